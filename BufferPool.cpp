@@ -0,0 +1,186 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#include <vector>
+#include <array>
+#include <mutex>
+#include <atomic>
+
+#include "BufferPool.h"
+
+#define POOL_CLASSES        10          // 1 KB, 2 KB, 4 KB ... 512 KB
+#define POOL_MIN_SHIFT      10
+#define POOL_OVERSIZE       0xff
+#define POOL_THREAD_CACHE   4           // Buffers per size class cached by each thread
+#define POOL_SHARED_BYTES   (4 << 20)   // Bytes per size class cached for all threads
+#define POOL_HEADER         16          // In front of each buffer, keeps the buffer aligned like new does
+
+typedef struct
+{
+    uint8_t nClass;
+    size_t  nCapacity;
+}BUFFERHEADER;
+static_assert(sizeof(BUFFERHEADER) <= POOL_HEADER, "BUFFERHEADER does not fit");
+
+typedef struct
+{
+    mutex                            mxCache;
+    array<vector<uint8_t*>, POOL_CLASSES> avCache;
+    atomic<uint64_t>                 nHits{0};
+    atomic<uint64_t>                 nMisses{0};
+    atomic<uint64_t>                 nOversize{0};
+    atomic<uint64_t>                 nFreed{0};
+}SHAREDPOOL;
+
+static SHAREDPOOL& GetSharedPool()
+{
+    static SHAREDPOOL* pPool = new SHAREDPOOL();    // Never destroyed, threads may return buffers until the process ends
+    return *pPool;
+}
+
+static BUFFERHEADER* GetHeader(const uint8_t* const pBuffer) noexcept
+{
+    return reinterpret_cast<BUFFERHEADER*>(const_cast<uint8_t*>(pBuffer) - POOL_HEADER);
+}
+
+static void FreeBuffer(uint8_t* const pBuffer) noexcept
+{
+    delete[] (pBuffer - POOL_HEADER);
+}
+
+static size_t SharedLimit(const uint8_t nClass) noexcept
+{
+    const size_t nLimit = POOL_SHARED_BYTES >> (POOL_MIN_SHIFT + nClass);
+    return nLimit < 4 ? 4 : nLimit;
+}
+
+// False once the cache of the thread is destroyed. A thread_local destroyed after it may still get or put buffers,
+// they go to the shared cache then. No destructor, so it can be read until the thread is gone.
+static thread_local bool s_bCacheAlive = true;
+
+class ThreadCache
+{
+public:
+    ~ThreadCache()      // Thread ends, the cached buffers go to the shared cache
+    {
+        s_bCacheAlive = false;
+        for (uint8_t nClass = 0; nClass < POOL_CLASSES; ++nClass)
+        {
+            for (size_t n = 0; n < m_anCount[nClass]; ++n)
+                PutShared(nClass, m_aapBuffer[nClass][n]);
+        }
+    }
+
+    uint8_t* Get(const uint8_t nClass) noexcept
+    {
+        return m_anCount[nClass] > 0 ? m_aapBuffer[nClass][--m_anCount[nClass]] : nullptr;
+    }
+
+    bool Put(const uint8_t nClass, uint8_t* const pBuffer) noexcept
+    {
+        if (m_anCount[nClass] == POOL_THREAD_CACHE)
+            return false;
+        m_aapBuffer[nClass][m_anCount[nClass]++] = pBuffer;
+        return true;
+    }
+
+    static void PutShared(const uint8_t nClass, uint8_t* const pBuffer) noexcept
+    {
+        SHAREDPOOL& Pool = GetSharedPool();
+        unique_lock<mutex> lock(Pool.mxCache);
+        if (Pool.avCache[nClass].size() < SharedLimit(nClass))
+        {
+            Pool.avCache[nClass].push_back(pBuffer);    // Capacity is reserved, does not throw
+            return;
+        }
+        lock.unlock();
+
+        Pool.nFreed.fetch_add(1, memory_order_relaxed);
+        FreeBuffer(pBuffer);
+    }
+
+private:
+    uint8_t* m_aapBuffer[POOL_CLASSES][POOL_THREAD_CACHE] = {};
+    size_t   m_anCount[POOL_CLASSES] = {};
+};
+
+static thread_local ThreadCache s_ThreadCache;
+
+uint8_t* BufferPool::Get(const size_t nSize)
+{
+    SHAREDPOOL& Pool = GetSharedPool();
+
+    uint8_t nClass = 0;
+    while (nClass < POOL_CLASSES && (static_cast<size_t>(1) << (POOL_MIN_SHIFT + nClass)) < nSize)
+        ++nClass;
+
+    if (nClass == POOL_CLASSES)
+    {
+        Pool.nOversize.fetch_add(1, memory_order_relaxed);
+        uint8_t* pBuffer = new uint8_t[POOL_HEADER + nSize] + POOL_HEADER;
+        *GetHeader(pBuffer) = BUFFERHEADER({ POOL_OVERSIZE, nSize });
+        return pBuffer;
+    }
+
+    uint8_t* pBuffer = s_bCacheAlive == true ? s_ThreadCache.Get(nClass) : nullptr;
+    if (pBuffer == nullptr)
+    {
+        lock_guard<mutex> lock(Pool.mxCache);
+        if (Pool.avCache[nClass].empty() == false)
+        {
+            pBuffer = Pool.avCache[nClass].back();
+            Pool.avCache[nClass].pop_back();
+        }
+        else if (Pool.avCache[nClass].capacity() == 0)
+            Pool.avCache[nClass].reserve(SharedLimit(nClass));
+    }
+
+    if (pBuffer != nullptr)
+    {
+        Pool.nHits.fetch_add(1, memory_order_relaxed);
+        return pBuffer;
+    }
+
+    Pool.nMisses.fetch_add(1, memory_order_relaxed);
+    const size_t nCapacity = static_cast<size_t>(1) << (POOL_MIN_SHIFT + nClass);
+    pBuffer = new uint8_t[POOL_HEADER + nCapacity] + POOL_HEADER;
+    *GetHeader(pBuffer) = BUFFERHEADER({ nClass, nCapacity });
+    return pBuffer;
+}
+
+void BufferPool::Put(uint8_t* const pBuffer) noexcept
+{
+    if (pBuffer == nullptr)
+        return;
+
+    const uint8_t nClass = GetHeader(pBuffer)->nClass;
+    if (nClass == POOL_OVERSIZE)
+        FreeBuffer(pBuffer);
+    else if (s_bCacheAlive == false || s_ThreadCache.Put(nClass, pBuffer) == false)
+        ThreadCache::PutShared(nClass, pBuffer);
+}
+
+size_t BufferPool::GetCapacity(const uint8_t* const pBuffer) noexcept
+{
+    return GetHeader(pBuffer)->nCapacity;
+}
+
+shared_ptr<uint8_t> BufferPool::GetShared(const size_t nSize)
+{
+    return shared_ptr<uint8_t>(Get(nSize), [](uint8_t* pBuffer) noexcept { Put(pBuffer); });
+}
+
+BufferPool::STATISTIC BufferPool::GetStatistic() noexcept
+{
+    const SHAREDPOOL& Pool = GetSharedPool();
+    return STATISTIC({ Pool.nHits.load(memory_order_relaxed), Pool.nMisses.load(memory_order_relaxed), Pool.nOversize.load(memory_order_relaxed), Pool.nFreed.load(memory_order_relaxed) });
+}
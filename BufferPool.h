@@ -0,0 +1,59 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+using namespace std;
+
+// Buffers in size classes from 1 KB to 512 KB. Released buffers are kept in a small cache of the
+// releasing thread, and if that is full, in a cache shared by all threads. Larger buffers are not cached.
+class BufferPool
+{
+public:
+    typedef struct
+    {
+        uint64_t nHits;         // Served from a cache
+        uint64_t nMisses;       // Newly allocated, the caches of the size class were empty
+        uint64_t nOversize;     // Larger than the biggest size class
+        uint64_t nFreed;        // Released to the heap, because the caches were full
+    }STATISTIC;
+
+    static uint8_t* Get(const size_t nSize);
+    static void Put(uint8_t* const pBuffer) noexcept;
+    static size_t GetCapacity(const uint8_t* const pBuffer) noexcept;   // Usable size, at least the size requested
+    static shared_ptr<uint8_t> GetShared(const size_t nSize);           // Goes back to the pool with the last reference
+    static STATISTIC GetStatistic() noexcept;
+};
+
+// Allocator for containers taking their memory from the BufferPool, e.g. vector<uint8_t, PoolAllocator<uint8_t>>
+template <typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator() noexcept = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(const size_t nCount) { return reinterpret_cast<T*>(BufferPool::Get(nCount * sizeof(T))); }
+    void deallocate(T* const pData, const size_t) noexcept { BufferPool::Put(reinterpret_cast<uint8_t*>(pData)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
@@ -32,6 +32,7 @@ extern void OutputDebugString(const wchar_t* pOut);
 extern void OutputDebugStringA(const char* pOut);
 static const std::vector<std::string> vEnvFilter{"USER=", "HOME="};
 #else
+#include <psapi.h>
 static const std::vector<std::string> vEnvFilter{"COMPUTERNAME=","HOMEDRIVE=","HOMEPATH=","USERNAME=","USERPROFILE=","SystemRoot=","TMP=","TEMP=","Path="};
 #endif
 
@@ -109,14 +110,89 @@ typedef struct {
     FCGI_EndRequestBody body;
 } FCGI_EndRequestRecord;
 
-FastCgiClient::FastCgiClient() noexcept : m_bConnected(false), m_cClosed(2), m_usResquestId(0), m_nCountCurRequest(0), m_hProcess(Null)
+#define FCGI_MAX_CONTENT 65528  // Largest content length of a record that needs no padding
+
+typedef vector<uint8_t, PoolAllocator<uint8_t>> POOLBUFFER;
+
+static void SetRecordHeader(FCGI_Header* const pHeader, const uint8_t nType, const uint16_t nRequestId, const uint16_t nContentLen) noexcept
+{
+    pHeader->version = 1;
+    pHeader->type = nType;
+    pHeader->requestIdB1 = (nRequestId >> 8) & 0xff;
+    pHeader->requestIdB0 = nRequestId & 0xff;
+    pHeader->contentLengthB1 = (nContentLen >> 8) & 0xff;
+    pHeader->contentLengthB0 = nContentLen & 0xff;
+    pHeader->paddingLength = (8 - (nContentLen % 8)) & 7;
+    pHeader->reserved = 0;
+}
+
+// Appends a stream (FCGI_PARAMS, FCGI_STDIN, ...) to a buffer, split into as many records as needed
+class RecordStream
+{
+public:
+    RecordStream(POOLBUFFER& vBuffer, const uint8_t nType, const uint16_t nRequestId) noexcept : m_vBuffer(vBuffer), m_nType(nType), m_nRequestId(nRequestId), m_nHeaderPos(SIZE_MAX), m_nRecords(0) {}
+
+    size_t GetRecords() const noexcept { return m_nRecords; }
+
+    void Write(const void* pData, size_t nLen)
+    {
+        const uint8_t* pSrc = static_cast<const uint8_t*>(pData);
+        while (nLen > 0)
+        {
+            if (m_nHeaderPos == SIZE_MAX)    // Start a new record
+            {
+                m_nHeaderPos = m_vBuffer.size();
+                m_vBuffer.resize(m_nHeaderPos + sizeof(FCGI_Header));
+            }
+
+            const size_t nContentLen = m_vBuffer.size() - m_nHeaderPos - sizeof(FCGI_Header);
+            const size_t nCopy = min(nLen, FCGI_MAX_CONTENT - nContentLen);
+            m_vBuffer.insert(end(m_vBuffer), pSrc, pSrc + nCopy);
+            pSrc += nCopy, nLen -= nCopy;
+
+            if (nContentLen + nCopy == FCGI_MAX_CONTENT)
+                Close();
+        }
+    }
+
+    void End()  // Closes the open record and appends the empty record marking the end of the stream
+    {
+        Close();
+        m_nHeaderPos = m_vBuffer.size();
+        m_vBuffer.resize(m_nHeaderPos + sizeof(FCGI_Header));
+        SetRecordHeader(reinterpret_cast<FCGI_Header*>(&m_vBuffer[m_nHeaderPos]), m_nType, m_nRequestId, 0);
+        m_nHeaderPos = SIZE_MAX;
+        ++m_nRecords;
+    }
+
+private:
+    void Close()
+    {
+        if (m_nHeaderPos == SIZE_MAX)
+            return;
+        const uint16_t nContentLen = static_cast<uint16_t>(m_vBuffer.size() - m_nHeaderPos - sizeof(FCGI_Header));
+        SetRecordHeader(reinterpret_cast<FCGI_Header*>(&m_vBuffer[m_nHeaderPos]), m_nType, m_nRequestId, nContentLen);
+        m_vBuffer.resize(m_vBuffer.size() + reinterpret_cast<FCGI_Header*>(&m_vBuffer[m_nHeaderPos])->paddingLength, 0);
+        m_nHeaderPos = SIZE_MAX;
+        ++m_nRecords;
+    }
+
+private:
+    POOLBUFFER&      m_vBuffer;
+    uint8_t          m_nType;
+    uint16_t         m_nRequestId;
+    size_t           m_nHeaderPos;    // Offset of the header of the open record, SIZE_MAX if none is open
+    size_t           m_nRecords;      // Records closed so far
+};
+
+FastCgiClient::FastCgiClient() noexcept : m_bConnected(false), m_cClosed(2), m_apReqPages{}, m_usResquestId(0), m_nCountCurRequest(0), m_hProcess(Null), m_tmStartTimeout(5000), m_tmStopTimeout(2000)
 {
     m_FCGI_MAX_CONNS  = UINT32_MAX;
     m_FCGI_MAX_REQS   = UINT32_MAX;
     m_FCGI_MPXS_CONNS = 0;
 }
 
-FastCgiClient::FastCgiClient(const wstring& strProcessPath) : m_bConnected(false), m_cClosed(2), m_usResquestId(0), m_nCountCurRequest(0), m_strProcessPath(strProcessPath), m_hProcess(Null)
+FastCgiClient::FastCgiClient(const wstring& strProcessPath) : m_bConnected(false), m_cClosed(2), m_apReqPages{}, m_usResquestId(0), m_nCountCurRequest(0), m_strProcessPath(strProcessPath), m_hProcess(Null), m_tmStartTimeout(5000), m_tmStopTimeout(2000)
 {
     m_FCGI_MAX_CONNS = UINT32_MAX;
     m_FCGI_MAX_REQS = UINT32_MAX;
@@ -125,17 +201,29 @@ FastCgiClient::FastCgiClient(const wstring& strProcessPath) : m_bConnected(false
     StartFcgiProcess();
 }
 
-FastCgiClient::FastCgiClient(FastCgiClient&& src) noexcept : m_bConnected(false), m_cClosed(2), m_usResquestId(0), m_nCountCurRequest(0), m_hProcess(Null)
+FastCgiClient::FastCgiClient(const wstring& strProcessPath, const shared_ptr<FastCgiListenSocket>& spListenSocket) : FastCgiClient()
+{
+    m_strProcessPath = strProcessPath;
+    m_spListenSocket = spListenSocket;
+
+    StartFcgiProcess();
+}
+
+FastCgiClient::FastCgiClient(FastCgiClient&& src) noexcept : m_bConnected(false), m_cClosed(2), m_apReqPages{}, m_usResquestId(0), m_nCountCurRequest(0), m_hProcess(Null), m_tmStartTimeout(5000), m_tmStopTimeout(2000)
 {
     swap(m_pSocket, src.m_pSocket);
     swap(m_usResquestId, src.m_usResquestId);
-    swap(m_lstRequest, src.m_lstRequest);
+    swap(m_quFreeIds, src.m_quFreeIds);
+    for (size_t n = 0; n < m_apReqPages.size(); ++n)
+        m_apReqPages[n] = src.m_apReqPages[n].exchange(m_apReqPages[n]);
 
     swap(m_nCountCurRequest, src.m_nCountCurRequest);
 
     swap(m_bConnected, src.m_bConnected);
     //swap(m_cClosed, src.m_cClosed);
-    swap(m_strRecBuf, src.m_strRecBuf);
+    swap(m_Parser, src.m_Parser);
+    swap(m_spMetrics, src.m_spMetrics);
+    swap(m_spTracer, src.m_spTracer);
 
     swap(m_FCGI_MAX_CONNS, src.m_FCGI_MAX_CONNS);
     swap(m_FCGI_MAX_REQS, src.m_FCGI_MAX_REQS);
@@ -143,6 +231,10 @@ FastCgiClient::FastCgiClient(FastCgiClient&& src) noexcept : m_bConnected(false)
 
     swap(m_strProcessPath, src.m_strProcessPath);
     swap(m_hProcess, src.m_hProcess);
+    swap(m_spProcessExit, src.m_spProcessExit);
+    swap(m_spListenSocket, src.m_spListenSocket);
+    swap(m_tmStartTimeout, src.m_tmStartTimeout);
+    swap(m_tmStopTimeout, src.m_tmStopTimeout);
 }
 
 FastCgiClient::~FastCgiClient() noexcept
@@ -151,9 +243,9 @@ FastCgiClient::~FastCgiClient() noexcept
     {
         if (m_cClosed == 0)
         {
-            m_pSocket->BindFuncBytesReceived(static_cast<function<void(TcpSocket* const)>>(nullptr));
-            m_pSocket->BindErrorFunction(static_cast<function<void(BaseSocket* const)>>(nullptr));
-            m_pSocket->BindCloseFunction(static_cast<function<void(BaseSocket* const)>>(nullptr));
+            m_pSocket->BindFuncBytesReceived(nullptr);
+            m_pSocket->BindErrorFunction(nullptr);
+            m_pSocket->BindCloseFunction(nullptr);
             m_pSocket->Close();
             m_pSocket.reset();
         }
@@ -163,30 +255,56 @@ FastCgiClient::~FastCgiClient() noexcept
     {
 #if defined(_WIN32) || defined(_WIN64)
         TerminateProcess(m_hProcess, 0);
+        WaitForProcessExit(m_tmStopTimeout);
         CloseHandle(m_hProcess);
 #else
-        kill(m_hProcess, SIGTERM);
-        sleep(2);   // The process has 2 sec. to shut down until we kill him hard
-        kill(m_hProcess, SIGKILL);
+        if (WaitForProcessExit(chrono::milliseconds(0)) == false)   // Its pid may be used again, once the process is collected
+        {
+            kill(m_hProcess, SIGTERM);
+            if (WaitForProcessExit(m_tmStopTimeout) == false)   // Returns as soon as the process is gone, otherwise we kill him hard
+            {
+                kill(m_hProcess, SIGKILL);
+                WaitForProcessExit(chrono::milliseconds(500));
+            }
+        }
 #endif
     }
+
+    for (auto& pPage : m_apReqPages)
+        delete[] pPage.load();
 }
 
 uint32_t FastCgiClient::Connect(const string strIpServer, uint16_t usPort, bool bSecondConnection/* = false*/)
+{
+    uint32_t nRet = ConnectOnce(strIpServer, usPort, bSecondConnection);
+
+    // A process we started may not listen yet, it is probed with growing pauses until it answers or exits
+    const auto tmEnd = chrono::steady_clock::now() + m_tmStartTimeout;
+    for (chrono::milliseconds tmPause(5); nRet != 1 && m_hProcess != Null && chrono::steady_clock::now() < tmEnd; tmPause = min(tmPause * 2, chrono::milliseconds(250)))
+    {
+        if (WaitForProcessExit(tmPause) == true)    // The pause, it ends early if the process is gone
+            break;
+        nRet = ConnectOnce(strIpServer, usPort, bSecondConnection);
+    }
+
+    return nRet;
+}
+
+uint32_t FastCgiClient::ConnectOnce(const string& strIpServer, const uint16_t usPort, const bool bSecondConnection)
 {
     while ((m_cClosed & 2) != 2)
         this_thread::sleep_for(chrono::milliseconds(10));
 
-    m_pSocket = make_unique<TcpSocket>();
+    m_pSocket = FastCgiStream::Create(strIpServer);
 
-    m_pSocket->BindFuncConEstablished(static_cast<function<void(TcpSocket* const)>>(bind(&FastCgiClient::Connected, this, _1)));
-    m_pSocket->BindFuncBytesReceived(static_cast<function<void(TcpSocket* const)>>(bind(&FastCgiClient::DatenEmpfangen, this, _1)));
-    m_pSocket->BindErrorFunction(static_cast<function<void(BaseSocket* const)>>(bind(&FastCgiClient::SocketError, this, _1)));
-    m_pSocket->BindCloseFunction(static_cast<function<void(BaseSocket* const)>>(bind(&FastCgiClient::SocketClosing, this, _1)));
+    m_pSocket->BindFuncConEstablished(bind(&FastCgiClient::Connected, this, _1));
+    m_pSocket->BindFuncBytesReceived(bind(&FastCgiClient::DatenEmpfangen, this, _1));
+    m_pSocket->BindErrorFunction(bind(&FastCgiClient::SocketError, this, _1));
+    m_pSocket->BindCloseFunction(bind(&FastCgiClient::SocketClosing, this, _1));
 
     m_bConnected = false;
 
-    if (m_pSocket->Connect(strIpServer.c_str(), usPort) == true)
+    if (m_pSocket->Connect(strIpServer, usPort) == true)
     {
         mutex mxConnected;
         unique_lock<mutex> lock(mxConnected);
@@ -197,7 +315,7 @@ uint32_t FastCgiClient::Connect(const string strIpServer, uint16_t usPort, bool
         {
             m_bConnected = false;
 
-            basic_string<uint8_t> qBuf(128, 0);
+            uint8_t qBuf[128] = { 0 };
 
             FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&qBuf[0]);
             pHeader->version = 1;
@@ -217,6 +335,8 @@ uint32_t FastCgiClient::Connect(const string strIpServer, uint16_t usPort, bool
             pHeader->paddingLength = (8 - (nContentLen % 8)) & 7;
 
             m_pSocket->Write(&qBuf[0], sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength);
+            if (m_spMetrics != nullptr)
+                m_spMetrics->RecordOut(FCGI_GET_VALUES, nContentLen);
 
             // wait until the answer is here
             if (m_cvConnected.wait_for(lock, chrono::milliseconds(500), [&]() noexcept { return m_bConnected; }) == false)   // Timeout
@@ -224,7 +344,7 @@ uint32_t FastCgiClient::Connect(const string strIpServer, uint16_t usPort, bool
 
             m_pSocket->Close();
 
-            return Connect(strIpServer, usPort, true);
+            return ConnectOnce(strIpServer, usPort, true);
         }
 
         return m_pSocket->GetErrorNo() == 0 ? 1 : 0;
@@ -233,148 +353,136 @@ uint32_t FastCgiClient::Connect(const string strIpServer, uint16_t usPort, bool
     return 0;
 }
 
-void FastCgiClient::Connected(TcpSocket* const /*pTcpSocket*/) noexcept
+void FastCgiClient::Connected(FastCgiStream* const /*pStream*/) noexcept
 {
     m_cClosed = 0;
     m_bConnected = true;
     m_cvConnected.notify_all();
 }
 
-void FastCgiClient::DatenEmpfangen(TcpSocket* const pTcpSocket)
+void FastCgiClient::DatenEmpfangen(FastCgiStream* const pStream)
 {
-    size_t nAvailable = pTcpSocket->GetBytesAvailable();
+    const size_t nAvailable = pStream->GetBytesAvailable();
 
     if (nAvailable == 0)
     {
-        pTcpSocket->Close();
+        pStream->Close();
         return;
     }
 
-    auto spBuffer = make_unique<uint8_t[]>(nAvailable + 1 + m_strRecBuf.size());
-    if (m_strRecBuf.size() > 0)
-        copy(begin(m_strRecBuf), end(m_strRecBuf), &spBuffer[0]);
-
-    size_t nRead = pTcpSocket->Read(&spBuffer[m_strRecBuf.size()], nAvailable);
+    // Records the stream keeps in memory of its own (shm) are parsed where they are, the others are read into the parser
+    size_t nReceived = 0;
+    uint8_t* const pReceived = pStream->PeekReceived(nReceived);
+    if (pReceived == nullptr)
+    {
+        const size_t nRead = pStream->Read(m_Parser.GetWriteBuffer(nAvailable), nAvailable);
+        m_Parser.Commit(nRead);
+    }
 
-    if (nRead > 0)
+    const auto fnRecord = [&](const uint8_t nType, const uint16_t nRequestId, uint8_t* pContent, const uint16_t nContentLen) -> bool
     {
-        nRead += m_strRecBuf.size();
-        m_strRecBuf.clear();
-        nAvailable = nRead;  // Merken
+        if (m_spMetrics != nullptr)
+            m_spMetrics->RecordIn(nType, nContentLen);
 
-        FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&spBuffer[0]);
-        while (nRead >= sizeof(FCGI_Header) && pHeader->version == 1)
+        if (nType == FCGI_GET_VALUES_RESULT && nRequestId == 0)
         {
-            const uint16_t nRequestId = ToShort(&pHeader->requestIdB1);
-            m_mxReqList.lock();
-            auto itReqParam = m_lstRequest.find(nRequestId);
-            m_mxReqList.unlock();
-
-            if (pHeader->type == FCGI_GET_VALUES_RESULT && nRequestId == 0)
+            const uint8_t* pParam = pContent;
+            const char* pKey, *pValue;
+            uint32_t nKeyLen, nValueLen;
+            while (NextNameValuePair(&pParam, pContent + nContentLen, &pKey, nKeyLen, &pValue, nValueLen) == true)
             {
-                uint16_t nContentLen = ToShort(&pHeader->contentLengthB1);
-                uint8_t* pContent = &spBuffer[sizeof(FCGI_Header)];
-
-                if (sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength > nRead)
-                    break;
-
-                nRead -= sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength;
-
-                while (nContentLen != 0)
+                const string strVarName(pKey, nKeyLen), strVarValue(pValue, nValueLen);
+                try
                 {
-                    const uint32_t nVarNameLen = ToNumber(&pContent, nContentLen);
-                    const uint32_t nVarValueLen = ToNumber(&pContent, nContentLen);
-                    string strVarName, strVarValue;
-                    if (nVarNameLen > 0)
-                        strVarName = string(reinterpret_cast<char*>(pContent), nVarNameLen), pContent += nVarNameLen, nContentLen -= static_cast<uint16_t>(nVarNameLen);
-                    if (nVarValueLen > 0)
-                        strVarValue = string(reinterpret_cast<char*>(pContent), nVarValueLen), pContent += nVarValueLen, nContentLen -= static_cast<uint16_t>(nVarValueLen);
-
-                    try
-                    {
-                        if (strVarName == FCGI_MAX_CONNS)
-                            m_FCGI_MAX_CONNS = stoul(strVarValue);
-                        if (strVarName == FCGI_MAX_REQS)
-                            m_FCGI_MAX_REQS = stoul(strVarValue);
-                        if (strVarName == FCGI_MPXS_CONNS)
-                            m_FCGI_MPXS_CONNS = stoul(strVarValue);
-                    }
-                    catch (const std::exception& /*ex*/)
-                    {   // In case of wrong digit strings we leave de default settings
-                    }
+                    if (strVarName == FCGI_MAX_CONNS)
+                        m_FCGI_MAX_CONNS = stoul(strVarValue);
+                    if (strVarName == FCGI_MAX_REQS)
+                        m_FCGI_MAX_REQS = stoul(strVarValue);
+                    if (strVarName == FCGI_MPXS_CONNS)
+                        m_FCGI_MPXS_CONNS = stoul(strVarValue);
+                }
+                catch (const std::exception& /*ex*/)
+                {   // In case of wrong digit strings we leave de default settings
                 }
-
-                pHeader = reinterpret_cast<FCGI_Header*>(&pContent[pHeader->paddingLength]);
-
-                m_bConnected = true;
-                m_cvConnected.notify_all();
             }
-            else if ((pHeader->type == FCGI_STDOUT || pHeader->type == FCGI_STDERR) && nRequestId != 0)
-            {
-                const uint16_t nContentLen = ToShort(&pHeader->contentLengthB1);
-                unsigned char* pContent = reinterpret_cast<unsigned char*>(pHeader) + sizeof(FCGI_Header);
 
-                if (sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength > nRead)
-                    break;
-
-                if (nContentLen > 0 && itReqParam != end(m_lstRequest) && itReqParam->second.bIsAbort == false)
+            m_bConnected = true;
+            m_cvConnected.notify_all();
+        }
+        else if ((nType == FCGI_STDOUT || nType == FCGI_STDERR) && nRequestId != 0)
+        {
+            // Pinned, if another thread releases the request meanwhile, it waits until we are done with it
+            REQSLOT* pSlot = PinRequest(nRequestId);
+            if (nContentLen > 0 && pSlot != nullptr && pSlot->bAborted.load(memory_order_relaxed) == false)
+            {
+                if (nType == FCGI_STDOUT && pSlot->Request.bHaveOutput == false)
                 {
-                    if (pHeader->type == FCGI_STDOUT)
-                        itReqParam->second.fnDataOutput(nRequestId, pContent, nContentLen, itReqParam->second.vpCbParam);
-                    else
-                        itReqParam->second.strRecBuf = string(reinterpret_cast<char*>(pContent), nContentLen);
+                    pSlot->Request.bHaveOutput = true;
+                    if (m_spMetrics != nullptr)
+                        m_spMetrics->Observe(FastCgiMetrics::TIME_TO_FIRST_BYTE, chrono::steady_clock::now() - pSlot->Request.tmStart);
+                    if (m_spTracer != nullptr)
+                        m_spTracer->Event(this, nRequestId, FastCgiTracer::CLIENT_FIRST_STDOUT);
                 }
 
-                nRead -= sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength;
-                pHeader = reinterpret_cast<FCGI_Header*>(&pContent[nContentLen + pHeader->paddingLength]);
+                if (nType == FCGI_STDOUT)
+                    pSlot->Request.fnDataOutput(nRequestId, pContent, nContentLen, pSlot->Request.vpCbParam);
+                else if (pSlot->Request.fnComplete != nullptr)
+                    pSlot->Request.strRecBuf.append(reinterpret_cast<char*>(pContent), nContentLen);
+                else
+                    pSlot->Request.strRecBuf = string(reinterpret_cast<char*>(pContent), nContentLen);
             }
-            else if(pHeader->type == FCGI_END_REQUEST && nRequestId != 0)
+            UnpinRequest();
+        }
+        else if (nType == FCGI_END_REQUEST && nRequestId != 0)
+        {
+            m_mxReqList.lock();
+            if (FindRequest(nRequestId) != nullptr)
             {
-                if (sizeof(FCGI_EndRequestRecord) + pHeader->paddingLength > nRead)
-                    break;
-                FCGI_EndRequestRecord* pRecord = reinterpret_cast<FCGI_EndRequestRecord*>(pHeader);
-                //uint16_t nContentLen = ToShort(&pRecord->header.contentLengthB1);
-
-                nRead -= sizeof(FCGI_EndRequestRecord) + pHeader->paddingLength;
-                pHeader = reinterpret_cast<FCGI_Header*>(pRecord + sizeof(FCGI_EndRequestRecord) + pHeader->paddingLength);
-
-                m_mxReqList.lock();
-                itReqParam = m_lstRequest.find(nRequestId);
-                if (itReqParam != end(m_lstRequest))
-                {
-                    if (itReqParam->second.strRecBuf.empty() == false)
-                        itReqParam->second.fnDataOutput(nRequestId, reinterpret_cast<unsigned char*>(&itReqParam->second.strRecBuf[0]), static_cast<uint16_t>(itReqParam->second.strRecBuf.size()), itReqParam->second.vpCbParam);
-
-                    if (itReqParam->second.pbReqEnde != nullptr)
-                        *itReqParam->second.pbReqEnde = true;
-                    if (itReqParam->second.pcvReqEnd != nullptr)
-                        itReqParam->second.pcvReqEnd->notify_all();
-
-                    if (itReqParam->second.bIsAbort == false && m_nCountCurRequest >= 1)
-                        m_nCountCurRequest--;
-                    m_lstRequest.erase(itReqParam);
-                }
+                REQPARAM Request{};
+                FreeRequest(nRequestId, &Request);
                 m_mxReqList.unlock();
+
+                // Without the lock, the callbacks may send the next request
+                const FCGI_EndRequestBody* pBody = reinterpret_cast<FCGI_EndRequestBody*>(pContent);
+                if (nContentLen >= sizeof(FCGI_EndRequestBody))
+                    EndRequest(nRequestId, Request, (pBody->appStatusB3 << 24) | (pBody->appStatusB2 << 16) | (pBody->appStatusB1 << 8) | pBody->appStatusB0, pBody->protocolStatus, true);
+                else
+                    EndRequest(nRequestId, Request, 0, FCGI_REQUEST_COMPLETE, true);
             }
             else
             {
-                OutputDebugStringA(string("Record Typ = " + to_string(static_cast<int>(pHeader->type)) + " empfangen\r\n").c_str());
-                break;
+                if (IsRemoved(nRequestId) == true)  // Now the id may be used again
+                    ReleaseRequestId(nRequestId);
+                m_mxReqList.unlock();
             }
         }
+        else
+            OutputDebugStringA(string("Record Typ = " + to_string(static_cast<int>(nType)) + " empfangen\r\n").c_str());
+
+        return true;
+    };
 
-        if (nRead > 0)
-            m_strRecBuf = string(reinterpret_cast<char*>(&spBuffer[nAvailable - nRead]), nRead);
+    bool bValid;
+    if (pReceived != nullptr)   // The output callbacks got the data, nothing is held
+    {
+        size_t nParsed;
+        bValid = RecordParser::ParseRecords(pReceived, nReceived, nParsed, fnRecord);
+        pStream->ConsumeReceived(nParsed);
     }
+    else
+        bValid = m_Parser.Parse(fnRecord);
+
+    if (bValid == false)    // Not a FastCGI stream
+        pStream->Close();
 }
 
-void FastCgiClient::SocketError(BaseSocket* const pBaseSocket)
+void FastCgiClient::SocketError(FastCgiStream* const pStream)
 {
     m_cClosed = 1;
-    pBaseSocket->Close();
+    pStream->Close();
 }
 
-void FastCgiClient::SocketClosing(BaseSocket* const pBaseSocket)
+void FastCgiClient::SocketClosing(FastCgiStream* const pStream)
 {
     if (m_bConnected == false)
     {
@@ -382,29 +490,39 @@ void FastCgiClient::SocketClosing(BaseSocket* const pBaseSocket)
         m_cvConnected.notify_all();
     }
 
-    if (m_pSocket.get() == pBaseSocket && reinterpret_cast<TcpSocket*>(pBaseSocket)->GetBytesAvailable() > 0)
-        DatenEmpfangen(reinterpret_cast<TcpSocket*>(pBaseSocket));
+    if (m_pSocket.get() == pStream && pStream->GetBytesAvailable() > 0)
+        DatenEmpfangen(pStream);
 
+    ClearRequests(true);
     m_mxReqList.lock();
-    for (REQLIST::iterator iter = begin(m_lstRequest); iter != end(m_lstRequest); ++iter)
-    {
-        if (iter->second.strRecBuf.empty() == false)
-            iter->second.fnDataOutput(iter->first, reinterpret_cast<unsigned char*>(&iter->second.strRecBuf[0]), static_cast<uint16_t>(iter->second.strRecBuf.size()), iter->second.vpCbParam);
-
-        if (iter->second.pbReqEnde != nullptr)
-            *iter->second.pbReqEnde = true;
-        if (iter->second.pcvReqEnd != nullptr)
-            iter->second.pcvReqEnd->notify_all();
-    }
-    m_lstRequest.clear();
-    m_nCountCurRequest = 0;
-    m_strRecBuf.clear();
+    m_Parser.Reset();
     m_mxReqList.unlock();
 
     m_cClosed |= 2;
 }
 
 uint16_t FastCgiClient::SendRequest(vector<pair<string, string>>& vCgiParam, condition_variable* pcvReqEnd, bool* pbReqEnde, FN_OUTPUT fnDataOutput, void* vpCbParam/* = nullptr*/)
+{
+    return SendRequest(nullptr, vCgiParam, REQPARAM({ fnDataOutput, vpCbParam, pcvReqEnd, pbReqEnde, "", false, nullptr, chrono::steady_clock::time_point(), false }));
+}
+
+// Does not block, fnComplete is called from the receiving thread when the request is done
+uint16_t FastCgiClient::SendRequest(vector<pair<string, string>>& vCgiParam, FN_OUTPUT fnDataOutput, FN_COMPLETE fnComplete, void* vpCbParam/* = nullptr*/)
+{
+    return SendRequest(nullptr, vCgiParam, REQPARAM({ fnDataOutput, vpCbParam, nullptr, nullptr, "", false, fnComplete, chrono::steady_clock::time_point(), false }));
+}
+
+uint16_t FastCgiClient::SendRequest(const FastCgiParamBlock& StaticParams, vector<pair<string, string>>& vCgiParam, condition_variable* pcvReqEnd, bool* pbReqEnde, FN_OUTPUT fnDataOutput, void* vpCbParam/* = nullptr*/)
+{
+    return SendRequest(&StaticParams, vCgiParam, REQPARAM({ fnDataOutput, vpCbParam, pcvReqEnd, pbReqEnde, "", false, nullptr, chrono::steady_clock::time_point(), false }));
+}
+
+uint16_t FastCgiClient::SendRequest(const FastCgiParamBlock& StaticParams, vector<pair<string, string>>& vCgiParam, FN_OUTPUT fnDataOutput, FN_COMPLETE fnComplete, void* vpCbParam/* = nullptr*/)
+{
+    return SendRequest(&StaticParams, vCgiParam, REQPARAM({ fnDataOutput, vpCbParam, nullptr, nullptr, "", false, fnComplete, chrono::steady_clock::time_point(), false }));
+}
+
+uint16_t FastCgiClient::SendRequest(const FastCgiParamBlock* const pStaticParams, vector<pair<string, string>>& vCgiParam, REQPARAM&& Request)
 {
     m_mxReqList.lock();
     if (IsConnected() == false || m_nCountCurRequest >= m_FCGI_MAX_REQS)
@@ -413,130 +531,293 @@ uint16_t FastCgiClient::SendRequest(vector<pair<string, string>>& vCgiParam, con
         return 0;
     }
 
-    if (m_FCGI_MPXS_CONNS == 0 && m_lstRequest.size() > 0)
+    if (m_FCGI_MPXS_CONNS == 0 && GetActiveRequests() > 0)
     {
         m_mxReqList.unlock();
         return 0;
     }
 
+    const chrono::steady_clock::time_point tmStart = chrono::steady_clock::now();
+    Request.tmStart = tmStart;
+    const uint16_t nRetValue = AddRequest(move(Request));
+    if (nRetValue == 0) // All request ids are in use
+    {
+        m_mxReqList.unlock();
+        return 0;
+    }
     ++m_nCountCurRequest;
-    if (m_usResquestId > 65530)
-        m_usResquestId = 0;
-    ++m_usResquestId;
-
-    m_lstRequest.emplace(m_usResquestId, REQPARAM({ fnDataOutput, vpCbParam, pcvReqEnd, pbReqEnde, "", false }));
-    const uint16_t nRetValue = m_usResquestId;
     m_mxReqList.unlock();
 
-    auto uqBuf = make_unique<uint8_t[]>(16384);
+    if (m_spMetrics != nullptr)
+    {
+        m_spMetrics->Add(FastCgiMetrics::REQUESTS_STARTED);
+        m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, 1);
+    }
+    if (m_spTracer != nullptr)
+        m_spTracer->Event(this, nRetValue, FastCgiTracer::CLIENT_SEND_REQUEST, tmStart);
+
+    size_t nParamLen = pStaticParams != nullptr ? pStaticParams->size() : 0;
+    for (auto& item : vCgiParam)
+        nParamLen += (item.first.size() < 128 ? 1 : 4) + (item.second.size() < 128 ? 1 : 4) + item.first.size() + item.second.size();
 
-    // Start Record senden
-    FCGI_BeginRequestRecord* pRecord = reinterpret_cast<FCGI_BeginRequestRecord*>(&uqBuf[0]);
-    pRecord->header.version = 1;
-    pRecord->header.type = FCGI_BEGIN_REQUEST;
-    FromShort(&pRecord->header.requestIdB1, nRetValue);
-    FromShort(&pRecord->header.contentLengthB1, sizeof(FCGI_BeginRequestBody));
-    pRecord->header.paddingLength = 0;
-    pRecord->header.reserved = 0;
+    // BEGIN_REQUEST, the PARAMS records and the empty PARAMS record are sent with one write
+    POOLBUFFER vBuffer;
+    vBuffer.reserve(sizeof(FCGI_BeginRequestRecord) + nParamLen + (nParamLen / FCGI_MAX_CONTENT + 2) * (sizeof(FCGI_Header) + 8));
+    vBuffer.resize(sizeof(FCGI_BeginRequestRecord), 0);
 
+    // Start Record
+    FCGI_BeginRequestRecord* pRecord = reinterpret_cast<FCGI_BeginRequestRecord*>(&vBuffer[0]);
+    SetRecordHeader(&pRecord->header, FCGI_BEGIN_REQUEST, nRetValue, sizeof(FCGI_BeginRequestBody));
     FromShort(&pRecord->body.roleB1, FCGI_RESPONDER);
     pRecord->body.flags = FCGI_KEEP_CONN;
 
-    m_pSocket->Write(pRecord, sizeof(FCGI_BeginRequestRecord));
-
-    // Header Record senden
-    FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&uqBuf[0]);
-    pHeader->type = FCGI_PARAMS;
+    // Header Records
+    const size_t nParamRecords = EncodeParams(vBuffer, nRetValue, pStaticParams, vCgiParam);
 
-    unsigned char* pContent = &uqBuf[sizeof(FCGI_Header)];
-    uint16_t nContentLen = 0;
+    m_pSocket->Write(&vBuffer[0], vBuffer.size());
 
-    for (auto& item : vCgiParam)
+    if (m_spMetrics != nullptr)
     {
-        nContentLen += AddNameValuePair(&pContent, item.first.c_str(), item.first.size(), item.second.c_str(), item.second.size());
-        if (nContentLen > 16300)
-        {
-            break;
-        }
+        m_spMetrics->RecordOut(FCGI_BEGIN_REQUEST, sizeof(FCGI_BeginRequestBody));
+        m_spMetrics->RecordOut(FCGI_PARAMS, nParamLen, nParamRecords);
     }
-
-    FromShort(&pHeader->contentLengthB1, nContentLen);
-    pHeader->paddingLength = (8 - (nContentLen % 8)) & 7;
-    std::fill_n(pContent, pHeader->paddingLength, 0);
-    m_pSocket->Write(pHeader, sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength);
-
-    // End of Header Record senden
-    FromShort(&pHeader->contentLengthB1, 0);
-    pHeader->paddingLength = 0;
-    m_pSocket->Write(pHeader, sizeof(FCGI_Header));
+    if (m_spTracer != nullptr)
+        m_spTracer->Event(this, nRetValue, FastCgiTracer::CLIENT_PARAMS_SENT);
 
     return nRetValue;
 }
 
+// Each record is one write, header, data and padding go out with one Writev. The data is not copied into a
+// buffer of our own, the POSIX streams send it from where it is, the SocketLib copies it once into its send queue.
 void FastCgiClient::SendRequestData(const uint16_t nRequestId, const char* szBuffer, const uint32_t nBufLen)
 {
-    uint32_t nMaxLen = min(nBufLen, static_cast<uint32_t>(0x7fff));
-    auto uqBuf = make_unique<uint8_t[]>(nMaxLen + sizeof(FCGI_Header) + 8);
+    static const uint8_t caPadding[8] = { 0 };
 
-    // Start Record senden
-    FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&uqBuf[0]);
-    pHeader->version = 1;
-    pHeader->type = FCGI_STDIN;
-    FromShort(&pHeader->requestIdB1, nRequestId);
-    pHeader->paddingLength = 0;
-    pHeader->reserved = 0;
-
-    if (nBufLen == 0)   // Data end
+    if (nBufLen <= 4096)    // A small block is cheaper copied and written once, as well as the data end record
     {
-        FromShort(&pHeader->contentLengthB1, static_cast<uint16_t>(0));
-        m_pSocket->Write(&uqBuf[0], sizeof(FCGI_Header));
+        uint8_t caBuffer[sizeof(FCGI_Header) + 4096 + 8];
+        FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(caBuffer);
+        SetRecordHeader(pHeader, FCGI_STDIN, nRequestId, static_cast<uint16_t>(nBufLen));
+        copy_n(szBuffer, nBufLen, &caBuffer[sizeof(FCGI_Header)]);
+        fill_n(&caBuffer[sizeof(FCGI_Header) + nBufLen], pHeader->paddingLength, 0);
+
+        m_pSocket->Write(caBuffer, sizeof(FCGI_Header) + nBufLen + pHeader->paddingLength);
+
+        if (m_spMetrics != nullptr)
+            m_spMetrics->RecordOut(FCGI_STDIN, nBufLen);
         return;
     }
 
-    char* pDataContent = reinterpret_cast<char*>(&uqBuf[sizeof(FCGI_Header)]);
+    FCGI_Header Header;
     uint32_t nOffset = 0;
+    uint64_t nRecords = 0;
     while (nBufLen > nOffset)
     {
-        nMaxLen = min(nMaxLen, nBufLen - nOffset);
-        copy(szBuffer + nOffset, szBuffer + nOffset + nMaxLen, pDataContent);
-        FromShort(&pHeader->contentLengthB1, static_cast<uint16_t>(nMaxLen));
-        pHeader->paddingLength = (8 - (nMaxLen % 8)) & 7;
-        std::fill_n(pDataContent + nMaxLen, pHeader->paddingLength, 0);
-        m_pSocket->Write(&uqBuf[0], sizeof(FCGI_Header) + nMaxLen + pHeader->paddingLength);
-        nOffset += nMaxLen;
+        const uint16_t nLen = static_cast<uint16_t>(min(nBufLen - nOffset, static_cast<uint32_t>(UINT16_MAX)));
+        SetRecordHeader(&Header, FCGI_STDIN, nRequestId, nLen);
+        const iovec astRecord[3] = { { &Header, sizeof(FCGI_Header) }, { const_cast<char*>(szBuffer + nOffset), nLen }, { const_cast<uint8_t*>(caPadding), Header.paddingLength } };
+        m_pSocket->Writev(astRecord, 3);
+        nOffset += nLen;
+        ++nRecords;
     }
+
+    if (m_spMetrics != nullptr)
+        m_spMetrics->RecordOut(FCGI_STDIN, nBufLen, nRecords);
 }
 
+void FastCgiClient::SendRequestData(const uint16_t nRequestId, const shared_ptr<const char> spBuffer, const uint32_t nBufLen)
+{
+    SendRequestData(nRequestId, spBuffer.get(), nBufLen);
+}   // Our share goes here, the data is written
+
 bool FastCgiClient::AbortRequest(uint16_t nRequestId)
 {
-    string caBuffer(sizeof(FCGI_Header), 0);
     // Header Record senden
-    FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&caBuffer[0]);
-    pHeader->version = 1;
-    pHeader->type = FCGI_ABORT_REQUEST;
-    FromShort(&pHeader->contentLengthB1, 0);
-    FromShort(&pHeader->requestIdB1, nRequestId);
-    pHeader->paddingLength = 0;
-    pHeader->reserved = 0;
+    FCGI_Header Header;
+    SetRecordHeader(&Header, FCGI_ABORT_REQUEST, nRequestId, 0);
 
-    m_pSocket->Write(pHeader, sizeof(FCGI_Header));
+    m_pSocket->Write(&Header, sizeof(FCGI_Header));
+    if (m_spMetrics != nullptr)
+        m_spMetrics->RecordOut(FCGI_ABORT_REQUEST, 0);
 
     m_mxReqList.lock();
-    const auto itReqParam = m_lstRequest.find(nRequestId);
-    if (itReqParam != end(m_lstRequest))
-        itReqParam->second.bIsAbort = true;
+    REQSLOT* pSlot = FindRequest(nRequestId);
+    if (pSlot != nullptr)
+        pSlot->bAborted = true;
     m_mxReqList.unlock();
 
     return true;
 }
 
+// No callback of the request is running or called anymore, when it returns. Except it is called from one of them.
 void FastCgiClient::RemoveRequest(uint16_t nRequestId)
 {
     m_mxReqList.lock();
-    const auto itReqParam = m_lstRequest.find(nRequestId);
-    if (itReqParam != end(m_lstRequest))
-        m_lstRequest.erase(itReqParam);
+    const bool bFound = FindRequest(nRequestId) != nullptr;
+    if (bFound == true)
+        FreeRequest(nRequestId, nullptr, true);
+    m_mxReqList.unlock();
+
+    if (bFound == true && m_spMetrics != nullptr)  // Ends without an answer
+    {
+        m_spMetrics->Add(FastCgiMetrics::REQUESTS_ABORTED);
+        m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
+    }
+}
+
+FastCgiClient::REQSLOT* FastCgiClient::FindRequest(const uint16_t nRequestId) const noexcept
+{
+    REQSLOT* pPage = m_apReqPages[nRequestId >> 8].load(memory_order_acquire);
+    if (pPage == nullptr || pPage[nRequestId & 0xff].bActive.load(memory_order_acquire) == false)
+        return nullptr;
+    return &pPage[nRequestId & 0xff];
+}
+
+// Like FindRequest, for the receive thread. Until UnpinRequest the request is not released by another thread.
+FastCgiClient::REQSLOT* FastCgiClient::PinRequest(const uint16_t nRequestId) noexcept
+{
+    m_idReceiver.store(this_thread::get_id(), memory_order_relaxed);
+    m_nPinned.store(nRequestId);    // seq_cst, FreeRequest clears bActive and then looks at m_nPinned, one of us sees the other
+
+    REQSLOT* pPage = m_apReqPages[nRequestId >> 8].load(memory_order_acquire);
+    if (pPage == nullptr || pPage[nRequestId & 0xff].bActive.load() == false)
+        return nullptr;
+    return &pPage[nRequestId & 0xff];
+}
+
+void FastCgiClient::UnpinRequest()
+{
+    m_nPinned.store(0);
+    if (m_nPinWaiters.load() > 0)
+    {
+        lock_guard<mutex> lock(m_mxPin);
+        m_cvPin.notify_all();
+    }
+}
+
+uint16_t FastCgiClient::AddRequest(REQPARAM&& Request)    // m_mxReqList must be locked
+{
+    uint16_t nRequestId;
+    if (m_quFreeIds.empty() == false)
+    {
+        nRequestId = m_quFreeIds.front();
+        m_quFreeIds.pop_front();
+    }
+    else if (m_usResquestId < UINT16_MAX)
+        nRequestId = ++m_usResquestId;  // Id 0 is reserved for management records
+    else
+        return 0;
+
+    REQSLOT* pPage = m_apReqPages[nRequestId >> 8].load(memory_order_relaxed);
+    if (pPage == nullptr)
+    {
+        pPage = new REQSLOT[256];
+        m_apReqPages[nRequestId >> 8].store(pPage, memory_order_release);
+    }
+
+    pPage[nRequestId & 0xff].Request = move(Request);
+    pPage[nRequestId & 0xff].bAborted.store(false, memory_order_relaxed);
+    pPage[nRequestId & 0xff].bActive.store(true, memory_order_release);
+    return nRequestId;
+}
+
+// m_mxReqList must be locked. If the receive thread delivers a record to the request right now, the lock is released
+// until it is done, the slot and its id are used again only afterwards. pRequest gets the request taken out of the slot.
+// With bKeepId the id is released by the FCGI_END_REQUEST still to come.
+void FastCgiClient::FreeRequest(const uint16_t nRequestId, REQPARAM* const pRequest/* = nullptr*/, const bool bKeepId/* = false*/)
+{
+    REQSLOT& Slot = m_apReqPages[nRequestId >> 8].load(memory_order_relaxed)[nRequestId & 0xff];
+    Slot.bActive.store(false);  // seq_cst, see PinRequest
+    while (m_nPinned.load() == nRequestId && m_idReceiver.load(memory_order_relaxed) != this_thread::get_id())
+    {
+        m_mxReqList.unlock();   // The callback running may send a request
+        unique_lock<mutex> lock(m_mxPin);
+        ++m_nPinWaiters;
+        m_cvPin.wait(lock, [&]() noexcept { return m_nPinned.load() != nRequestId; });
+        --m_nPinWaiters;
+        lock.unlock();
+        m_mxReqList.lock();
+    }
+
+    if (pRequest != nullptr)
+    {
+        *pRequest = move(Slot.Request);
+        pRequest->bIsAbort = Slot.bAborted.load(memory_order_relaxed);
+    }
+    Slot.Request = REQPARAM({ nullptr, nullptr, nullptr, nullptr, "", false, nullptr, chrono::steady_clock::time_point(), false });
+    if (bKeepId == true)
+        Slot.bRemoved = true;
+    else
+        ReleaseRequestId(nRequestId);
+}
+
+bool FastCgiClient::IsRemoved(const uint16_t nRequestId) const noexcept    // m_mxReqList must be locked
+{
+    const REQSLOT* pPage = m_apReqPages[nRequestId >> 8].load(memory_order_relaxed);
+    return pPage != nullptr && pPage[nRequestId & 0xff].bRemoved == true;
+}
+
+void FastCgiClient::ReleaseRequestId(const uint16_t nRequestId)    // m_mxReqList must be locked
+{
+    m_apReqPages[nRequestId >> 8].load(memory_order_relaxed)[nRequestId & 0xff].bRemoved = false;
+    m_quFreeIds.push_back(nRequestId);
+    if (m_nCountCurRequest >= 1)    // Also aborted and removed requests, the server is done with them now
+        m_nCountCurRequest--;
+}
+
+void FastCgiClient::ClearRequests(const bool bFlushStdErr)    // Ends all requests
+{
+    vector<pair<uint16_t, REQPARAM>> vEnded;
+
+    m_mxReqList.lock();
+    for (uint32_t nRequestId = 1; nRequestId <= m_usResquestId; ++nRequestId)
+    {
+        if (FindRequest(static_cast<uint16_t>(nRequestId)) != nullptr)
+        {
+            vEnded.emplace_back(static_cast<uint16_t>(nRequestId), REQPARAM{});
+            FreeRequest(static_cast<uint16_t>(nRequestId), &vEnded.back().second);
+        }
+        else if (IsRemoved(static_cast<uint16_t>(nRequestId)) == true)
+            ReleaseRequestId(static_cast<uint16_t>(nRequestId));
+    }
+    m_nCountCurRequest = 0;
     m_mxReqList.unlock();
+
+    for (auto& item : vEnded)
+        EndRequest(item.first, item.second, 0, FCGI_CONNECTION_LOST, bFlushStdErr);
+}
+
+void FastCgiClient::EndRequest(const uint16_t nRequestId, REQPARAM& Request, const uint32_t nAppStatus, const uint8_t nProtocolStatus, const bool bFlushStdErr)
+{
+    if (m_spMetrics != nullptr)
+    {
+        if (Request.bIsAbort == true || nProtocolStatus == FCGI_CONNECTION_LOST)
+            m_spMetrics->Add(FastCgiMetrics::REQUESTS_ABORTED);
+        else if (nProtocolStatus == FCGI_OVERLOADED || nProtocolStatus == FCGI_CANT_MPX_CONN)
+            m_spMetrics->Add(FastCgiMetrics::REQUESTS_OVERLOADED);
+        else
+        {
+            m_spMetrics->Add(FastCgiMetrics::REQUESTS_COMPLETED);
+            m_spMetrics->Observe(FastCgiMetrics::TOTAL_TIME, chrono::steady_clock::now() - Request.tmStart);
+        }
+        m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
+    }
+    if (m_spTracer != nullptr)
+        m_spTracer->Event(this, nRequestId, FastCgiTracer::CLIENT_END_REQUEST);
+
+    if (Request.fnComplete != nullptr)
+    {
+        Request.fnComplete(nRequestId, nAppStatus, nProtocolStatus, Request.strRecBuf, Request.vpCbParam);
+        return;
+    }
+
+    if (bFlushStdErr == true && Request.strRecBuf.empty() == false)
+        Request.fnDataOutput(nRequestId, reinterpret_cast<unsigned char*>(&Request.strRecBuf[0]), static_cast<uint16_t>(Request.strRecBuf.size()), Request.vpCbParam);
+
+    if (Request.pbReqEnde != nullptr)
+        *Request.pbReqEnde = true;
+    if (Request.pcvReqEnd != nullptr)
+        Request.pcvReqEnd->notify_all();
 }
 
 void FastCgiClient::StartFcgiProcess()
@@ -597,85 +878,450 @@ void FastCgiClient::StartFcgiProcess()
     }
     envp.push_back(nullptr);
 
-    int iRes = posix_spawn(&m_hProcess, wargv[0], NULL, NULL, &wargv[0], &envp[0]);
+    posix_spawn_file_actions_t stActions;
+    posix_spawn_file_actions_init(&stActions);
+    if (m_spListenSocket != nullptr && m_spListenSocket->GetHandle() >= 0)  // The process accepts on it, instead of opening a port itself
+        posix_spawn_file_actions_adddup2(&stActions, m_spListenSocket->GetHandle(), FCGI_LISTENSOCK_FILENO);
+
+    int iRes = posix_spawn(&m_hProcess, wargv[0], &stActions, NULL, &wargv[0], &envp[0]);
+    posix_spawn_file_actions_destroy(&stActions);
     if (iRes != 0)
+    {
         OutputDebugString(wstring(L"posix_spawn result: " + to_wstring(iRes) +  L", pid: " + to_wstring(m_hProcess) + L", errno = " + to_wstring(errno) +  L"\r\n").c_str());
+        m_hProcess = Null;
+        return;
+    }
+
+    // The thread collects the process as soon as it exits, nobody else calls waitpid for it
+    auto spExit = make_shared<PROCESSEXIT>();
+    spExit->bExited = false;
+    m_spProcessExit = spExit;
+    thread([spExit](const pid_t nPid)
+    {
+        int nStatus;
+        while (waitpid(nPid, &nStatus, 0) == -1 && errno == EINTR)
+        {
+        }
+        lock_guard<mutex> lock(spExit->mxExit);
+        spExit->bExited = true;
+        spExit->cvExit.notify_all();
+    }, m_hProcess).detach();
 #endif
-    this_thread::sleep_for(chrono::milliseconds(500));
+    // No waiting here, Connect probes the process until it answers
 }
 
-bool FastCgiClient::IsFcgiProcessActiv(size_t nCount/* = 0*/)
+bool FastCgiClient::WaitForProcessExit(const chrono::milliseconds tmTimeout)
 {
-    if (m_hProcess != Null)
-    {
 #if defined(_WIN32) || defined(_WIN64)
-        DWORD nExitCode = STILL_ACTIVE;
+    return m_hProcess == Null || WaitForSingleObject(m_hProcess, static_cast<DWORD>(tmTimeout.count())) != WAIT_TIMEOUT;
+#else
+    if (m_spProcessExit == nullptr)
+        return true;
+    unique_lock<mutex> lock(m_spProcessExit->mxExit);
+    return m_spProcessExit->cvExit.wait_for(lock, tmTimeout, [&]() noexcept { return m_spProcessExit->bExited; });
+#endif
+}
 
-        if (!GetExitCodeProcess(m_hProcess, &nExitCode))
-            return false;
-        if (nExitCode == STILL_ACTIVE)
+bool FastCgiClient::IsFcgiProcessActiv(size_t nCount/* = 0*/)
+{
+    for (; m_hProcess != Null; ++nCount)
+    {
+        if (WaitForProcessExit(chrono::milliseconds(0)) == false)
             return true;
 
+#if defined(_WIN32) || defined(_WIN64)
         CloseHandle(m_hProcess);
-#else
-        int nExitCode;
-        int status = waitpid(m_hProcess, &nExitCode, WNOHANG);
-
-        if (status == 0)
-            return true;
 #endif
-        m_mxReqList.lock();
-        if (m_lstRequest.size() > 0)
-        {
-            for (REQLIST::iterator iter = begin(m_lstRequest); iter != end(m_lstRequest); ++iter)
-            {
-                if (iter->second.pbReqEnde != nullptr)
-                    *iter->second.pbReqEnde = true;
-                if (iter->second.pcvReqEnd != nullptr)
-                    iter->second.pcvReqEnd->notify_all();
-            }
-            m_lstRequest.clear();
-            m_nCountCurRequest = 0;
-        }
-        m_mxReqList.unlock();
+        ClearRequests(false);
 
         m_cClosed |= 4;
         m_hProcess = Null;
+        m_spProcessExit.reset();
 
         if (nCount >= 5)
             return false;
 
-        StartFcgiProcess();
-
-        return IsFcgiProcessActiv(++nCount);
+        StartFcgiProcess();     // Returns at once, the next Connect waits until the process is ready
     }
     return m_strProcessPath.empty();    // If no process path is given, we return true, we assume that the process is externally controlled and running
 }
 
-uint16_t FastCgiBase::AddNameValuePair(uint8_t** pBuffer, const char* pKey, size_t nKeyLen, const char* pValue, size_t nValueLen) noexcept
+size_t FastCgiClient::GetProcessMemory() const
 {
-    uint16_t nRetLen = 0;
-    nRetLen += FromNumber(pBuffer, static_cast<uint32_t>(nKeyLen));
-    nRetLen += FromNumber(pBuffer, static_cast<uint32_t>(nValueLen));
-    for (size_t n = 0; n < nKeyLen; ++n, ++nRetLen)
-        *(*pBuffer)++ = *pKey++;
-    for (size_t n = 0; n < nValueLen; ++n, ++nRetLen)
-        *(*pBuffer)++ = *pValue++;
+    if (m_hProcess == Null)
+        return 0;
+#if defined(_WIN32) || defined(_WIN64)
+    PROCESS_MEMORY_COUNTERS stCounters{};
+    if (K32GetProcessMemoryInfo(m_hProcess, &stCounters, sizeof(stCounters)) == TRUE)
+        return stCounters.WorkingSetSize;
+#else
+    ifstream fsStatm("/proc/" + to_string(m_hProcess) + "/statm");  // Total and resident size in pages
+    size_t nSize, nResident;
+    if (fsStatm >> nSize >> nResident)
+        return nResident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return 0;
+}
+
+//---------------- Client Pool ----------------------
 
-    return nRetLen;
+FastCgiClientPool::FastCgiClientPool(const string strIpServer, const uint16_t usPort, const uint32_t nMaxIdle/* = 4*/) : m_strIpServer(strIpServer), m_usPort(usPort), m_nMaxIdle(nMaxIdle), m_nConnecting(0), m_bHaveValues(false), m_bProbing(false)
+{
+    m_FCGI_MAX_CONNS = UINT32_MAX;
+    m_FCGI_MAX_REQS = UINT32_MAX;
+    m_FCGI_MPXS_CONNS = 0;
 }
 
-uint16_t FastCgiBase::ToShort(const uint8_t* const pBuffer) noexcept
+unique_ptr<FastCgiClient> FastCgiClientPool::NewConnection()
 {
-    uint16_t nResult = *pBuffer;
-    nResult <<= 8, nResult |= *(pBuffer + 1);
-    return nResult;
+    // The first connection asks the backend for its limits, connections made meanwhile wait for the answer.
+    // If it fails, the next one asks.
+    unique_lock<mutex> lock(m_mxPool);
+    m_cvValues.wait(lock, [&]() noexcept { return m_bHaveValues == true || m_bProbing == false; });
+    const bool bProbe = m_bHaveValues == false;
+    m_bProbing = bProbe;
+    lock.unlock();
+
+    auto pClient = make_unique<FastCgiClient>();
+    pClient->SetMetrics(m_spMetrics);
+    pClient->SetTracer(m_spTracer);
+    const bool bConnected = pClient->Connect(m_strIpServer, m_usPort, bProbe == false) == 1;
+
+    lock.lock();
+    if (bProbe == true)
+    {
+        if (bConnected == true)
+        {
+            m_FCGI_MAX_CONNS = pClient->m_FCGI_MAX_CONNS;
+            m_FCGI_MAX_REQS = pClient->m_FCGI_MAX_REQS;
+            m_FCGI_MPXS_CONNS = pClient->m_FCGI_MPXS_CONNS;
+            m_bHaveValues = true;
+        }
+        m_bProbing = false;
+        m_cvValues.notify_all();
+    }
+    else if (bConnected == true)
+    {
+        pClient->m_FCGI_MAX_CONNS = m_FCGI_MAX_CONNS;
+        pClient->m_FCGI_MAX_REQS = m_FCGI_MAX_REQS;
+        pClient->m_FCGI_MPXS_CONNS = m_FCGI_MPXS_CONNS;
+    }
+
+    return bConnected == true ? move(pClient) : nullptr;
 }
 
-uint32_t FastCgiBase::ToNumber(uint8_t** pBuffer, uint16_t& nContentLen) noexcept
+uint32_t FastCgiClientPool::Prewarm(const uint32_t nCount)
 {
-    uint16_t nLen = 1;
-    uint32_t nResult = **pBuffer;
+    uint32_t nConnected = 0;
+    while (nConnected < nCount)
+    {
+        m_mxPool.lock();
+        if (m_vConnections.size() + m_nConnecting >= m_FCGI_MAX_CONNS)
+        {
+            m_mxPool.unlock();
+            break;
+        }
+        ++m_nConnecting;
+        m_mxPool.unlock();
+
+        unique_ptr<FastCgiClient> pClient = NewConnection();
+
+        lock_guard<mutex> lock(m_mxPool);
+        --m_nConnecting;
+        if (pClient == nullptr)
+            break;
+        m_vConnections.emplace_back(POOLENTRY({ move(pClient), 0 }));
+        ++nConnected;
+    }
+
+    return nConnected;
+}
+
+FastCgiClient* FastCgiClientPool::Acquire()
+{
+    unique_lock<mutex> lock(m_mxPool);
+
+    // Remove connections closed by the backend, if nobody uses them
+    m_vConnections.erase(remove_if(begin(m_vConnections), end(m_vConnections), [](const POOLENTRY& entry) noexcept { return entry.nInUse == 0 && entry.pClient->IsConnected() == false; }), end(m_vConnections));
+
+    // An idle connection, or the least used one if the backend multiplexes
+    auto itEntry = end(m_vConnections);
+    for (auto it = begin(m_vConnections); it != end(m_vConnections); ++it)
+    {
+        if (it->pClient->IsConnected() == false || (it->nInUse > 0 && m_FCGI_MPXS_CONNS == 0))
+            continue;
+        if (itEntry == end(m_vConnections) || it->nInUse < itEntry->nInUse)
+            itEntry = it;
+        if (itEntry->nInUse == 0)
+            break;
+    }
+
+    if (itEntry != end(m_vConnections) && (itEntry->nInUse == 0 || m_vConnections.size() + m_nConnecting >= m_FCGI_MAX_CONNS))
+    {
+        ++itEntry->nInUse;
+        return itEntry->pClient.get();
+    }
+
+    if (m_vConnections.size() + m_nConnecting >= m_FCGI_MAX_CONNS)
+        return nullptr;
+
+    ++m_nConnecting;
+    lock.unlock();
+
+    unique_ptr<FastCgiClient> pClient = NewConnection();
+
+    lock.lock();
+    --m_nConnecting;
+    if (pClient == nullptr)
+        return nullptr;
+
+    FastCgiClient* pRet = pClient.get();
+    m_vConnections.emplace_back(POOLENTRY({ move(pClient), 1 }));
+    return pRet;
+}
+
+void FastCgiClientPool::Release(FastCgiClient* const pClient)
+{
+    lock_guard<mutex> lock(m_mxPool);
+
+    const auto itEntry = find_if(begin(m_vConnections), end(m_vConnections), [&](const POOLENTRY& entry) noexcept { return entry.pClient.get() == pClient; });
+    if (itEntry == end(m_vConnections) || itEntry->nInUse == 0)
+        return;
+
+    if (--itEntry->nInUse == 0)
+    {
+        const size_t nIdle = count_if(begin(m_vConnections), end(m_vConnections), [](const POOLENTRY& entry) noexcept { return entry.nInUse == 0; });
+        if (nIdle > m_nMaxIdle || itEntry->pClient->IsConnected() == false)
+            m_vConnections.erase(itEntry);
+    }
+}
+
+size_t FastCgiClientPool::GetConnectionCount()
+{
+    lock_guard<mutex> lock(m_mxPool);
+    return m_vConnections.size();
+}
+
+//---------------- Process Pool ---------------------
+
+FastCgiProcessPool::FastCgiProcessPool(const wstring& strCommand, const string strIpServer, const uint16_t usBasePort, const uint32_t nMinProcesses, const uint32_t nMaxProcesses/* = 0*/) :
+    m_strCommand(strCommand), m_strIpServer(strIpServer), m_usBasePort(usBasePort), m_nMinProcesses(nMinProcesses), m_nMaxProcesses(max(max(nMinProcesses, nMaxProcesses), static_cast<uint32_t>(1))),
+    m_nMaxRequests(0), m_nMaxMemory(0), m_tmIdleTimeout(10000)
+{
+}
+
+unique_ptr<FastCgiClient> FastCgiProcessPool::NewProcess(const uint16_t usPort)
+{
+    wstring strCommand(m_strCommand);
+    const wstring strPort = to_wstring(usPort);
+    unique_ptr<FastCgiClient> pClient;
+    string strAddress(m_strIpServer);
+    uint16_t usConnectPort = usPort;
+    if (strCommand.find(L"%PORT%") == wstring::npos)    // The process gets its listening socket from us
+    {
+        auto spListenSocket = make_shared<FastCgiListenSocket>();
+        if (spListenSocket->Open(m_strIpServer, 0) == false)
+        {
+            OutputDebugString(L"FastCgiProcessPool: no listening socket for the process\r\n");
+            return nullptr;
+        }
+        strAddress = spListenSocket->GetAddress();
+        usConnectPort = spListenSocket->GetPort();
+        pClient = make_unique<FastCgiClient>(strCommand, spListenSocket);
+    }
+    else
+    {
+        for (size_t nPos = strCommand.find(L"%PORT%"); nPos != wstring::npos; nPos = strCommand.find(L"%PORT%", nPos + strPort.size()))
+            strCommand.replace(nPos, 6, strPort);
+        pClient = make_unique<FastCgiClient>(strCommand);
+    }
+    pClient->SetMetrics(m_spMetrics);
+    pClient->SetTracer(m_spTracer);
+
+    if (pClient->Connect(strAddress, usConnectPort) == 1)   // Probes the process until it answers
+        return pClient;
+
+    OutputDebugString(wstring(L"FastCgiProcessPool: no connection to process on port " + strPort + L"\r\n").c_str());
+    return nullptr;     // The destructor stops the process
+}
+
+uint16_t FastCgiProcessPool::GetFreePort() const noexcept    // m_mxPool must be locked
+{
+    for (uint32_t n = 0; n < m_nMaxProcesses; ++n)
+    {
+        const uint16_t usPort = static_cast<uint16_t>(m_usBasePort + n);
+        if (find(begin(m_vStarting), end(m_vStarting), usPort) == end(m_vStarting)
+            && find_if(begin(m_vProcesses), end(m_vProcesses), [usPort](const PROCESSENTRY& Entry) noexcept { return Entry.usPort == usPort; }) == end(m_vProcesses))
+            return usPort;
+    }
+    return 0;
+}
+
+bool FastCgiProcessPool::IsWorn(const PROCESSENTRY& Entry) const
+{
+    if (m_nMaxRequests != 0 && Entry.nRequests >= m_nMaxRequests)
+        return true;
+    return m_nMaxMemory != 0 && Entry.pClient->GetProcessMemory() > m_nMaxMemory;
+}
+
+uint32_t FastCgiProcessPool::Start()
+{
+    vector<pair<uint16_t, future<unique_ptr<FastCgiClient>>>> vStarted;   // The processes start in parallel
+
+    m_mxPool.lock();
+    while (m_vProcesses.size() + m_vStarting.size() < m_nMinProcesses)
+    {
+        m_vStarting.push_back(GetFreePort());
+        vStarted.emplace_back(m_vStarting.back(), async(launch::async, &FastCgiProcessPool::NewProcess, this, m_vStarting.back()));
+    }
+    m_mxPool.unlock();
+
+    for (auto& item : vStarted)
+    {
+        unique_ptr<FastCgiClient> pClient = item.second.get();
+
+        lock_guard<mutex> lock(m_mxPool);
+        m_vStarting.erase(find(begin(m_vStarting), end(m_vStarting), item.first));
+        if (pClient != nullptr)
+            m_vProcesses.emplace_back(PROCESSENTRY({ move(pClient), item.first, 0, 0, chrono::steady_clock::now() }));
+    }
+
+    lock_guard<mutex> lock(m_mxPool);
+    return static_cast<uint32_t>(m_vProcesses.size());
+}
+
+FastCgiClient* FastCgiProcessPool::Acquire()
+{
+    vector<unique_ptr<FastCgiClient>> vStop;    // Stopped after the lock is released, the destructor waits for the process
+    unique_lock<mutex> lock(m_mxPool);
+
+    // Processes that are gone, and processes above the minimum idle for too long
+    const auto tmNow = chrono::steady_clock::now();
+    for (auto it = begin(m_vProcesses); it != end(m_vProcesses);)
+    {
+        if (it->nInUse == 0 && (it->pClient->IsConnected() == false || (m_vProcesses.size() > m_nMinProcesses && tmNow - it->tmIdleSince >= m_tmIdleTimeout)))
+        {
+            vStop.emplace_back(move(it->pClient));
+            it = m_vProcesses.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    // An idle process, or the least used one if the backend multiplexes
+    auto itEntry = end(m_vProcesses);
+    for (auto it = begin(m_vProcesses); it != end(m_vProcesses); ++it)
+    {
+        if (it->pClient->IsConnected() == false || (it->nInUse > 0 && (it->pClient->IsMultiplexing() == false || it->nInUse >= it->pClient->GetMaxReqs())))
+            continue;
+        if (itEntry == end(m_vProcesses) || it->nInUse < itEntry->nInUse)
+            itEntry = it;
+        if (itEntry->nInUse == 0)
+            break;
+    }
+
+    if (itEntry != end(m_vProcesses) && (itEntry->nInUse == 0 || m_vProcesses.size() + m_vStarting.size() >= m_nMaxProcesses))
+    {
+        ++itEntry->nInUse;
+        ++itEntry->nRequests;
+        return itEntry->pClient.get();
+    }
+
+    if (m_vProcesses.size() + m_vStarting.size() >= m_nMaxProcesses)
+        return nullptr;
+
+    const uint16_t usPort = GetFreePort();
+    m_vStarting.push_back(usPort);
+    lock.unlock();
+
+    unique_ptr<FastCgiClient> pClient = NewProcess(usPort);
+
+    lock.lock();
+    m_vStarting.erase(find(begin(m_vStarting), end(m_vStarting), usPort));
+    if (pClient == nullptr)
+        return nullptr;
+
+    FastCgiClient* pRet = pClient.get();
+    m_vProcesses.emplace_back(PROCESSENTRY({ move(pClient), usPort, 1, 1, chrono::steady_clock::time_point() }));
+    return pRet;
+}
+
+void FastCgiProcessPool::Release(FastCgiClient* const pClient)
+{
+    unique_ptr<FastCgiClient> pStop;    // A worn out process is stopped after the lock is released
+    lock_guard<mutex> lock(m_mxPool);
+
+    const auto itEntry = find_if(begin(m_vProcesses), end(m_vProcesses), [&](const PROCESSENTRY& Entry) noexcept { return Entry.pClient.get() == pClient; });
+    if (itEntry == end(m_vProcesses) || itEntry->nInUse == 0)
+        return;
+
+    if (--itEntry->nInUse == 0)
+    {
+        itEntry->tmIdleSince = chrono::steady_clock::now();
+        if (itEntry->pClient->IsConnected() == false || IsWorn(*itEntry) == true)
+        {   // The next Acquire starts a new one if needed
+            pStop = move(itEntry->pClient);
+            m_vProcesses.erase(itEntry);
+        }
+    }
+}
+
+size_t FastCgiProcessPool::GetProcessCount()
+{
+    lock_guard<mutex> lock(m_mxPool);
+    return m_vProcesses.size();
+}
+
+uint16_t FastCgiBase::AddNameValuePair(uint8_t** pBuffer, const char* pKey, size_t nKeyLen, const char* pValue, size_t nValueLen) noexcept
+{
+    uint16_t nRetLen = 0;
+    nRetLen += FromNumber(pBuffer, static_cast<uint32_t>(nKeyLen));
+    nRetLen += FromNumber(pBuffer, static_cast<uint32_t>(nValueLen));
+    memcpy(*pBuffer, pKey, nKeyLen);
+    memcpy(*pBuffer + nKeyLen, pValue, nValueLen);
+    *pBuffer += nKeyLen + nValueLen;
+
+    return static_cast<uint16_t>(nRetLen + nKeyLen + nValueLen);
+}
+
+FastCgiParamBlock& FastCgiParamBlock::Add(const CgiName& Name, const char* pValue, const size_t nValueLen)
+{
+    uint8_t caLength[4];
+    uint8_t* pLength = caLength;
+    FastCgiBase::FromNumber(&pLength, static_cast<uint32_t>(nValueLen));
+
+    m_vEncoded.reserve(m_vEncoded.size() + Name.m_nLengthLen + (pLength - caLength) + Name.m_nLen + nValueLen);
+    m_vEncoded.insert(end(m_vEncoded), Name.m_aLength, Name.m_aLength + Name.m_nLengthLen);
+    m_vEncoded.insert(end(m_vEncoded), caLength, pLength);
+    m_vEncoded.insert(end(m_vEncoded), Name.m_szName, Name.m_szName + Name.m_nLen);
+    m_vEncoded.insert(end(m_vEncoded), pValue, pValue + nValueLen);
+    return *this;
+}
+
+FastCgiParamBlock& FastCgiParamBlock::Add(const char* pName, const size_t nNameLen, const char* pValue, const size_t nValueLen)
+{
+    const size_t nOffset = m_vEncoded.size();
+    m_vEncoded.resize(nOffset + 8 + nNameLen + nValueLen);
+    uint8_t* pPos = &m_vEncoded[nOffset];
+    FastCgiBase::FromNumber(&pPos, static_cast<uint32_t>(nNameLen));
+    FastCgiBase::FromNumber(&pPos, static_cast<uint32_t>(nValueLen));
+    memcpy(pPos, pName, nNameLen);
+    memcpy(pPos + nNameLen, pValue, nValueLen);
+    m_vEncoded.resize(pPos - &m_vEncoded[0] + nNameLen + nValueLen);
+    return *this;
+}
+
+uint16_t FastCgiBase::ToShort(const uint8_t* const pBuffer) noexcept
+{
+    uint16_t nResult = *pBuffer;
+    nResult <<= 8, nResult |= *(pBuffer + 1);
+    return nResult;
+}
+
+uint32_t FastCgiBase::ToNumber(uint8_t** pBuffer, uint16_t& nContentLen) noexcept
+{
+    uint16_t nLen = 1;
+    uint32_t nResult = **pBuffer;
     if ((**pBuffer & 0x80) == 0x80)
         nResult &= 0x7F, nLen = 4;
     (*pBuffer)++;
@@ -685,6 +1331,67 @@ uint32_t FastCgiBase::ToNumber(uint8_t** pBuffer, uint16_t& nContentLen) noexcep
     return nResult;
 }
 
+uint8_t* FastCgiBase::RecordParser::GetWriteBuffer(const size_t nMinSize)
+{
+    const bool bShared = m_spBuffer.use_count() > 1;    // FCGI_STDIN chunks still point into the buffer
+
+    if (m_nStart == m_nEnd && bShared == false)
+        m_nStart = m_nEnd = 0;
+
+    if (m_nCapacity - m_nEnd >= nMinSize)   // Behind the data is enough room
+        return m_spBuffer.get() + m_nEnd;
+
+    const size_t nLeft = m_nEnd - m_nStart; // Begin of a record, that is not completely received
+    if (bShared == false && m_nCapacity >= nLeft + nMinSize)
+        copy(m_spBuffer.get() + m_nStart, m_spBuffer.get() + m_nEnd, m_spBuffer.get());
+    else
+    {
+        const size_t nCapacity = max(static_cast<size_t>(65536 + 512), nLeft + nMinSize);  // 65536 + 512 holds the largest record
+        shared_ptr<uint8_t> spBuffer = BufferPool::GetShared(nCapacity);
+        if (nLeft > 0)
+            copy(m_spBuffer.get() + m_nStart, m_spBuffer.get() + m_nEnd, spBuffer.get());
+        m_spBuffer = move(spBuffer);
+        m_nCapacity = BufferPool::GetCapacity(m_spBuffer.get());
+    }
+
+    m_nStart = 0;
+    m_nEnd = nLeft;
+    return m_spBuffer.get() + m_nEnd;
+}
+
+void FastCgiBase::RecordParser::Reset() noexcept
+{
+    if (m_spBuffer.use_count() > 1)
+        m_spBuffer.reset(), m_nCapacity = 0;
+    m_nStart = m_nEnd = 0;
+}
+
+bool FastCgiBase::NextNameValuePair(const uint8_t** pBuffer, const uint8_t* const pEnd, const char** pKey, uint32_t& nKeyLen, const char** pValue, uint32_t& nValueLen) noexcept
+{
+    const uint8_t* pPos = *pBuffer;
+    uint32_t* aLength[2] = { &nKeyLen, &nValueLen };
+    for (uint32_t* pLength : aLength)
+    {
+        if (pPos >= pEnd)
+            return false;
+        const uint8_t nFirst = *pPos;   // Read once, the buffer may be shared memory the other side still writes
+        if ((nFirst & 0x80) == 0x80 && pEnd - pPos < 4)
+            return false;
+        if ((nFirst & 0x80) == 0x80)
+            *pLength = ((nFirst & 0x7fu) << 24) | (pPos[1] << 16) | (pPos[2] << 8) | pPos[3], pPos += 4;
+        else
+            *pLength = nFirst, ++pPos;
+    }
+
+    if (static_cast<size_t>(pEnd - pPos) < static_cast<size_t>(nKeyLen) + nValueLen)
+        return false;
+
+    *pKey = reinterpret_cast<const char*>(pPos);
+    *pValue = reinterpret_cast<const char*>(pPos + nKeyLen);
+    *pBuffer = pPos + nKeyLen + nValueLen;
+    return true;
+}
+
 void FastCgiBase::FromShort(uint8_t* const pBuffer, uint16_t sNumber) noexcept
 {
     *pBuffer = (sNumber >> 8) & 0xff;
@@ -698,8 +1405,8 @@ uint16_t FastCgiBase::FromNumber(uint8_t** pBuffer, uint32_t nNumber) noexcept
         *(*pBuffer)++ = static_cast<uint8_t>(nNumber);
     else
     {
-        *(*pBuffer)++ = 0x80;
-        *(*pBuffer)++ = (nNumber >> 16) & 0xff; // Should always be 0, the largest number is 65535
+        *(*pBuffer)++ = 0x80 | ((nNumber >> 24) & 0x7f);
+        *(*pBuffer)++ = (nNumber >> 16) & 0xff;
         *(*pBuffer)++ = (nNumber >> 8) & 0xff;
         *(*pBuffer)++ = nNumber & 0xff;
         nLen = 4;
@@ -707,40 +1414,265 @@ uint16_t FastCgiBase::FromNumber(uint8_t** pBuffer, uint32_t nNumber) noexcept
     return nLen;
 }
 
+size_t FastCgiBase::EncodeParams(POOLBUFFER& vBuffer, const uint16_t nRequestId, const FastCgiParamBlock* const pStaticParams, const vector<pair<string, string>>& vCgiParam)
+{
+    // A name-value pair may span record boundaries
+    RecordStream rsParams(vBuffer, FCGI_PARAMS, nRequestId);
+    if (pStaticParams != nullptr)
+        rsParams.Write(pStaticParams->data(), pStaticParams->size());
+    for (auto& item : vCgiParam)
+    {
+        uint8_t caLength[8];
+        uint8_t* pLength = caLength;
+        FromNumber(&pLength, static_cast<uint32_t>(item.first.size()));
+        FromNumber(&pLength, static_cast<uint32_t>(item.second.size()));
+        rsParams.Write(caLength, pLength - caLength);
+        rsParams.Write(item.first.c_str(), item.first.size());
+        rsParams.Write(item.second.c_str(), item.second.size());
+    }
+    rsParams.End();
+    return rsParams.GetRecords();
+}
+
 //---------------- Server ---------------------------
 
-template <typename Callback>
-struct callback_ostreambuf : public streambuf
+class StreamOutBuffer : public streambuf
 {
-    using callback_t = Callback;
-    callback_ostreambuf(Callback cb, void* userdata1 = nullptr, void* userdata2 = nullptr) :
-        callback_(cb), user_data1(userdata1), user_data2(userdata2) {}
+public:
+    StreamOutBuffer(FastCgiStream* const pSocket, const uint16_t nRequestId, const size_t nRecordSize, const chrono::milliseconds tmMaxDelay, FastCgiMetrics* const pMetrics, const chrono::steady_clock::time_point tmBegin, const atomic<bool>* const pbAborted)
+    {
+        Reset(pSocket, nRequestId, nRecordSize, tmMaxDelay, pMetrics, tmBegin, pbAborted);
+    }
+
+    // For the next request, tmBegin is the start of the request for the time to first byte.
+    // If *pbAborted gets true, the output is discarded and the stream goes bad with the next write or flush.
+    void Reset(FastCgiStream* const pSocket, const uint16_t nRequestId, const size_t nRecordSize, const chrono::milliseconds tmMaxDelay, FastCgiMetrics* const pMetrics, const chrono::steady_clock::time_point tmBegin, const atomic<bool>* const pbAborted)
+    {
+        lock_guard<mutex> lock(m_mxBuffer);
+        m_pSocket = pSocket;
+        m_pbAborted = pbAborted;
+        m_nRequestId = nRequestId;
+        m_nRecordSize = nRecordSize;
+        m_tmMaxDelay = tmMaxDelay;
+        m_tmFirstData = 0;
+        m_pMetrics = pMetrics;
+        m_tmBegin = tmBegin;
+        m_bHaveOutput = false;
+
+        // Room for: header, content, padding, empty FCGI_STDOUT and FCGI_END_REQUEST, so the last write is one block
+        m_vBuffer.resize(sizeof(FCGI_Header) + nRecordSize + 8 + sizeof(FCGI_Header) + sizeof(FCGI_EndRequestRecord));
+        setp(GetContent(), GetContent() + nRecordSize);
+        Discard();
+    }
+
+    // Sends the buffered data, the empty FCGI_STDOUT record and FCGI_END_REQUEST with one write, after an abort only FCGI_END_REQUEST
+    void Finish(const uint32_t nAppStatus, const uint8_t nProtocolStatus)
+    {
+        lock_guard<mutex> lock(m_mxBuffer);
+        size_t nStart = 0;
+        size_t nLen = 0;
+        if (IsAborted() == false)
+        {
+            nLen = BuildRecord(nStart);
+
+            FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&m_vBuffer[nStart + nLen]);
+            SetRecordHeader(pHeader, FCGI_STDOUT, m_nRequestId, 0);
+            nLen += sizeof(FCGI_Header);
+            if (m_pMetrics != nullptr)
+                m_pMetrics->RecordOut(FCGI_STDOUT, 0);
+        }
+        else
+            Discard();
+
+        FCGI_EndRequestRecord* pEndRequest = reinterpret_cast<FCGI_EndRequestRecord*>(&m_vBuffer[nStart + nLen]);
+        SetRecordHeader(&pEndRequest->header, FCGI_END_REQUEST, m_nRequestId, sizeof(FCGI_EndRequestBody));
+        pEndRequest->body.appStatusB3 = (nAppStatus >> 24) & 0xff;
+        pEndRequest->body.appStatusB2 = (nAppStatus >> 16) & 0xff;
+        pEndRequest->body.appStatusB1 = (nAppStatus >> 8) & 0xff;
+        pEndRequest->body.appStatusB0 = nAppStatus & 0xff;
+        pEndRequest->body.protocolStatus = nProtocolStatus;
+        fill_n(pEndRequest->body.reserved, sizeof(pEndRequest->body.reserved), 0);
+        nLen += sizeof(FCGI_EndRequestRecord);
+
+        m_pSocket->Write(&m_vBuffer[nStart], nLen);
+        if (m_pMetrics != nullptr)
+            m_pMetrics->RecordOut(FCGI_END_REQUEST, sizeof(FCGI_EndRequestBody));
+    }
+
+    // When the flush timer has to send the data written so far, time_point::max() if nothing is waiting. Does not lock.
+    chrono::steady_clock::time_point GetDue() const noexcept
+    {
+        if (IsTimed() == false || m_nPublished.load(memory_order_acquire) == m_nSent.load(memory_order_relaxed))
+            return chrono::steady_clock::time_point::max();
+        return chrono::steady_clock::time_point(chrono::steady_clock::duration(m_tmFirstData.load(memory_order_relaxed))) + m_tmMaxDelay;
+    }
+
+    // From the flush timer, sends the data waiting since tmMaxDelay or longer, also if the handler does not write anymore.
+    // Only the part the handler published, it goes on writing behind it meanwhile. Header and padding are not put in the buffer.
+    void FlushIfDue(const chrono::steady_clock::time_point tmNow)
+    {
+        static const uint8_t caPadding[8] = { 0 };
+
+        lock_guard<mutex> lock(m_mxBuffer);
+        if (IsAborted() == true || GetDue() > tmNow)
+            return;
+
+        const size_t nSent = m_nSent.load(memory_order_relaxed);
+        const size_t nPublished = m_nPublished.load(memory_order_acquire);
+        FCGI_Header Header;
+        SetRecordHeader(&Header, FCGI_STDOUT, m_nRequestId, static_cast<uint16_t>(nPublished - nSent));
+        const iovec astRecord[3] = { { &Header, sizeof(FCGI_Header) }, { GetContent() + nSent, nPublished - nSent }, { const_cast<uint8_t*>(caPadding), Header.paddingLength } };
+        m_pSocket->Writev(astRecord, Header.paddingLength > 0 ? 3 : 2);
+        m_nSent.store(nPublished, memory_order_relaxed);
+        CountOutput(nPublished - nSent);
+    }
 
 protected:
     streamsize xsputn(const char_type* s, streamsize n) override
     {
-        return callback_(s, n, user_data1, user_data2); // returns the number of characters successfully written.
-    };
+        if (IsAborted() == true)
+        {
+            lock_guard<mutex> lock(m_mxBuffer);
+            Discard();
+            return 0;
+        }
+
+        const streamsize nTotal = n;
+        while (n > 0)
+        {
+            if (pptr() == epptr())
+            {
+                lock_guard<mutex> lock(m_mxBuffer);
+                FlushRecord();
+            }
+            const streamsize nCopy = min(n, static_cast<streamsize>(epptr() - pptr()));
+            copy_n(s, nCopy, pptr());
+            pbump(static_cast<int>(nCopy));
+            s += nCopy, n -= nCopy;
+        }
+        Publish();
+
+        return nTotal; // returns the number of characters successfully written.
+    }
 
     int_type overflow(int_type ch) override
     {
-        return static_cast<int_type>(callback_(&ch, 1, user_data1, user_data2)); // returns the number of characters successfully written.
+        lock_guard<mutex> lock(m_mxBuffer);
+        if (IsAborted() == true)
+        {
+            Discard();
+            return traits_type::eof();
+        }
+
+        FlushRecord();
+        if (traits_type::eq_int_type(ch, traits_type::eof()) == false)
+        {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+            Publish();
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override     // ostream::flush
+    {
+        lock_guard<mutex> lock(m_mxBuffer);
+        if (IsAborted() == true)
+        {
+            Discard();
+            return -1;
+        }
+
+        FlushRecord();
+        return 0;
     }
 
 private:
-    Callback callback_;
-    void* user_data1;
-    void* user_data2;
-};
+    bool IsAborted() const noexcept { return m_pbAborted != nullptr && m_pbAborted->load(memory_order_relaxed); }
+    bool IsTimed() const noexcept { return m_tmMaxDelay.count() != 0; }
+    char* GetContent() noexcept { return reinterpret_cast<char*>(&m_vBuffer[sizeof(FCGI_Header)]); }
+    void Discard() noexcept { setp(pbase(), epptr()); m_nSent.store(0, memory_order_relaxed); m_nPublished.store(0, memory_order_relaxed); }  // m_mxBuffer must be locked
+
+    // With a max. delay, lets the flush timer see the data written so far. The put area is not locked, the timer only takes
+    // what is published. Characters put with sputc, e.g. by the number formatting, come with the next write.
+    void Publish() noexcept
+    {
+        if (IsTimed() == false)
+            return;
+        const size_t nLen = static_cast<size_t>(pptr() - pbase());
+        const size_t nPublished = m_nPublished.load(memory_order_relaxed);
+        if (nLen == nPublished)
+            return;
+        if (nPublished == m_nSent.load(memory_order_relaxed))  // Nothing was waiting, the delay starts now
+            m_tmFirstData.store(chrono::steady_clock::now().time_since_epoch().count(), memory_order_relaxed);
+        m_nPublished.store(nLen, memory_order_release);
+    }
 
-template <typename Callback>
-auto make_callback_ostreambuf(Callback cb, void* user_data1 = nullptr, void* user_data2 = nullptr)
-{
-    return new callback_ostreambuf<Callback>(cb, user_data1, user_data2);
-}
+    // Puts the header in front of the data not sent yet and counts it, the record starts at nStart. Returns the size of the record.
+    size_t BuildRecord(size_t& nStart) noexcept     // m_mxBuffer must be locked
+    {
+        nStart = m_nSent.load(memory_order_relaxed);
+        const uint16_t nContentLen = static_cast<uint16_t>(pptr() - pbase() - nStart);
+        size_t nLen = 0;
+        if (nContentLen > 0)
+        {
+            FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&m_vBuffer[nStart]);   // Over data the flush timer sent already
+            SetRecordHeader(pHeader, FCGI_STDOUT, m_nRequestId, nContentLen);
+            fill_n(pptr(), pHeader->paddingLength, 0);
+            CountOutput(nContentLen);
+            nLen = sizeof(FCGI_Header) + nContentLen + pHeader->paddingLength;
+        }
+        Discard();
+
+        return nLen;
+    }
+
+    void FlushRecord()  // m_mxBuffer must be locked
+    {
+        size_t nStart;
+        const size_t nLen = BuildRecord(nStart);
+        if (nLen > 0)
+            m_pSocket->Write(&m_vBuffer[nStart], nLen);
+    }
+
+    void CountOutput(const size_t nContentLen) noexcept
+    {
+        if (m_pMetrics == nullptr)
+            return;
+
+        m_pMetrics->RecordOut(FCGI_STDOUT, nContentLen);
+        if (m_bHaveOutput == false)
+        {
+            m_bHaveOutput = true;
+            m_pMetrics->Observe(FastCgiMetrics::TIME_TO_FIRST_BYTE, chrono::steady_clock::now() - m_tmBegin);
+        }
+    }
+
+private:
+    FastCgiStream*           m_pSocket;
+    uint16_t                 m_nRequestId;
+    const atomic<bool>*      m_pbAborted;
+    POOLBUFFER               m_vBuffer;
+    size_t                   m_nRecordSize;
+    atomic<size_t>           m_nSent;         // Content of the put area the flush timer sent, changed under m_mxBuffer
+    atomic<size_t>           m_nPublished;    // Content of the put area the flush timer may send, set by the handler
+    mutex                    m_mxBuffer;      // Taken at record boundaries, flush, finish and by the flush timer, not for every write
+    chrono::milliseconds     m_tmMaxDelay;    // Data older than this is sent by the flush timer, 0 = only full records
+    atomic<chrono::steady_clock::rep> m_tmFirstData;  // When the oldest data not sent was published
+    FastCgiMetrics*          m_pMetrics;
+    chrono::steady_clock::time_point m_tmBegin;
+    bool                     m_bHaveOutput;
+};
 
 class StreamInBuffer : public streambuf
 {
+    typedef struct
+    {
+        shared_ptr<uint8_t> spBuffer;   // Receive buffer the chunk lives in, kept alive until the chunk is consumed
+        uint8_t* pData;
+        size_t nLen;
+    }CHUNK;
+
 public:
     StreamInBuffer() : m_bEof(false)
     {
@@ -748,59 +1680,221 @@ public:
         setp(nullptr, nullptr);
     }
 
-    void SetEof() noexcept {
+    void SetEof()
+    {
+        m_mxLock.lock();
         m_bEof = true;
+        m_mxLock.unlock();
+        m_cvData.notify_all();
     }
 
-protected:
-    streamsize xsputn(const char_type* s, streamsize n) override
+    void Reset()    // Releases the receive buffers still referenced
+    {
+        lock_guard<mutex> lock(m_mxLock);
+        m_quChunks.clear();
+        m_spCurrent.reset();
+        m_bEof = false;
+        setg(nullptr, nullptr, nullptr);
+    }
+
+    void AddChunk(const shared_ptr<uint8_t>& spBuffer, uint8_t* pData, const size_t nLen)
     {
-        if (n == 0) return n;
+        if (nLen == 0) return;
 
-        auto pBuf = make_unique<char[]>(n);
-        copy(s, s + n, &pBuf[0]);
         m_mxLock.lock();
-        m_vBuffers.emplace_back(make_tuple(move(pBuf), n));
+        m_quChunks.emplace_back(CHUNK({ spBuffer, pData, nLen }));
         m_mxLock.unlock();
+        m_cvData.notify_one();
+    }
 
-        if (pbase() == nullptr && pptr() == nullptr)
-        {
-            setg(&get<0>(m_vBuffers.front())[0], &get<0>(m_vBuffers.front())[0], &get<0>(m_vBuffers.front())[get<1>(m_vBuffers.front())]);
-            setp(&get<0>(m_vBuffers.front())[0], &get<0>(m_vBuffers.front())[ get<1>(m_vBuffers.front())]);
-        }
-
-        return n; // returns the number of characters successfully written.
-    };
-
+protected:
     int_type underflow() override
     {
-        if (gptr() == egptr() && m_vBuffers.size() > 0)
-        {
-            m_mxLock.lock();
-            m_vBuffers.erase(m_vBuffers.begin());
-            m_mxLock.unlock();
-        }
+        if (gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+
+        unique_lock<mutex> lock(m_mxLock);
+        m_spCurrent.reset();    // The current chunk is consumed, the receive buffer can be released
 
-        while (gptr() == egptr() && m_vBuffers.size() == 0 && m_bEof == false)
-            this_thread::sleep_for(chrono::milliseconds(1));
+        m_cvData.wait(lock, [&]() noexcept { return m_quChunks.empty() == false || m_bEof == true; });
 
-        if (gptr() == egptr() && m_vBuffers.size() == 0 && m_bEof == true)
+        if (m_quChunks.empty() == true) // m_bEof is set
+        {
+            setg(nullptr, nullptr, nullptr);
             return traits_type::eof();
+        }
 
-        setg(&get<0>(m_vBuffers.front())[0], &get<0>(m_vBuffers.front())[0], &get<0>(m_vBuffers.front())[get<1>(m_vBuffers.front())]);
-        setp(&get<0>(m_vBuffers.front())[0], &get<0>(m_vBuffers.front())[get<1>(m_vBuffers.front())]);
+        CHUNK& chunk = m_quChunks.front();
+        m_spCurrent = move(chunk.spBuffer);
+        char* pData = reinterpret_cast<char*>(chunk.pData);
+        setg(pData, pData, pData + chunk.nLen);
+        m_quChunks.pop_front();
 
-        const int_type nRet = traits_type::to_int_type(*gptr());
-        return nRet;
+        return traits_type::to_int_type(*gptr());
     }
 
 private:
     mutex m_mxLock;
+    condition_variable m_cvData;
     bool m_bEof;
-    vector<tuple<unique_ptr<char[]>, streamsize>> m_vBuffers;
+    deque<CHUNK> m_quChunks;
+    shared_ptr<uint8_t> m_spCurrent;
 };
 
-FastCgiServer::FastCgiServer(const string strBindAddr, const uint16_t sPort, FN_DOACTION fnCallBack) : m_strBindAddr(strBindAddr), m_sPort(sPort), m_fnDoAction(fnCallBack)
+static void ResetStream(ios& Stream)    // State and formatting like a new stream
+{
+    Stream.clear();
+    Stream.exceptions(ios_base::goodbit);
+    Stream.flags(ios_base::skipws | ios_base::dec);
+    Stream.width(0);
+    Stream.precision(6);
+    Stream.fill(' ');
+}
+
+WorkerPool::~WorkerPool()
+{
+    Stop();
+}
+
+void WorkerPool::Start(const uint32_t nThreads, const uint32_t nMaxQueue)
+{
+    lock_guard<mutex> lock(m_mxQueue);
+    if (m_vThreads.size() > 0)
+        return;
+
+    m_bStop = false;
+    m_nMaxQueue = nMaxQueue;
+    for (uint32_t n = 0; n < max(nThreads, static_cast<uint32_t>(1)); ++n)
+        m_vThreads.emplace_back(thread(&WorkerPool::WorkerThread, this));
+}
+
+void WorkerPool::Stop()
+{
+    m_mxQueue.lock();
+    m_bStop = true;
+    m_mxQueue.unlock();
+    m_cvQueue.notify_all();
+
+    for (auto& thWorker : m_vThreads)
+    {
+        if (thWorker.joinable() == true)
+            thWorker.join();
+    }
+    m_vThreads.clear();
+}
+
+bool WorkerPool::Post(packaged_task<void()>& task)
+{
+    m_mxQueue.lock();
+    if (m_nMaxQueue != 0 && m_quTasks.size() >= static_cast<size_t>(m_nIdle) + m_nMaxQueue)
+    {
+        m_mxQueue.unlock();
+        return false;
+    }
+    m_quTasks.emplace_back(move(task));
+    m_mxQueue.unlock();
+    m_cvQueue.notify_one();
+    return true;
+}
+
+size_t WorkerPool::GetQueueLen()
+{
+    lock_guard<mutex> lock(m_mxQueue);
+    return m_quTasks.size();
+}
+
+void WorkerPool::WorkerThread()
+{
+    unique_lock<mutex> lock(m_mxQueue);
+    while (true)
+    {
+        ++m_nIdle;
+        m_cvQueue.wait(lock, [&]() noexcept { return m_bStop == true || m_quTasks.empty() == false; });
+        --m_nIdle;
+        if (m_quTasks.empty() == true)  // m_bStop is set and nothing left to do
+            break;
+
+        packaged_task<void()> task(move(m_quTasks.front()));
+        m_quTasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+static const ParamView s_KnownParams[] =    // Same order as FastCgiParams::KNOWNPARAM
+{
+    { "REQUEST_METHOD", 14 }, { "SCRIPT_FILENAME", 15 }, { "SCRIPT_NAME", 11 }, { "CONTENT_LENGTH", 14 }, { "CONTENT_TYPE", 12 }, { "QUERY_STRING", 12 },
+    { "REQUEST_URI", 11 }, { "DOCUMENT_URI", 12 }, { "DOCUMENT_ROOT", 13 }, { "PATH_INFO", 9 }, { "SERVER_NAME", 11 }, { "SERVER_PORT", 11 }, { "SERVER_PROTOCOL", 15 },
+    { "REMOTE_ADDR", 11 }, { "REMOTE_PORT", 11 }, { "HTTP_HOST", 9 }, { "HTTP_COOKIE", 11 }, { "HTTPS", 5 }
+};
+static_assert(sizeof(s_KnownParams) / sizeof(s_KnownParams[0]) == FastCgiParams::KNOWN_COUNT, "s_KnownParams does not match KNOWNPARAM");
+
+static const uint32_t s_nFlushThreads = 4;     // m_FlushPool, writing the output the flush timer found due
+
+ParamView FastCgiParams::KnownName(const KNOWNPARAM nParam) noexcept
+{
+    return nParam < KNOWN_COUNT ? s_KnownParams[nParam] : ParamView();
+}
+
+void FastCgiParams::Parse(string& strParams)    // Takes the content of strParams, no copy of the names and values is made
+{
+    m_strArena.swap(strParams);
+    strParams.clear();
+    m_vIndex.clear();
+    m_anKnown.fill(UINT32_MAX);
+
+    const uint8_t* const pStart = reinterpret_cast<const uint8_t*>(m_strArena.data());
+    const uint8_t* pParam = pStart;
+    const uint8_t* const pParamEnd = pStart + m_strArena.size();
+    const char* pKey, *pValue;
+    uint32_t nKeyLen, nValueLen;
+    while (FastCgiBase::NextNameValuePair(&pParam, pParamEnd, &pKey, nKeyLen, &pValue, nValueLen) == true)
+    {
+        const uint32_t nIndex = static_cast<uint32_t>(m_vIndex.size());
+        m_vIndex.push_back({ static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(pKey) - pStart), nKeyLen, static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(pValue) - pStart), nValueLen });
+
+        for (uint8_t n = 0; n < KNOWN_COUNT; ++n)
+        {
+            if (s_KnownParams[n].size() == nKeyLen && m_anKnown[n] == UINT32_MAX && memcmp(s_KnownParams[n].data(), pKey, nKeyLen) == 0)
+            {
+                m_anKnown[n] = nIndex;  // The first one counts, like in the map
+                break;
+            }
+        }
+    }
+}
+
+size_t FastCgiParams::Find(const char* szName, const size_t nNameLen) const noexcept
+{
+    for (size_t n = 0; n < m_vIndex.size(); ++n)
+    {
+        if (m_vIndex[n].nNameLen == nNameLen && memcmp(&m_strArena[m_vIndex[n].nName], szName, nNameLen) == 0)
+            return n;
+    }
+    return SIZE_MAX;
+}
+
+ParamView FastCgiParams::Get(const char* szName) const noexcept
+{
+    const size_t nIndex = Find(szName, strlen(szName));
+    return nIndex != SIZE_MAX ? GetValue(nIndex) : ParamView();
+}
+
+bool FastCgiParams::Has(const char* szName) const noexcept
+{
+    return Find(szName, strlen(szName)) != SIZE_MAX;
+}
+
+PARAMETERLIST FastCgiParams::ToMap() const
+{
+    PARAMETERLIST lstParameter;
+    for (size_t n = 0; n < m_vIndex.size(); ++n)
+        lstParameter.emplace(GetName(n).str(), GetValue(n).str());
+    return lstParameter;
+}
+
+FastCgiServer::FastCgiServer(const string strBindAddr, const uint16_t sPort, FN_DOACTION fnCallBack) : m_strBindAddr(strBindAddr), m_sPort(sPort), m_fnDoAction(fnCallBack), m_nWorkerThreads(50), m_nMaxQueue(0), m_nMaxConns(0), m_nMaxReqs(0), m_bMultiplex(true), m_nMaxParamsSize(1024 * 1024), m_nActiveRequests(0), m_nRecordSize(16384), m_tmMaxDelay(0), m_bStopFlush(false)
 {
 
 }
@@ -809,15 +1903,48 @@ FastCgiServer::~FastCgiServer()
 {
     while (m_Connections.size() > 0)
         this_thread::sleep_for(chrono::milliseconds(10));
+    StopFlushTimer();
+    m_WorkerPool.Stop();
+}
+
+void FastCgiServer::SetOutputBuffer(const uint32_t nRecordSize, const chrono::milliseconds tmMaxDelay/* = chrono::milliseconds(0)*/) noexcept
+{
+    m_nRecordSize = min(max(nRecordSize, static_cast<uint32_t>(1024)), static_cast<uint32_t>(65528));   // 65528 is the largest content length without padding
+    m_tmMaxDelay = tmMaxDelay;
+}
+
+uint32_t FastCgiServer::GetMaxReqs() const noexcept
+{
+    if (m_nMaxReqs != 0)
+        return m_nMaxReqs;
+    return max(m_nWorkerThreads, static_cast<uint32_t>(1)) + m_nMaxQueue;    // More would wait unseen in the run queue
+}
+
+uint32_t FastCgiServer::GetMaxConns() const noexcept
+{
+    return m_nMaxConns != 0 ? m_nMaxConns : GetMaxReqs();
 }
 
 bool FastCgiServer::Start()
 {
-    m_pSocket = make_unique<TcpServer>();
+    m_WorkerPool.Start(m_nWorkerThreads, m_nMaxQueue);
+    if (m_tmMaxDelay.count() != 0 && m_thFlush.joinable() == false)
+    {
+        m_bStopFlush = false;
+        m_FlushPool.Start(s_nFlushThreads, 0);
+        m_thFlush = thread(&FastCgiServer::FlushTimer, this);
+    }
 
-    m_pSocket->BindNewConnection(static_cast<function<void(const vector<TcpSocket*>&)>>(bind(&FastCgiServer::OnNewConnection, this, _1)));
-    m_pSocket->BindErrorFunction(static_cast<function<void(BaseSocket* const)>>(bind(&FastCgiServer::OnSocketError, this, _1)));
-    return m_pSocket->Start(m_strBindAddr.c_str(), m_sPort);
+    m_pSocket = FastCgiListener::Create(m_strBindAddr);   // Without an address, the listening socket we got from a web server
+
+    m_pSocket->BindNewConnection(bind(&FastCgiServer::OnNewConnection, this, _1));
+    m_pSocket->BindErrorFunction([](FastCgiListener* const pListener) { pListener->Close(); });
+    m_pSocket->BindAcceptCondition([this]()
+    {
+        lock_guard<mutex> lock(m_mxConnections);
+        return m_Connections.size() < GetMaxConns();
+    });
+    return m_pSocket->Start(m_strBindAddr, m_sPort);
 }
 
 bool FastCgiServer::Stop()
@@ -825,6 +1952,7 @@ bool FastCgiServer::Stop()
     if (m_pSocket != nullptr)
     {
         m_pSocket->Close();
+        lock_guard<mutex> lock(m_mxConnections);    // OnSocketClosing uses it
         m_pSocket.reset(nullptr);
     }
 
@@ -835,6 +1963,7 @@ bool FastCgiServer::Stop()
     }
     m_mxConnections.unlock();
 
+    StopFlushTimer();
     return true;
 }
 
@@ -845,33 +1974,42 @@ int FastCgiServer::GetError()
     return -1;
 }
 
-void FastCgiServer::OnNewConnection(const vector<TcpSocket*>& vNewConnections)
+void FastCgiServer::OnNewConnection(const vector<FastCgiStream*>& vNewConnections)
 {
-    vector<TcpSocket*> vCache;
+    vector<FastCgiStream*> vCache;
     for (auto& pSocket : vNewConnections)
     {
         if (pSocket != nullptr)
         {
-            pSocket->BindFuncBytesReceived(static_cast<function<void(TcpSocket* const)>>(bind(&FastCgiServer::OnDataReceived, this, _1)));
-            pSocket->BindErrorFunction(static_cast<function<void(BaseSocket* const)>>(bind(&FastCgiServer::OnSocketError, this, _1)));
-            pSocket->BindCloseFunction(static_cast<function<void(BaseSocket* const)>>(bind(&FastCgiServer::OnSocketClosing, this, _1)));
+            pSocket->BindFuncBytesReceived(bind(&FastCgiServer::OnDataReceived, this, _1));
+            pSocket->BindErrorFunction(bind(&FastCgiServer::OnSocketError, this, _1));
+            pSocket->BindCloseFunction(bind(&FastCgiServer::OnSocketClosing, this, _1));
             vCache.push_back(pSocket);
         }
     }
 
     if (vCache.size())
     {
+        vector<FastCgiStream*> vRejected;
         m_mxConnections.lock();
         for (auto& pSocket : vCache)
         {
-            m_Connections.emplace(pSocket, REQUEST());
+            if (m_Connections.size() >= GetMaxConns())
+            {
+                vRejected.push_back(pSocket);
+                continue;
+            }
+            m_Connections.emplace(pSocket, make_shared<CONNECTION>());
             pSocket->StartReceiving();
         }
         m_mxConnections.unlock();
+
+        for (auto& pSocket : vRejected) // More than FCGI_MAX_CONNS, closed outside the lock, OnSocketClosing takes it too
+            pSocket->Close();
     }
 }
 
-void FastCgiServer::OnDataReceived(TcpSocket* pSocket)
+void FastCgiServer::OnDataReceived(FastCgiStream* const pSocket)
 {
     const size_t nAvailable = pSocket->GetBytesAvailable();
 
@@ -881,240 +2019,447 @@ void FastCgiServer::OnDataReceived(TcpSocket* pSocket)
         return;
     }
 
-   auto spBuffer = make_unique<uint8_t[]>(nAvailable);
+    m_mxConnections.lock();
+    const auto itConnection = m_Connections.find(pSocket);
+    const shared_ptr<CONNECTION> pConnection = itConnection != end(m_Connections) ? itConnection->second : nullptr;
+    m_mxConnections.unlock();
 
-    size_t nRead = pSocket->Read(&spBuffer[0], nAvailable);
+    if (pConnection == nullptr)
+        return;
 
-    if (nRead > 0)
+    lock_guard<mutex> lock(pConnection->mxRequests);
+    REQUEST& lstRequests = pConnection->lstRequests;
+
+    // Records the stream keeps in memory of its own (shm) are parsed where they are, the others are read into the parser
+    size_t nReceived = 0;
+    uint8_t* const pReceived = pSocket->PeekReceived(nReceived);
+    if (pReceived == nullptr)
     {
-        m_mxConnections.lock();
-        const auto itConnection = m_Connections.find(pSocket);
-        if (itConnection != end(m_Connections))
+        const size_t nRead = pSocket->Read(pConnection->Parser.GetWriteBuffer(nAvailable), nAvailable);
+        pConnection->Parser.Commit(nRead);
+    }
+
+    const auto fnRecord = [&](const uint8_t nType, const uint16_t nRequestId, uint8_t* pContent, const uint16_t nContentLen) -> bool
+    {
+        const auto itRequest = find_if(begin(lstRequests), end(lstRequests), [nRequestId](const unique_ptr<REQUESTPARAM>& pReq) noexcept { return pReq->nRequestId == nRequestId; });
+        if (m_spMetrics != nullptr)
+            m_spMetrics->RecordIn(nType, nContentLen);
+
+        switch (nType)
         {
-            FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&spBuffer[0]);
+        case FCGI_GET_VALUES:
+            if (itRequest != end(lstRequests))
+                return false;
+            else
+            {
+                uint8_t caBuffer[256];
+                FCGI_Header* pNewHeader = reinterpret_cast<FCGI_Header*>(caBuffer);
+                uint8_t* pValues = &caBuffer[sizeof(FCGI_Header)];
+                uint16_t nValuesLen = 0;
+
+                const uint8_t* pParam = pContent;
+                const char* pKey, *pValue;
+                uint32_t nKeyLen, nValueLen;
+                while (NextNameValuePair(&pParam, pContent + nContentLen, &pKey, nKeyLen, &pValue, nValueLen) == true)
+                {
+                    const string strVariable(pKey, nKeyLen);
+                    string strValue;
+                    if (strVariable == FCGI_MAX_CONNS)
+                        strValue = to_string(GetMaxConns());
+                    else if (strVariable == FCGI_MAX_REQS)
+                        strValue = to_string(GetMaxReqs());
+                    else if (strVariable == FCGI_MPXS_CONNS)
+                        strValue = m_bMultiplex == true ? "1" : "0";
+                    else
+                        continue;   // Unknown variables are left out of the answer
+                    if (nValuesLen + 8 + strVariable.size() + strValue.size() > sizeof(caBuffer) - sizeof(FCGI_Header) - 8)
+                        break;
+                    nValuesLen += AddNameValuePair(&pValues, strVariable.c_str(), strVariable.size(), strValue.c_str(), strValue.size());
+                }
+                SetRecordHeader(pNewHeader, FCGI_GET_VALUES_RESULT, 0, nValuesLen);
+                std::fill_n(pValues, pNewHeader->paddingLength, 0);
+                pSocket->Write(caBuffer, sizeof(FCGI_Header) + nValuesLen + pNewHeader->paddingLength);
+                if (m_spMetrics != nullptr)
+                    m_spMetrics->RecordOut(FCGI_GET_VALUES_RESULT, nValuesLen);
+            }
+            break;
+
+        case FCGI_BEGIN_REQUEST:
+            if (itRequest != end(lstRequests) || nContentLen < sizeof(FCGI_BeginRequestBody))
+                return false;
+            else if (m_bMultiplex == false && lstRequests.empty() == false)
+            {   // Only one request at a time on this connection, the following records of the request are ignored
+                SendEndRequest(pSocket, nRequestId, 0, FCGI_CANT_MPX_CONN);
+                if (m_spMetrics != nullptr)
+                    m_spMetrics->Add(FastCgiMetrics::REQUESTS_OVERLOADED);
+            }
+            else if (m_nActiveRequests.fetch_add(1) >= GetMaxReqs())
+            {   // More than FCGI_MAX_REQS, also rejected
+                --m_nActiveRequests;
+                SendEndRequest(pSocket, nRequestId, 0, FCGI_OVERLOADED);
+                if (m_spMetrics != nullptr)
+                    m_spMetrics->Add(FastCgiMetrics::REQUESTS_OVERLOADED);
+            }
+            else
+            {
+                FCGI_BeginRequestBody* pBody = reinterpret_cast<FCGI_BeginRequestBody*>(pContent);
+                if (pConnection->lstFree.empty() == true)
+                    lstRequests.emplace_back(make_unique<REQUESTPARAM>());
+                else
+                {
+                    lstRequests.emplace_back(move(pConnection->lstFree.back()));
+                    pConnection->lstFree.pop_back();
+                }
+                lstRequests.back()->nRequestId = nRequestId;
+                lstRequests.back()->nState = 0;
+                lstRequests.back()->bAborted = false;
+                lstRequests.back()->tmBegin = chrono::steady_clock::now();
+                if (m_spMetrics != nullptr)
+                {
+                    m_spMetrics->Add(FastCgiMetrics::REQUESTS_STARTED);
+                    m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, 1);
+                }
+                if (m_spTracer != nullptr)
+                    m_spTracer->Event(pConnection.get(), nRequestId, FastCgiTracer::SERVER_BEGIN_REQUEST, lstRequests.back()->tmBegin);
+                ToShort(&pBody->roleB1); // FCGI_RESPONDER , FCGI_AUTHORIZER , FCGI_FILTER
+                //pBody->flags;  // FCGI_KEEP_CONN
+            }
+            break;
 
-            while (nRead > 0)
+        case FCGI_PARAMS:
+            if (itRequest == end(lstRequests))
+            {   // Request is not active (e.g. rejected), the record is ignored
+            }
+            else if ((*itRequest)->nState != 0)
+                return false;
+            else if (nContentLen == 0)
             {
-                const uint16_t nRequestId = ToShort(&pHeader->requestIdB1);
-                uint16_t nContentLen = ToShort(&pHeader->contentLengthB1);
-                const uint8_t nPaddingLen = pHeader->paddingLength;
-                uint8_t* pContent = reinterpret_cast<uint8_t*>(pHeader) + sizeof(FCGI_Header);
-                FCGI_Header* pNextHeader = reinterpret_cast<FCGI_Header*>(pContent + nContentLen + nPaddingLen);
+                REQUESTPARAM& Request = **itRequest;
+                Request.nState++;
 
-                const auto itRequest = itConnection->second.find(nRequestId); // Get the Request from the Request ID
+                // All PARAMS records are collected, name-value pairs may span record boundaries
+                Request.Params.Parse(Request.strBuffer);
+                Request.Params.m_pbAborted = &Request.bAborted;
+                if (m_spTracer != nullptr)
+                    m_spTracer->Event(pConnection.get(), nRequestId, FastCgiTracer::SERVER_PARAMS_COMPLETE);
 
-                if (nRead < sizeof(FCGI_Header) + nContentLen + nPaddingLen)
+                if (Request.pOutBuf == nullptr)
                 {
-                    pSocket->PutBackRead(pHeader, nRead);
-                    m_mxConnections.unlock();
-                    return;
+                    Request.pOutBuf = make_unique<StreamOutBuffer>(pSocket, nRequestId, m_nRecordSize, m_tmMaxDelay, m_spMetrics.get(), Request.tmBegin, &Request.bAborted);
+                    Request.pStreamOut = make_unique<ostream>(Request.pOutBuf.get());
+                    Request.pInBuf = make_unique<StreamInBuffer>();
+                    Request.pStreamIn = make_unique<istream>(Request.pInBuf.get());
+                }
+                else    // Streams of a previous request, the handler may have changed their state
+                {
+                    Request.pOutBuf->Reset(pSocket, nRequestId, m_nRecordSize, m_tmMaxDelay, m_spMetrics.get(), Request.tmBegin, &Request.bAborted);
+                    ResetStream(*Request.pStreamOut);
+                    ResetStream(*Request.pStreamIn);
                 }
 
-                nRead -= sizeof(FCGI_Header) + nContentLen + nPaddingLen;
+                packaged_task<void()> taskDoAction(bind(&FastCgiServer::DoAction, this, pConnection, &Request));
+                Request.ftDoAction = taskDoAction.get_future();
 
-                switch (pHeader->type)
+                if (m_WorkerPool.Post(taskDoAction) == false)   // Run queue is full
                 {
-                case FCGI_GET_VALUES:
-                    if (itRequest != end(itConnection->second))
+                    SendEndRequest(pSocket, nRequestId, 0, FCGI_OVERLOADED);
+                    ReleaseRequest(*pConnection, itRequest);
+                    if (m_spTracer != nullptr)
+                        m_spTracer->Event(pConnection.get(), nRequestId, FastCgiTracer::SERVER_END_REQUEST);
+                    if (m_spMetrics != nullptr)
                     {
-                        pSocket->Close();
-                        nRead = 0;
+                        m_spMetrics->Add(FastCgiMetrics::REQUESTS_OVERLOADED);
+                        m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
                     }
-                    else
-                    {
-                        vector<string> vstrVariablen;
-                        while (nContentLen != 0)
-                        {
-                            const uint32_t nVarNameLen = ToNumber(&pContent, nContentLen);
-                            const uint32_t nVarValueLen = ToNumber(&pContent, nContentLen);
-                            const string strVarName, strVarValue;
-                            if (nVarNameLen > 0)
-                                vstrVariablen.push_back(string(reinterpret_cast<char*>(pContent), nVarNameLen)), pContent += nVarNameLen, nContentLen -= static_cast<uint16_t>(nVarNameLen);
-                            pContent += nVarValueLen, nContentLen -= static_cast<uint16_t>(nVarValueLen);
-                        }
-
-                        auto spBufWrite = make_unique<uint8_t[]>(1024);    // Reserve new buffer with more room
-                        FCGI_Header* pNewHeader = reinterpret_cast<FCGI_Header*>(&spBufWrite[0]);       // get the pointer to the header
-                        copy(pHeader, pHeader + 1/*sizeof(FCGI_Header)*/, pNewHeader);   // copy the received header to your new buffer
-                        pContent = &spBufWrite[sizeof(FCGI_Header)];
-                        nContentLen = 0;
-                        for (const auto& strVariable : vstrVariablen)
-                        {
-                            if (strVariable == FCGI_MAX_CONNS)
-                                nContentLen += AddNameValuePair(&pContent, strVariable.c_str(), strVariable.size(), "10", 2);
-                            else if (strVariable == FCGI_MAX_REQS)
-                                nContentLen += AddNameValuePair(&pContent, strVariable.c_str(), strVariable.size(), "50", 2);
-                            else if (strVariable == FCGI_MPXS_CONNS)
-                                nContentLen += AddNameValuePair(&pContent, strVariable.c_str(), strVariable.size(), "1", 1);
-                        }
-                        FromShort(&pNewHeader->contentLengthB1, nContentLen);
-                        pNewHeader->type = FCGI_GET_VALUES_RESULT;
-                        pNewHeader->paddingLength = (8 - (nContentLen % 8)) & 7;
-                        std::fill_n(pContent, pNewHeader->paddingLength, 0);
-                        pSocket->Write(&spBufWrite[0], sizeof(FCGI_Header) + nContentLen + pNewHeader->paddingLength);
-                    }
-                    pHeader = pNextHeader;
-                    break;
+                }
+                else if (m_spMetrics != nullptr)
+                    m_spMetrics->SetGauge(FastCgiMetrics::QUEUE_DEPTH, static_cast<int64_t>(m_WorkerPool.GetQueueLen()));
+            }
+            else if ((*itRequest)->strBuffer.size() + nContentLen > m_nMaxParamsSize)
+            {   // Otherwise a client sending PARAMS without the end could grow the buffer until we run out of memory
+                SendEndRequest(pSocket, nRequestId, 0, FCGI_OVERLOADED);
+                (*itRequest)->strBuffer = string();
+                ReleaseRequest(*pConnection, itRequest);    // The following records of the request are ignored
+                if (m_spTracer != nullptr)
+                    m_spTracer->Event(pConnection.get(), nRequestId, FastCgiTracer::SERVER_END_REQUEST);
+                if (m_spMetrics != nullptr)
+                {
+                    m_spMetrics->Add(FastCgiMetrics::REQUESTS_TOO_LARGE);
+                    m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
+                }
+            }
+            else
+                (*itRequest)->strBuffer.append(reinterpret_cast<char*>(pContent), nContentLen);
+            break;
 
-                case FCGI_BEGIN_REQUEST:
-                    if (itRequest != end(itConnection->second))
-                    {
-                        pSocket->Close();
-                        nRead = 0;
-                    }
-                    else
-                    {
-                        FCGI_BeginRequestRecord* pRecord = reinterpret_cast<FCGI_BeginRequestRecord*>(&spBuffer[0]);
-                        itConnection->second.emplace(nRequestId, REQUESTPARAM());
-                        ToShort(&pRecord->body.roleB1); // FCGI_RESPONDER , FCGI_AUTHORIZER , FCGI_FILTER
-                        //pRecord->body.flags;  // FCGI_KEEP_CONN
-                    }
-                    pHeader = pNextHeader;
-                    break;
+        case FCGI_STDIN:
+            if (itRequest == end(lstRequests) || (*itRequest)->bAborted == true)
+            {   // Request is not active (e.g. rejected, aborted or already finished), the record is ignored
+            }
+            else if ((*itRequest)->nState != 1)
+                return false;
+            else if (nContentLen == 0)
+            {
+                // The request is finished by DoAction, when the handler returns
+                (*itRequest)->pInBuf->SetEof();
+            }
+            else if (pReceived != nullptr)  // Stays in the memory of the stream until the request read it
+            {
+                const shared_ptr<uint8_t> spChunk = pSocket->HoldReceived(pContent, nContentLen);
+                (*itRequest)->pInBuf->AddChunk(spChunk, spChunk.get(), nContentLen);
+            }
+            else    // The content stays in the receive buffer, the request holds a reference to it
+                (*itRequest)->pInBuf->AddChunk(pConnection->Parser.GetBuffer(), pContent, nContentLen);
+            break;
 
-                case FCGI_PARAMS:
-                    if (itRequest == end(itConnection->second) || itRequest->second.nState != 0)
-                    {
-                        pSocket->Close();
-                        nRead = 0;
-                    }
-                    else if (nContentLen == 0)
-                    {
-                        itRequest->second.nState++;
-
-                        itRequest->second.obuf = make_unique<streambuf*>(make_callback_ostreambuf([&](const void* buf, std::streamsize sz, void* user_data1, void* user_data2) -> std::streamsize
-                        {
-                            TcpSocket* pSock = reinterpret_cast<TcpSocket*>(user_data2);
-                            auto pSendBuffer = make_unique<uint8_t[]>(sizeof(FCGI_Header) + 16368 + 8);
-                            FCGI_Header* pHeader = reinterpret_cast<FCGI_Header*>(&pSendBuffer[0]);
-                            pHeader->version = 1;
-                            pHeader->type = FCGI_STDOUT;
-                            FromShort(&pHeader->requestIdB1, static_cast<uint16_t>(reinterpret_cast<size_t>(user_data1)));
-                            pHeader->paddingLength = 0;
-                            pHeader->reserved = 0;
-
-                            const size_t nAnzahl = sz;
-                            size_t nOffset = 0;
-
-                            while (nAnzahl - nOffset != 0)
-                            {
-                                const uint16_t sSend = static_cast<uint16_t>(std::min(nAnzahl - nOffset, static_cast<size_t>(16368)));
-                                FromShort(&pHeader->contentLengthB1, sSend);
-                                pHeader->paddingLength = (8 - (sSend % 8)) & 7;
-                                std::copy_n(reinterpret_cast<const uint8_t*>(buf) + nOffset, sSend, &pSendBuffer[sizeof(FCGI_Header)]);
-                                std::fill_n(&pSendBuffer[sizeof(FCGI_Header) + sSend], pHeader->paddingLength, 0);
-                                pSock->Write(&pSendBuffer[0], sizeof(FCGI_Header) + sSend + pHeader->paddingLength);
-                                nOffset += sSend;
-                            }
-
-                            //cout.write(reinterpret_cast<const char*>(buf), sz);
-                            return sz; // return the numbers of characters written.
-                        }, reinterpret_cast<void*>(nRequestId), pSocket));
-
-                        itRequest->second.streamOut = make_unique<ostream*>(new ostream(*itRequest->second.obuf.get())); //ostr << "TEST " << 42; // Write string and integer
-                        itRequest->second.ibuf = make_unique<streambuf*>(new StreamInBuffer());
-                        itRequest->second.stremIn = make_unique<iostream*>(new iostream(*itRequest->second.ibuf.get()));
-                        itRequest->second.thDoAction = thread([&](PARAMETERLIST& lstParameter, ostream* outStream, istream* inStream)
-                        {
-                            m_fnDoAction(lstParameter, *outStream, *inStream);
-                        }, ref(itRequest->second.lstParameter), *itRequest->second.streamOut.get(), *itRequest->second.stremIn.get());
-                    }
-                    else
-                    {
-                        while (nContentLen != 0)
-                        {
-                            const uint32_t nVarNameLen = ToNumber(&pContent, nContentLen);
-                            const uint32_t nVarValueLen = ToNumber(&pContent, nContentLen);
-                            string strVarName, strVarValue;
-                            if (nVarNameLen > 0)
-                                strVarName = string(reinterpret_cast<char*>(pContent), nVarNameLen), pContent += nVarNameLen, nContentLen -= static_cast<uint16_t>(nVarNameLen);
-                            if (nVarValueLen > 0)
-                                strVarValue = string(reinterpret_cast<char*>(pContent), nVarValueLen), pContent += nVarValueLen, nContentLen -= static_cast<uint16_t>(nVarValueLen);
-
-                            itRequest->second.lstParameter.emplace(strVarName, strVarValue);
-                        }
-                    }
-                    pHeader = pNextHeader;
-                    break;
+        case FCGI_ABORT_REQUEST:    // Ends only this request, the others on the connection go on
+            if (itRequest == end(lstRequests) || (*itRequest)->bAborted == true)
+            {   // Already finished, FCGI_END_REQUEST is on the way
+            }
+            else if ((*itRequest)->nState == 0)
+            {   // No handler yet, we answer right away
+                SendEndRequest(pSocket, nRequestId, 0, FCGI_REQUEST_COMPLETE);
+                ReleaseRequest(*pConnection, itRequest);
+                if (m_spTracer != nullptr)
+                    m_spTracer->Event(pConnection.get(), nRequestId, FastCgiTracer::SERVER_END_REQUEST);
+                if (m_spMetrics != nullptr)
+                {
+                    m_spMetrics->Add(FastCgiMetrics::REQUESTS_ABORTED);
+                    m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
+                }
+            }
+            else
+            {   // The handler sees the flag, its output is discarded, DoAction sends FCGI_END_REQUEST when it returns
+                (*itRequest)->bAborted = true;
+                (*itRequest)->pInBuf->SetEof();
+            }
+            break;
 
-                case FCGI_STDIN:
-                    if (itRequest == end(itConnection->second) || itRequest->second.nState != 1)
-                    {
-                        pSocket->Close();
-                        nRead = 0;
-                    }
-                    else
-                    {
-                        if (nContentLen == 0)
-                        {
-                            reinterpret_cast<StreamInBuffer*>((*itRequest->second.stremIn.get())->rdbuf())->SetEof();
-                            //(*itRequest->second.stremIn.get())->setstate(ios::eofbit);
-                            if (itRequest->second.thDoAction.joinable() == true)
-                                itRequest->second.thDoAction.join();
-
-                            // Empty STDOUT packet
-                            pHeader->type = FCGI_STDOUT;
-                            FromShort(&pHeader->contentLengthB1, 0);
-                            pHeader->paddingLength = 0;
-                            pSocket->Write(pHeader, sizeof(FCGI_Header));
-
-                            auto spBufWrite = make_unique<uint8_t[]>(1024);    // Reserve new buffer with more room
-                            FCGI_EndRequestRecord* pEndRequest = reinterpret_cast<FCGI_EndRequestRecord*>(&spBufWrite[0]);       // get the pointer to the header
-                            copy(pHeader, pHeader + 1, &pEndRequest->header);                // copy the received header to your new buffer
-
-                            pEndRequest->header.type = FCGI_END_REQUEST;
-                            FromShort(&pHeader->contentLengthB1, sizeof(FCGI_EndRequestBody));
-
-                            unsigned char* pTmp = &pEndRequest->body.appStatusB3;
-                            FromNumber(&pTmp, 0);
-                            pEndRequest->body.protocolStatus = FCGI_REQUEST_COMPLETE;
-
-                            pSocket->Write(pEndRequest, sizeof(FCGI_EndRequestRecord));
-
-                            itConnection->second.erase(itRequest);
-                        }
-                        else
-                        {
-                            (*itRequest->second.stremIn.get())->write(reinterpret_cast<char*>(pContent), nContentLen);
-                        }
-                    }
-                    pHeader = pNextHeader;
-                    break;
+        default:
+            return false;
+        }
+
+        return true;
+    };
+
+    bool bValid;
+    if (pReceived != nullptr)
+    {
+        size_t nParsed;
+        bValid = RecordParser::ParseRecords(pReceived, nReceived, nParsed, fnRecord);
+        pSocket->ConsumeReceived(nParsed);
+    }
+    else
+        bValid = pConnection->Parser.Parse(fnRecord);
 
-                default:
-                    pSocket->Close();
-                    nRead = 0;
-                    break;
+    if (bValid == false)
+        pSocket->Close();
+}
+
+void FastCgiServer::OnSocketError(FastCgiStream* const pSocket)
+{
+    pSocket->Close();
+}
+
+void FastCgiServer::OnSocketClosing(FastCgiStream* const pSocket)
+{
+    m_mxConnections.lock();
+    const auto itConnection = m_Connections.find(pSocket);
+    const shared_ptr<CONNECTION> pConnection = itConnection != end(m_Connections) ? itConnection->second : nullptr;
+    m_mxConnections.unlock();
+
+    if (pConnection != nullptr)
+    {
+        unique_lock<mutex> lock(pConnection->mxRequests);
+        pConnection->bClosed = true;
+
+        for (auto itReq = begin(pConnection->lstRequests); itReq != end(pConnection->lstRequests);)
+        {
+            if ((*itReq)->ftDoAction.valid() == false)  // Handler not started, nothing to wait for
+            {
+                pConnection->lstFree.emplace_back(move(*itReq));   // Not destroyed, a flush may still have its output buffer
+                itReq = pConnection->lstRequests.erase(itReq);
+                --m_nActiveRequests;
+                if (m_spMetrics != nullptr)
+                {
+                    m_spMetrics->Add(FastCgiMetrics::REQUESTS_ABORTED);
+                    m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
                 }
+                continue;
             }
+
+            // No more data will come, wake up a handler waiting on FCGI_STDIN
+            (*itReq)->pInBuf->SetEof();
+            ++itReq;
         }
 
+        // The socket is destroyed after we return, the running handlers and the flush must be done with it
+        pConnection->cvRequests.wait(lock, [&]() noexcept { return pConnection->lstRequests.empty() == true && pConnection->bFlushing == false; });
+        lock.unlock();
+
+        m_mxConnections.lock();
+        m_Connections.erase(pSocket);
+        if (m_pSocket != nullptr)   // Below FCGI_MAX_CONNS again, the listener may accept the next one
+            m_pSocket->NotifyAcceptCondition();
         m_mxConnections.unlock();
     }
 }
 
-void FastCgiServer::OnSocketError(BaseSocket* const pSocket)
+void FastCgiServer::DoAction(const shared_ptr<CONNECTION> pConnection, REQUESTPARAM* const pReqParam)
 {
-    pSocket->Close();
+    if (m_spMetrics != nullptr)
+        m_spMetrics->SetGauge(FastCgiMetrics::QUEUE_DEPTH, static_cast<int64_t>(m_WorkerPool.GetQueueLen()));
+
+    int nAppStatus = 0;
+    if (pConnection->bClosed == false && pReqParam->bAborted == false)  // Nobody is interested in the result anymore, if the connection is gone or the request aborted
+    {
+        if (m_spTracer != nullptr)
+            m_spTracer->Event(pConnection.get(), pReqParam->nRequestId, FastCgiTracer::SERVER_HANDLER_START);
+        try
+        {
+            if (m_fnDoRequest)
+                nAppStatus = m_fnDoRequest(pReqParam->Params, *pReqParam->pStreamOut, *pReqParam->pStreamIn);
+            else if (m_fnDoAction)  // The map is only built for the handler wanting it
+                nAppStatus = m_fnDoAction(pReqParam->Params.ToMap(), *pReqParam->pStreamOut, *pReqParam->pStreamIn);
+        }
+        catch (const std::exception& ex)
+        {
+            OutputDebugStringA(string("Exception in FastCgi handler: " + string(ex.what()) + "\r\n").c_str());
+            nAppStatus = -1;
+        }
+        catch (...)
+        {
+            nAppStatus = -1;
+        }
+        if (m_spTracer != nullptr)
+            m_spTracer->Event(pConnection.get(), pReqParam->nRequestId, FastCgiTracer::SERVER_HANDLER_END);
+    }
+
+    lock_guard<mutex> lock(pConnection->mxRequests);
+    if (pConnection->bClosed == false)
+    {
+        // Rest of the output, empty STDOUT packet and END_REQUEST
+        pReqParam->pOutBuf->Finish(static_cast<uint32_t>(nAppStatus), FCGI_REQUEST_COMPLETE);
+        if (m_spTracer != nullptr)
+            m_spTracer->Event(pConnection.get(), pReqParam->nRequestId, FastCgiTracer::SERVER_END_REQUEST);
+    }
+
+    if (m_spMetrics != nullptr)
+    {
+        if (pConnection->bClosed == false && pReqParam->bAborted == false)
+        {
+            m_spMetrics->Add(FastCgiMetrics::REQUESTS_COMPLETED);
+            m_spMetrics->Observe(FastCgiMetrics::TOTAL_TIME, chrono::steady_clock::now() - pReqParam->tmBegin);
+        }
+        else
+            m_spMetrics->Add(FastCgiMetrics::REQUESTS_ABORTED);
+        m_spMetrics->AddGauge(FastCgiMetrics::REQUESTS_IN_FLIGHT, -1);
+    }
+    ReleaseRequest(*pConnection, find_if(begin(pConnection->lstRequests), end(pConnection->lstRequests), [pReqParam](const unique_ptr<REQUESTPARAM>& pReq) noexcept { return pReq.get() == pReqParam; }));
+    pConnection->cvRequests.notify_all();
 }
 
-void FastCgiServer::OnSocketClosing(BaseSocket* const pSocket)
+void FastCgiServer::ReleaseRequest(CONNECTION& Connection, const REQUEST::iterator itRequest)    // Connection.mxRequests must be locked
 {
-    m_mxConnections.lock();
-    const auto itConnection = m_Connections.find(reinterpret_cast<TcpSocket*>(pSocket));
-    if (itConnection != end(m_Connections))
+    if (itRequest == end(Connection.lstRequests))
+        return;
+
+    REQUESTPARAM& Request = **itRequest;
+    Request.strBuffer.clear();
+    Request.ftDoAction = future<void>();
+    if (Request.pInBuf != nullptr)
+        Request.pInBuf->Reset();
+
+    Connection.lstFree.emplace_back(move(*itRequest));
+    *itRequest = move(Connection.lstRequests.back());
+    Connection.lstRequests.pop_back();
+    --m_nActiveRequests;
+}
+
+// Finds the output buffered longer than m_tmMaxDelay, the handlers may not write again for a long time. m_FlushPool sends it,
+// the connection lock is not held while writing. A connection gets the next flush only after the last one is done.
+void FastCgiServer::FlushTimer()
+{
+    unique_lock<mutex> lock(m_mxFlush);
+    chrono::steady_clock::time_point tmNext = chrono::steady_clock::now() + m_tmMaxDelay;
+    while (m_cvFlush.wait_until(lock, tmNext, [&]() noexcept { return m_bStopFlush; }) == false)
     {
-        for (auto itReq = begin(itConnection->second); itReq != end(itConnection->second); ++itReq)
+        lock.unlock();
+
+        vector<shared_ptr<CONNECTION>> vConnections;
+        m_mxConnections.lock();
+        for (auto& item : m_Connections)
+            vConnections.push_back(item.second);
+        m_mxConnections.unlock();
+
+        const chrono::steady_clock::time_point tmNow = chrono::steady_clock::now();
+        tmNext = tmNow + m_tmMaxDelay;  // Output written from now on is due not before
+        for (auto& pConnection : vConnections)
         {
-            if (itReq->second.thDoAction.joinable() == true)
+            vector<StreamOutBuffer*> vDue;
             {
-                thread& thAction = itReq->second.thDoAction;
-                m_mxConnections.unlock();
-                thAction.join();
-                m_mxConnections.lock();
+                lock_guard<mutex> lockRequests(pConnection->mxRequests);
+                if (pConnection->bClosed == true || pConnection->bFlushing == true)
+                    continue;
+                for (auto& pRequest : pConnection->lstRequests)
+                {
+                    if (pRequest->ftDoAction.valid() == false)  // The handler is not posted, the output buffer is not set up for this request
+                        continue;
+                    const chrono::steady_clock::time_point tmDue = pRequest->pOutBuf->GetDue();
+                    if (tmDue <= tmNow)
+                        vDue.push_back(pRequest->pOutBuf.get());
+                    else
+                        tmNext = min(tmNext, tmDue);
+                }
+                if (vDue.empty() == true)
+                    continue;
+                pConnection->bFlushing = true;
             }
+
+            // The buffers stay with the connection, a request finished meanwhile has nothing due anymore
+            packaged_task<void()> taskFlush([pConnection, vDue]()
+            {
+                for (auto pOutBuf : vDue)
+                    pOutBuf->FlushIfDue(chrono::steady_clock::now());
+                lock_guard<mutex> lockRequests(pConnection->mxRequests);
+                pConnection->bFlushing = false;
+                pConnection->cvRequests.notify_all();
+            });
+            m_FlushPool.Post(taskFlush);
         }
-        m_Connections.erase(itConnection);
+
+        lock.lock();
     }
-    m_mxConnections.unlock();
+}
+
+void FastCgiServer::StopFlushTimer()
+{
+    if (m_thFlush.joinable() == false)
+        return;
+
+    m_mxFlush.lock();
+    m_bStopFlush = true;
+    m_mxFlush.unlock();
+    m_cvFlush.notify_all();
+    m_thFlush.join();
+    m_FlushPool.Stop();     // After the flushes posted
+}
+
+void FastCgiServer::SendEndRequest(FastCgiStream* const pSocket, const uint16_t nRequestId, const uint32_t nAppStatus, const uint8_t nProtocolStatus)
+{
+    FCGI_EndRequestRecord EndRequest{};
+    EndRequest.header.version = 1;
+    EndRequest.header.type = FCGI_END_REQUEST;
+    FromShort(&EndRequest.header.requestIdB1, nRequestId);
+    FromShort(&EndRequest.header.contentLengthB1, sizeof(FCGI_EndRequestBody));
+
+    EndRequest.body.appStatusB3 = (nAppStatus >> 24) & 0xff;
+    EndRequest.body.appStatusB2 = (nAppStatus >> 16) & 0xff;
+    EndRequest.body.appStatusB1 = (nAppStatus >> 8) & 0xff;
+    EndRequest.body.appStatusB0 = nAppStatus & 0xff;
+    EndRequest.body.protocolStatus = nProtocolStatus;
+
+    pSocket->Write(&EndRequest, sizeof(FCGI_EndRequestRecord));
+    if (m_spMetrics != nullptr)
+        m_spMetrics->RecordOut(FCGI_END_REQUEST, sizeof(FCGI_EndRequestBody));
 }
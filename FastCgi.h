@@ -12,13 +12,20 @@
 
 #include <functional>
 #include <string>
+#include <cstring>
 #include <map>
+#include <array>
 #include <condition_variable>
 #include <sstream>
 #include <thread>
 #include <atomic>
+#include <deque>
+#include <future>
 
-#include "SocketLib/SocketLib.h"
+#include "Transport.h"
+#include "BufferPool.h"
+#include "Metrics.h"
+#include "Trace.h"
 #if defined(_WIN32) || defined(_WIN64)
 #include <Windows.h>
 #define Null nullptr
@@ -31,21 +38,216 @@ using namespace std;
 
 typedef map<string, string> PARAMETERLIST;   // Name des Parameters, Wert des Parameters
 
+// Name or value of a request parameter, points into the parameter buffer of the request
+class ParamView
+{
+public:
+    constexpr ParamView() noexcept : m_pData(""), m_nLen(0) {}
+    constexpr ParamView(const char* pData, size_t nLen) noexcept : m_pData(pData), m_nLen(nLen) {}
+
+    const char* data() const noexcept { return m_pData; }
+    size_t size() const noexcept { return m_nLen; }
+    bool empty() const noexcept { return m_nLen == 0; }
+    string str() const { return string(m_pData, m_nLen); }
+    bool operator==(const ParamView& Other) const noexcept { return m_nLen == Other.m_nLen && memcmp(m_pData, Other.m_pData, m_nLen) == 0; }
+    bool operator!=(const ParamView& Other) const noexcept { return !(*this == Other); }
+    bool operator==(const char* szOther) const noexcept { return *this == ParamView(szOther, strlen(szOther)); }
+    bool operator!=(const char* szOther) const noexcept { return !(*this == szOther); }
+
+private:
+    const char* m_pData;
+    size_t      m_nLen;
+};
+
+// Parameters of one request. The FCGI_PARAMS content is kept as it was received,
+// the index holds the offsets of the names and values in it.
+class FastCgiParams
+{
+    friend class FastCgiServer;
+    typedef struct
+    {
+        uint32_t nName;
+        uint32_t nNameLen;
+        uint32_t nValue;
+        uint32_t nValueLen;
+    }PARAMENTRY;
+
+public:
+    enum KNOWNPARAM : uint8_t   // Parameters found without searching, the names are returned by KnownName
+    {
+        REQUEST_METHOD, SCRIPT_FILENAME, SCRIPT_NAME, CONTENT_LENGTH, CONTENT_TYPE, QUERY_STRING,
+        REQUEST_URI, DOCUMENT_URI, DOCUMENT_ROOT, PATH_INFO, SERVER_NAME, SERVER_PORT, SERVER_PROTOCOL,
+        REMOTE_ADDR, REMOTE_PORT, HTTP_HOST, HTTP_COOKIE, HTTPS, KNOWN_COUNT
+    };
+
+    FastCgiParams() noexcept : m_pbAborted(nullptr) { m_anKnown.fill(UINT32_MAX); }
+
+    size_t size() const noexcept { return m_vIndex.size(); }
+    ParamView GetName(const size_t nIndex) const noexcept { return ParamView(&m_strArena[m_vIndex[nIndex].nName], m_vIndex[nIndex].nNameLen); }
+    ParamView GetValue(const size_t nIndex) const noexcept { return ParamView(&m_strArena[m_vIndex[nIndex].nValue], m_vIndex[nIndex].nValueLen); }
+    ParamView Get(const KNOWNPARAM nParam) const noexcept { return m_anKnown[nParam] != UINT32_MAX ? GetValue(m_anKnown[nParam]) : ParamView(); }
+    ParamView Get(const char* szName) const noexcept;
+    bool Has(const KNOWNPARAM nParam) const noexcept { return m_anKnown[nParam] != UINT32_MAX; }
+    bool Has(const char* szName) const noexcept;
+    PARAMETERLIST ToMap() const;
+    // The client sent FCGI_ABORT_REQUEST, the handler should stop. Its output is discarded from then on.
+    bool IsAborted() const noexcept { return m_pbAborted != nullptr && m_pbAborted->load(memory_order_relaxed); }
+    // Indexes the name-value pairs of the FCGI_PARAMS content in strParams, takes the string without copying it
+    void Parse(string& strParams);
+
+    static ParamView KnownName(const KNOWNPARAM nParam) noexcept;
+
+private:
+    size_t Find(const char* szName, const size_t nNameLen) const noexcept;
+
+private:
+    string                   m_strArena;    // Content of all FCGI_PARAMS records of the request
+    vector<PARAMENTRY>       m_vIndex;      // In the order received
+    array<uint32_t, KNOWN_COUNT> m_anKnown; // Index in m_vIndex, UINT32_MAX if not sent
+    const atomic<bool>*      m_pbAborted;   // Flag of the server request, valid while its handler runs
+};
+
+// Name of a parameter known at compile time, e.g. CgiName("SERVER_SOFTWARE"), its length is encoded by the compiler
+class CgiName
+{
+public:
+    template <size_t N>
+    explicit constexpr CgiName(const char (&szName)[N]) noexcept : m_szName(szName), m_nLen(N - 1),
+        m_aLength{ N - 1 < 128 ? static_cast<uint8_t>(N - 1) : static_cast<uint8_t>(0x80 | (((N - 1) >> 24) & 0x7f)),
+                   static_cast<uint8_t>(((N - 1) >> 16) & 0xff), static_cast<uint8_t>(((N - 1) >> 8) & 0xff), static_cast<uint8_t>((N - 1) & 0xff) },
+        m_nLengthLen(N - 1 < 128 ? 1 : 4) {}
+
+    constexpr const char* data() const noexcept { return m_szName; }
+    constexpr size_t size() const noexcept { return m_nLen; }
+
+private:
+    friend class FastCgiParamBlock;
+    const char* m_szName;
+    size_t      m_nLen;
+    uint8_t     m_aLength[4];   // Length of the name as FastCGI encodes it
+    uint8_t     m_nLengthLen;
+};
+
+// Name-value pairs encoded once and copied as they are into the FCGI_PARAMS of each request,
+// e.g. the variables that are the same for all requests to a virtual host
+class FastCgiParamBlock
+{
+public:
+    FastCgiParamBlock& Add(const CgiName& Name, const char* pValue, const size_t nValueLen);
+    FastCgiParamBlock& Add(const CgiName& Name, const string& strValue) { return Add(Name, strValue.c_str(), strValue.size()); }
+    FastCgiParamBlock& Add(const char* pName, const size_t nNameLen, const char* pValue, const size_t nValueLen);
+    FastCgiParamBlock& Add(const string& strName, const string& strValue) { return Add(strName.c_str(), strName.size(), strValue.c_str(), strValue.size()); }
+    void Clear() noexcept { m_vEncoded.clear(); }
+
+    const uint8_t* data() const noexcept { return m_vEncoded.data(); }
+    size_t size() const noexcept { return m_vEncoded.size(); }
+
+private:
+    vector<uint8_t> m_vEncoded;
+};
+
+namespace CgiNames
+{
+    constexpr CgiName GATEWAY_INTERFACE("GATEWAY_INTERFACE");
+    constexpr CgiName SERVER_SOFTWARE("SERVER_SOFTWARE");
+    constexpr CgiName SERVER_NAME("SERVER_NAME");
+    constexpr CgiName SERVER_ADDR("SERVER_ADDR");
+    constexpr CgiName SERVER_PORT("SERVER_PORT");
+    constexpr CgiName SERVER_PROTOCOL("SERVER_PROTOCOL");
+    constexpr CgiName DOCUMENT_ROOT("DOCUMENT_ROOT");
+    constexpr CgiName REQUEST_METHOD("REQUEST_METHOD");
+    constexpr CgiName REQUEST_URI("REQUEST_URI");
+    constexpr CgiName QUERY_STRING("QUERY_STRING");
+    constexpr CgiName SCRIPT_NAME("SCRIPT_NAME");
+    constexpr CgiName SCRIPT_FILENAME("SCRIPT_FILENAME");
+    constexpr CgiName PATH_INFO("PATH_INFO");
+    constexpr CgiName CONTENT_TYPE("CONTENT_TYPE");
+    constexpr CgiName CONTENT_LENGTH("CONTENT_LENGTH");
+    constexpr CgiName REMOTE_ADDR("REMOTE_ADDR");
+    constexpr CgiName REMOTE_PORT("REMOTE_PORT");
+    constexpr CgiName REDIRECT_STATUS("REDIRECT_STATUS");
+    constexpr CgiName HTTPS("HTTPS");
+}
+
 class FastCgiBase
 {
+    friend class FastCgiParams;
+    friend class FastCgiParamBlock;
 public:
     uint16_t AddNameValuePair(uint8_t** pBuffer, const char* pKey, size_t nKeyLen, const char* pValue, size_t nValueLen) noexcept;
 
 protected:
+    // Incremental record parser for one connection. The received bytes are read directly into its buffer,
+    // a record spread over several receive calls is completed where it is, without copying the data again.
+    class RecordParser
+    {
+    public:
+        RecordParser() noexcept : m_nCapacity(0), m_nStart(0), m_nEnd(0) {}
+
+        uint8_t* GetWriteBuffer(const size_t nMinSize);
+        void Commit(const size_t nLen) noexcept { m_nEnd += nLen; }
+        const shared_ptr<uint8_t>& GetBuffer() const noexcept { return m_spBuffer; }
+        void Reset() noexcept;
+
+        // Calls fnRecord(nType, nRequestId, pContent, nContentLen) for each complete record.
+        // Returns false if the data is no FastCGI record or fnRecord returned false.
+        template <typename FN_RECORD>
+        bool Parse(FN_RECORD fnRecord)
+        {
+            size_t nParsed;
+            const bool bValid = ParseRecords(m_spBuffer.get() + m_nStart, m_nEnd - m_nStart, nParsed, fnRecord);
+            m_nStart += nParsed;
+            return bValid;
+        }
+
+        // The same on bytes somebody else keeps, e.g. a stream in shared memory. nParsed gets the length of the records.
+        // Each byte of a header is read once, the other side may still write to them.
+        template <typename FN_RECORD>
+        static bool ParseRecords(uint8_t* const pData, const size_t nLen, size_t& nParsed, FN_RECORD fnRecord)
+        {
+            nParsed = 0;
+            while (nLen - nParsed >= 8)     // sizeof(FCGI_Header)
+            {
+                uint8_t* pRecord = pData + nParsed;
+                if (pRecord[0] != 1)    // version
+                    return false;
+
+                const uint16_t nContentLen = static_cast<uint16_t>((pRecord[4] << 8) | pRecord[5]);
+                const size_t nRecordLen = 8 + nContentLen + pRecord[6];
+                if (nLen - nParsed < nRecordLen)
+                    break;
+
+                nParsed += nRecordLen;
+                if (fnRecord(pRecord[1], static_cast<uint16_t>((pRecord[2] << 8) | pRecord[3]), pRecord + 8, nContentLen) == false)
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        shared_ptr<uint8_t> m_spBuffer;     // Shared with FCGI_STDIN chunks not yet read by the request
+        size_t              m_nCapacity;
+        size_t              m_nStart;       // Begin of the first record not yet parsed
+        size_t              m_nEnd;         // End of the received data
+    };
+
     uint16_t ToShort(const uint8_t* const pBuffer) noexcept;
     uint32_t ToNumber(uint8_t** pBuffer, uint16_t& nContentLen) noexcept;
+    static bool NextNameValuePair(const uint8_t** pBuffer, const uint8_t* const pEnd, const char** pKey, uint32_t& nKeyLen, const char** pValue, uint32_t& nValueLen) noexcept;
     void FromShort(uint8_t* const pBuffer, uint16_t sNumber) noexcept;
-    uint16_t FromNumber(uint8_t** pBuffer, uint32_t nNumber) noexcept;
+    static uint16_t FromNumber(uint8_t** pBuffer, uint32_t nNumber) noexcept;
+    // Appends the FCGI_PARAMS records, split at 64 KB, and the empty one ending them. Returns the number of records.
+    static size_t EncodeParams(vector<uint8_t, PoolAllocator<uint8_t>>& vBuffer, const uint16_t nRequestId, const FastCgiParamBlock* const pStaticParams, const vector<pair<string, string>>& vCgiParam);
 };
 
 class FastCgiClient : public FastCgiBase
 {
+    friend class FastCgiClientPool;
+    friend class FastCgiProcessPool;
     typedef function<void(const uint16_t nReqId, const unsigned char*, uint16_t, void*)> FN_OUTPUT;
+    // Called once per request: app status and protocol status of FCGI_END_REQUEST, everything received on FCGI_STDERR.
+    // The protocol status is FCGI_CONNECTION_LOST, if the request ended without FCGI_END_REQUEST.
+    typedef function<void(const uint16_t nReqId, const uint32_t nAppStatus, const uint8_t nProtocolStatus, const string& strStdErr, void*)> FN_COMPLETE;
     typedef struct tagRequest
     {
         FN_OUTPUT           fnDataOutput;
@@ -54,39 +256,96 @@ class FastCgiClient : public FastCgiBase
         bool*               pbReqEnde;
         string              strRecBuf;
         bool                bIsAbort;
+        FN_COMPLETE         fnComplete;
+        chrono::steady_clock::time_point tmStart;   // SendRequest called
+        bool                bHaveOutput;            // First FCGI_STDOUT received
     }REQPARAM;
-    typedef map<uint16_t, REQPARAM> REQLIST;
+    typedef struct
+    {
+        REQPARAM     Request;
+        atomic<bool> bActive{false};    // Set after Request is filled, read without lock on the receive path
+        atomic<bool> bAborted{false};   // AbortRequest, copied to Request.bIsAbort when it is taken out of the slot
+        bool         bRemoved{false};   // RemoveRequest, the server still has the id until its FCGI_END_REQUEST. Guarded by m_mxReqList
+    }REQSLOT;
+    typedef struct
+    {
+        mutex              mxExit;
+        condition_variable cvExit;
+        bool               bExited;     // Set by the thread waiting for the process, it is collected then
+    }PROCESSEXIT;
 
 public:
+    static const uint8_t FCGI_CONNECTION_LOST = 0xff;
+
     FastCgiClient() noexcept;
     FastCgiClient(const wstring& strProcessPath);
+    // The process accepts on spListenSocket (FCGI_LISTENSOCK_FILENO), Connect to its address and port. Several processes may share it.
+    FastCgiClient(const wstring& strProcessPath, const shared_ptr<FastCgiListenSocket>& spListenSocket);
     FastCgiClient(FastCgiClient&&) noexcept;
     virtual ~FastCgiClient() noexcept;
 
-    uint32_t Connect(const string strIpServer, uint16_t usPort, bool bSecondConnection = false);
+    uint32_t Connect(const string strIpServer, uint16_t usPort, bool bSecondConnection = false);   // "unix:/run/app.sock" connects to a unix domain socket, "shm:/run/app.sock" too and offers shared memory
     bool IsConnected() noexcept { return m_bConnected && m_cClosed == 0; }
     uint16_t SendRequest(vector<pair<string, string>>& vCgiParam, condition_variable* pcvReqEnd, bool* pbReqEnde, FN_OUTPUT fnDataOutput, void* vpCbParam = nullptr);
-    void SendRequestData(const uint16_t nRequestId, const char* szBuffer, const uint32_t nBufLen);
+    uint16_t SendRequest(vector<pair<string, string>>& vCgiParam, FN_OUTPUT fnDataOutput, FN_COMPLETE fnComplete, void* vpCbParam = nullptr);
+    // StaticParams are sent in front of vCgiParam without encoding them again
+    uint16_t SendRequest(const FastCgiParamBlock& StaticParams, vector<pair<string, string>>& vCgiParam, condition_variable* pcvReqEnd, bool* pbReqEnde, FN_OUTPUT fnDataOutput, void* vpCbParam = nullptr);
+    uint16_t SendRequest(const FastCgiParamBlock& StaticParams, vector<pair<string, string>>& vCgiParam, FN_OUTPUT fnDataOutput, FN_COMPLETE fnComplete, void* vpCbParam = nullptr);
+    void SendRequestData(const uint16_t nRequestId, const char* szBuffer, const uint32_t nBufLen);    // Borrows the buffer until it returns
+    // Takes a share of the buffer instead, the caller may drop its own reference any time. Released once the data is written.
+    void SendRequestData(const uint16_t nRequestId, const shared_ptr<const char> spBuffer, const uint32_t nBufLen);
     bool AbortRequest(uint16_t nRequestId);
     void RemoveRequest(uint16_t nRequestId);
     bool IsFcgiProcessActiv(size_t nCount = 0);
+    size_t GetProcessMemory() const;    // Resident memory of the started process in bytes, 0 if unknown
+    // Connect tries a started process until tmStart is over, the destructor waits tmStop for it to exit before it is killed
+    void SetProcessTimeouts(const chrono::milliseconds tmStart, const chrono::milliseconds tmStop) noexcept { m_tmStartTimeout = tmStart; m_tmStopTimeout = tmStop; }
+    uint32_t GetMaxConns() const noexcept { return m_FCGI_MAX_CONNS; }
+    uint32_t GetMaxReqs() const noexcept { return m_FCGI_MAX_REQS; }
+    bool IsMultiplexing() const noexcept { return m_FCGI_MPXS_CONNS != 0; }
+    // Off (nullptr) by default, several clients may share one FastCgiMetrics. Set it before Connect.
+    void SetMetrics(const shared_ptr<FastCgiMetrics>& spMetrics) noexcept { m_spMetrics = spMetrics; }
+    const shared_ptr<FastCgiMetrics>& GetMetrics() const noexcept { return m_spMetrics; }
+    // Phase timestamps of the requests, off (nullptr) by default. Set it before Connect.
+    void SetTracer(const shared_ptr<FastCgiTracer>& spTracer) noexcept { m_spTracer = spTracer; }
 
 private:
-    void Connected(TcpSocket* const pTcpSocket) noexcept;
-    void DatenEmpfangen(TcpSocket* const pTcpSocket);
-    void SocketError(BaseSocket* const pBaseSocket);
-    void SocketClosing(BaseSocket* const pBaseSocket);
+    void Connected(FastCgiStream* const pStream) noexcept;
+    void DatenEmpfangen(FastCgiStream* const pStream);
+    void SocketError(FastCgiStream* const pStream);
+    void SocketClosing(FastCgiStream* const pStream);
     void StartFcgiProcess();
+    bool WaitForProcessExit(const chrono::milliseconds tmTimeout);    // true if the process is gone
+    uint32_t ConnectOnce(const string& strIpServer, const uint16_t usPort, const bool bSecondConnection);
+    REQSLOT* FindRequest(const uint16_t nRequestId) const noexcept;
+    REQSLOT* PinRequest(const uint16_t nRequestId) noexcept;
+    void UnpinRequest();
+    uint16_t AddRequest(REQPARAM&& Request);
+    void FreeRequest(const uint16_t nRequestId, REQPARAM* const pRequest = nullptr, const bool bKeepId = false);
+    bool IsRemoved(const uint16_t nRequestId) const noexcept;
+    void ReleaseRequestId(const uint16_t nRequestId);
+    void ClearRequests(const bool bFlushStdErr);
+    void EndRequest(const uint16_t nRequestId, REQPARAM& Request, const uint32_t nAppStatus, const uint8_t nProtocolStatus, const bool bFlushStdErr);
+    uint16_t SendRequest(const FastCgiParamBlock* const pStaticParams, vector<pair<string, string>>& vCgiParam, REQPARAM&& Request);
+    size_t GetActiveRequests() const noexcept { return m_usResquestId - m_quFreeIds.size(); }
 
 private:
-    unique_ptr<TcpSocket> m_pSocket;
+    unique_ptr<FastCgiStream> m_pSocket;
     condition_variable m_cvConnected;
     bool               m_bConnected;
     atomic_char        m_cClosed;
-    REQLIST            m_lstRequest;
-    mutex              m_mxReqList;
-    string             m_strRecBuf;
-    uint16_t           m_usResquestId;
+    array<atomic<REQSLOT*>, 256> m_apReqPages;  // 256 pages with 256 slots each, indexed by the request id
+    deque<uint16_t>    m_quFreeIds;         // Released request ids, the oldest is reused first
+    mutex              m_mxReqList;         // Guards adding and releasing of requests, not the lookup
+    atomic<uint16_t>   m_nPinned{0};        // Request the receive thread delivers a record to, without the lock, 0 = none
+    atomic<thread::id> m_idReceiver;        // The thread pinning, it may release the request it pinned itself
+    atomic<uint32_t>   m_nPinWaiters{0};
+    mutex              m_mxPin;             // For m_cvPin only
+    condition_variable m_cvPin;             // Signaled when m_nPinned is cleared and somebody waits for it
+    RecordParser       m_Parser;
+    shared_ptr<FastCgiMetrics> m_spMetrics;
+    shared_ptr<FastCgiTracer>  m_spTracer;
+    uint16_t           m_usResquestId;      // Highest request id handed out so far
 
     uint32_t           m_nCountCurRequest;
 
@@ -96,31 +355,186 @@ private:
 
     wstring            m_strProcessPath;
     HANDLE             m_hProcess;
+    shared_ptr<PROCESSEXIT> m_spProcessExit;
+    shared_ptr<FastCgiListenSocket> m_spListenSocket;   // Passed to the process, if set
+    chrono::milliseconds m_tmStartTimeout;  // Until a started process must answer FCGI_GET_VALUES
+    chrono::milliseconds m_tmStopTimeout;   // Until a process must exit after SIGTERM
+};
+
+class FastCgiClientPool
+{
+    typedef struct
+    {
+        unique_ptr<FastCgiClient> pClient;
+        uint32_t                  nInUse;     // Number of times the connection is checked out
+    }POOLENTRY;
+
+public:
+    FastCgiClientPool(const string strIpServer, const uint16_t usPort, const uint32_t nMaxIdle = 4);
+    virtual ~FastCgiClientPool() = default;
+
+    uint32_t Prewarm(const uint32_t nCount);
+    FastCgiClient* Acquire();
+    void Release(FastCgiClient* const pClient);
+    size_t GetConnectionCount();
+    // Off (nullptr) by default, shared by the connections created afterwards. Other pools and clients may get the same one.
+    void SetMetrics(const shared_ptr<FastCgiMetrics>& spMetrics) noexcept { m_spMetrics = spMetrics; }
+    const shared_ptr<FastCgiMetrics>& GetMetrics() const noexcept { return m_spMetrics; }  // Of all connections of the pool
+    void SetTracer(const shared_ptr<FastCgiTracer>& spTracer) noexcept { m_spTracer = spTracer; }   // For connections created afterwards
+
+private:
+    unique_ptr<FastCgiClient> NewConnection();
+
+private:
+    string             m_strIpServer;
+    uint16_t           m_usPort;
+    uint32_t           m_nMaxIdle;        // Idle connections kept open, more are closed when released
+    uint32_t           m_nConnecting;     // Connections being established outside the lock
+    mutex              m_mxPool;
+    vector<POOLENTRY>  m_vConnections;
+    shared_ptr<FastCgiMetrics> m_spMetrics;
+    shared_ptr<FastCgiTracer>  m_spTracer;
+
+    bool               m_bHaveValues;     // The values below are read from the backend with the first connection, all guarded by m_mxPool
+    bool               m_bProbing;        // A connection asks for them, the others wait on m_cvValues
+    condition_variable m_cvValues;
+    uint32_t           m_FCGI_MAX_CONNS;
+    uint32_t           m_FCGI_MAX_REQS;
+    uint32_t           m_FCGI_MPXS_CONNS;
+};
+
+// Starts the backend processes itself, each one with its own port. "%PORT%" in the command line is replaced by the port,
+// e.g. L"/usr/bin/php-cgi -b 127.0.0.1:%PORT%". Every Acquire is one request, Release it when the request has ended.
+class FastCgiProcessPool
+{
+    typedef struct
+    {
+        unique_ptr<FastCgiClient> pClient;    // Owns the process
+        uint16_t                  usPort;
+        uint32_t                  nInUse;
+        uint32_t                  nRequests;  // Served so far, for the recycling
+        chrono::steady_clock::time_point tmIdleSince;
+    }PROCESSENTRY;
+
+public:
+    // Between nMinProcesses and nMaxProcesses are running, depending on the load, 0 for nMaxProcesses = a fixed number.
+    // Without %PORT% in strCommand, each process gets a listening socket on a free port of strIpServer passed as FCGI_LISTENSOCK_FILENO.
+    FastCgiProcessPool(const wstring& strCommand, const string strIpServer, const uint16_t usBasePort, const uint32_t nMinProcesses, const uint32_t nMaxProcesses = 0);
+    virtual ~FastCgiProcessPool() = default;
+
+    // A process is replaced after nMaxRequests requests or if it uses more than nMaxMemory bytes, 0 = never
+    void SetRecycling(const uint32_t nMaxRequests, const size_t nMaxMemory = 0) noexcept { m_nMaxRequests = nMaxRequests; m_nMaxMemory = nMaxMemory; }
+    void SetIdleTimeout(const chrono::milliseconds tmIdleTimeout) noexcept { m_tmIdleTimeout = tmIdleTimeout; }   // Processes above the minimum idle for longer are stopped
+    void SetTracer(const shared_ptr<FastCgiTracer>& spTracer) noexcept { m_spTracer = spTracer; }   // Before Start
+    void SetMetrics(const shared_ptr<FastCgiMetrics>& spMetrics) noexcept { m_spMetrics = spMetrics; } // Before Start, off (nullptr) by default
+    uint32_t Start();   // Starts the minimum number of processes, returns the number running
+    FastCgiClient* Acquire();   // An idle process, a new one if all are busy, nullptr if the maximum is reached
+    void Release(FastCgiClient* const pClient);
+    size_t GetProcessCount();
+    const shared_ptr<FastCgiMetrics>& GetMetrics() const noexcept { return m_spMetrics; }
+
+private:
+    unique_ptr<FastCgiClient> NewProcess(const uint16_t usPort);
+    uint16_t GetFreePort() const noexcept;
+    bool IsWorn(const PROCESSENTRY& Entry) const;
+
+private:
+    wstring            m_strCommand;
+    string             m_strIpServer;
+    uint16_t           m_usBasePort;      // Process n listens on m_usBasePort + n, with a passed listening socket only a number
+    uint32_t           m_nMinProcesses;
+    uint32_t           m_nMaxProcesses;
+    uint32_t           m_nMaxRequests;
+    size_t             m_nMaxMemory;
+    chrono::milliseconds m_tmIdleTimeout;
+    mutex              m_mxPool;
+    vector<PROCESSENTRY> m_vProcesses;
+    vector<uint16_t>   m_vStarting;       // Ports of processes started outside the lock
+    shared_ptr<FastCgiMetrics> m_spMetrics;
+    shared_ptr<FastCgiTracer>  m_spTracer;
+};
+
+class WorkerPool
+{
+public:
+    WorkerPool() noexcept : m_nMaxQueue(0), m_nIdle(0), m_bStop(false) {}
+    virtual ~WorkerPool();
+
+    void Start(const uint32_t nThreads, const uint32_t nMaxQueue);
+    void Stop();
+    bool Post(packaged_task<void()>& task);   // false if all threads are busy and the run queue is full
+    size_t GetQueueLen();
+
+private:
+    void WorkerThread();
+
+private:
+    vector<thread>                 m_vThreads;
+    deque<packaged_task<void()>>   m_quTasks;
+    mutex                          m_mxQueue;
+    condition_variable             m_cvQueue;
+    uint32_t                       m_nMaxQueue;     // 0 = unlimited
+    uint32_t                       m_nIdle;         // Threads waiting for a task, the tasks they will take do not count as queued
+    bool                           m_bStop;
 };
 
+class StreamOutBuffer;
+class StreamInBuffer;
+
 class FastCgiServer : public FastCgiBase
 {
     typedef struct
     {
+        uint16_t nRequestId;
         uint32_t nState;
-        PARAMETERLIST lstParameter;
-        string strBuffer;
-        unique_ptr<streambuf*> obuf;
-        unique_ptr<ostream*> streamOut;
-        //istringstream stremIn;
-        unique_ptr<streambuf*> ibuf;
-        unique_ptr<iostream*> stremIn;
-        thread thDoAction;
+        FastCgiParams Params;
+        string strBuffer;           // Content of the FCGI_PARAMS records until the empty one is received
+        unique_ptr<StreamOutBuffer> pOutBuf;    // Created with the first request, reused by the following ones
+        unique_ptr<ostream> pStreamOut;
+        unique_ptr<StreamInBuffer> pInBuf;
+        unique_ptr<istream> pStreamIn;
+        future<void> ftDoAction;
+        chrono::steady_clock::time_point tmBegin;   // FCGI_BEGIN_REQUEST received
+        atomic<bool> bAborted{false};               // FCGI_ABORT_REQUEST received, read by the handler thread
     }REQUESTPARAM;
-    //typedef tuple<uint32_t, PARAMETERLIST, string> REQUESTPARAM;  // State, Liste mit Parameter, Daten (post)
-    typedef map<uint16_t, REQUESTPARAM> REQUEST;    // Request-ID, Request-Parameter
+    typedef vector<unique_ptr<REQUESTPARAM>> REQUEST;   // Only a few requests per connection, they are searched by id
+    typedef struct
+    {
+        mutex mxRequests;                   // Guards the requests of this connection only
+        REQUEST lstRequests;
+        REQUEST lstFree;                    // Finished requests, their buffers and streams are used again
+        condition_variable cvRequests;      // Signaled if a request is finished or the flush is done
+        RecordParser Parser;
+        atomic<bool> bClosed{false};
+        bool bFlushing = false;             // A flush of the timer is posted for this connection, guarded by mxRequests
+    }CONNECTION;
 
     typedef function<int(const PARAMETERLIST&, ostream&, istream&)> FN_DOACTION;
+    typedef function<int(const FastCgiParams&, ostream&, istream&)> FN_DOREQUEST;
 
 public:
+    // strBindAddr "unix:/run/app.sock" listens on a unix domain socket, empty on the listening socket passed as FCGI_LISTENSOCK_FILENO.
+    // Clients connecting with "shm:" may get the shared memory on any unix domain socket, "shm:" listens like "unix:".
     FastCgiServer(const string strBindAddr, const uint16_t sPort, FN_DOACTION fnCallBack);
     virtual ~FastCgiServer();
 
+    // Before Start, used instead of the callback of the constructor, gets the parameters without copying them into a map
+    void SetRequestHandler(FN_DOREQUEST fnHandler) noexcept { m_fnDoRequest = move(fnHandler); }
+    void SetWorkerPool(const uint32_t nThreads, const uint32_t nMaxQueue = 0) noexcept { m_nWorkerThreads = nThreads; m_nMaxQueue = nMaxQueue; }
+    // Limits sent with FCGI_GET_VALUES_RESULT and enforced, 0 = taken from the worker pool (threads + queue) before Start.
+    // Requests above nMaxReqs get FCGI_OVERLOADED, a second request on a connection without multiplexing FCGI_CANT_MPX_CONN,
+    // connections above nMaxConns are closed right away.
+    void SetLimits(const uint32_t nMaxConns, const uint32_t nMaxReqs, const bool bMultiplex = true) noexcept { m_nMaxConns = nMaxConns; m_nMaxReqs = nMaxReqs; m_bMultiplex = bMultiplex; }
+    // Requests whose FCGI_PARAMS records sum up to more than nMaxBytes (default 1 MB) are ended with FCGI_OVERLOADED
+    void SetMaxParamsSize(const uint32_t nMaxBytes) noexcept { m_nMaxParamsSize = nMaxBytes; }
+    uint32_t GetMaxConns() const noexcept;
+    uint32_t GetMaxReqs() const noexcept;
+    // Handler output is sent in records of nRecordSize bytes, on flush, and with tmMaxDelay at the latest that long after it was written,
+    // also if the handler blocks meanwhile. Before Start.
+    void SetOutputBuffer(const uint32_t nRecordSize, const chrono::milliseconds tmMaxDelay = chrono::milliseconds(0)) noexcept;
+    void SetMetrics(const shared_ptr<FastCgiMetrics>& spMetrics) noexcept { m_spMetrics = spMetrics; }   // Before Start, off (nullptr) by default
+    const shared_ptr<FastCgiMetrics>& GetMetrics() const noexcept { return m_spMetrics; }
+    void SetTracer(const shared_ptr<FastCgiTracer>& spTracer) noexcept { m_spTracer = spTracer; }    // Before Start, off (nullptr) by default
     bool Start();
     bool Stop();
     int GetError();
@@ -128,17 +542,41 @@ public:
     string GetBindAdresse() { return m_strBindAddr; }
 
 private:
-    void OnNewConnection(const vector<TcpSocket*>& vNewConnections);
-    void OnDataReceived(TcpSocket*);
-    void OnSocketError(BaseSocket* const);
-    void OnSocketClosing(BaseSocket* const);
+    void OnNewConnection(const vector<FastCgiStream*>& vNewConnections);
+    void OnDataReceived(FastCgiStream* const);
+    void OnSocketError(FastCgiStream* const);
+    void OnSocketClosing(FastCgiStream* const);
+    void DoAction(const shared_ptr<CONNECTION> pConnection, REQUESTPARAM* const pReqParam);
+    void ReleaseRequest(CONNECTION& Connection, const REQUEST::iterator itRequest);
+    void SendEndRequest(FastCgiStream* const pSocket, const uint16_t nRequestId, const uint32_t nAppStatus, const uint8_t nProtocolStatus);
+    void FlushTimer();
+    void StopFlushTimer();
 
 private:
-    unique_ptr<TcpServer>    m_pSocket;
-    map<TcpSocket*, REQUEST> m_Connections;
-    mutex                    m_mxConnections;
+    unique_ptr<FastCgiListener> m_pSocket;
+    map<FastCgiStream*, shared_ptr<CONNECTION>> m_Connections;
+    mutex                    m_mxConnections;     // Guards only the map, the requests are guarded by CONNECTION::mxRequests
 
     string                   m_strBindAddr;
     uint16_t                 m_sPort;
-    FN_DOACTION              m_fnDoAction;
+    FN_DOACTION              m_fnDoAction;        // Handler getting the parameters as map
+    FN_DOREQUEST             m_fnDoRequest;       // SetRequestHandler, takes precedence over m_fnDoAction
+
+    WorkerPool               m_WorkerPool;
+    uint32_t                 m_nWorkerThreads;    // Number of threads running m_fnDoAction
+    uint32_t                 m_nMaxQueue;         // Requests waiting for a worker, if exceeded we answer with FCGI_OVERLOADED, 0 = unlimited
+    uint32_t                 m_nMaxConns;         // FCGI_MAX_CONNS, 0 = like m_nMaxReqs
+    uint32_t                 m_nMaxReqs;          // FCGI_MAX_REQS over all connections, 0 = m_nWorkerThreads + m_nMaxQueue
+    bool                     m_bMultiplex;        // FCGI_MPXS_CONNS
+    uint32_t                 m_nMaxParamsSize;    // Content of all FCGI_PARAMS records of one request
+    atomic<uint32_t>         m_nActiveRequests;   // From FCGI_BEGIN_REQUEST until released, over all connections
+    uint32_t                 m_nRecordSize;       // Size of the FCGI_STDOUT records the output of a request is collected in
+    chrono::milliseconds     m_tmMaxDelay;        // Buffered output older than this is sent by m_thFlush, 0 = only full records
+    thread                   m_thFlush;           // Runs only with m_tmMaxDelay
+    WorkerPool               m_FlushPool;         // Writes the output m_thFlush found due, a client not reading blocks only one thread
+    mutex                    m_mxFlush;
+    condition_variable       m_cvFlush;
+    bool                     m_bStopFlush;
+    shared_ptr<FastCgiMetrics> m_spMetrics;
+    shared_ptr<FastCgiTracer>  m_spTracer;
 };
@@ -0,0 +1,160 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#include <sstream>
+
+#include "Metrics.h"
+
+static const char* s_aszRecordType[FastCgiMetrics::RECORD_TYPES] =
+{
+    "OTHER", "BEGIN_REQUEST", "ABORT_REQUEST", "END_REQUEST", "PARAMS", "STDIN",
+    "STDOUT", "STDERR", "DATA", "GET_VALUES", "GET_VALUES_RESULT", "UNKNOWN_TYPE"
+};
+
+FastCgiMetrics::FastCgiMetrics(const string& strPrefix/* = "fastcgi"*/) : m_strPrefix(strPrefix)
+{
+    for (auto& Shard : m_aShards)
+    {
+        for (auto& nValue : Shard.anCounter) nValue = 0;
+        for (auto& nValue : Shard.anRecordsIn) nValue = 0;
+        for (auto& nValue : Shard.anBytesIn) nValue = 0;
+        for (auto& nValue : Shard.anRecordsOut) nValue = 0;
+        for (auto& nValue : Shard.anBytesOut) nValue = 0;
+        for (auto& aBucket : Shard.aanBucket)
+        {
+            for (auto& nValue : aBucket) nValue = 0;
+        }
+        for (auto& nValue : Shard.anSumUs) nValue = 0;
+    }
+    for (auto& nValue : m_anGauge)
+        nValue = 0;
+}
+
+FastCgiMetrics::SHARD& FastCgiMetrics::GetShard() noexcept
+{
+    static atomic<size_t> s_nNextShard(0);
+    static thread_local const size_t s_nShard = s_nNextShard++ % SHARDS;  // Threads are spread round robin
+    return m_aShards[s_nShard];
+}
+
+void FastCgiMetrics::RecordIn(const uint8_t nType, const size_t nBytes) noexcept
+{
+    SHARD& Shard = GetShard();
+    const uint8_t nIndex = nType < RECORD_TYPES ? nType : 0;
+    Shard.anRecordsIn[nIndex].fetch_add(1, memory_order_relaxed);
+    Shard.anBytesIn[nIndex].fetch_add(nBytes, memory_order_relaxed);
+}
+
+void FastCgiMetrics::RecordOut(const uint8_t nType, const size_t nBytes, const uint64_t nRecords/* = 1*/) noexcept
+{
+    SHARD& Shard = GetShard();
+    const uint8_t nIndex = nType < RECORD_TYPES ? nType : 0;
+    Shard.anRecordsOut[nIndex].fetch_add(nRecords, memory_order_relaxed);
+    Shard.anBytesOut[nIndex].fetch_add(nBytes, memory_order_relaxed);
+}
+
+void FastCgiMetrics::Observe(const HISTOGRAM nHistogram, const chrono::steady_clock::duration tmDuration) noexcept
+{
+    const int64_t nMicroSec = chrono::duration_cast<chrono::microseconds>(tmDuration).count();
+    const uint64_t nValue = nMicroSec > 0 ? static_cast<uint64_t>(nMicroSec) : 0;
+
+    size_t nBucket = 0;
+    while (nBucket < BUCKETS - 1 && (static_cast<uint64_t>(1) << nBucket) < nValue)
+        ++nBucket;
+
+    SHARD& Shard = GetShard();
+    Shard.aanBucket[nHistogram][nBucket].fetch_add(1, memory_order_relaxed);
+    Shard.anSumUs[nHistogram].fetch_add(nValue, memory_order_relaxed);
+}
+
+FastCgiMetrics::SNAPSHOT FastCgiMetrics::GetSnapshot() const noexcept
+{
+    SNAPSHOT Snapshot{};
+    for (auto& Shard : m_aShards)
+    {
+        for (size_t n = 0; n < COUNTER_COUNT; ++n)
+            Snapshot.anCounter[n] += Shard.anCounter[n].load(memory_order_relaxed);
+        for (size_t n = 0; n < RECORD_TYPES; ++n)
+        {
+            Snapshot.anRecordsIn[n] += Shard.anRecordsIn[n].load(memory_order_relaxed);
+            Snapshot.anBytesIn[n] += Shard.anBytesIn[n].load(memory_order_relaxed);
+            Snapshot.anRecordsOut[n] += Shard.anRecordsOut[n].load(memory_order_relaxed);
+            Snapshot.anBytesOut[n] += Shard.anBytesOut[n].load(memory_order_relaxed);
+        }
+        for (size_t n = 0; n < HISTOGRAM_COUNT; ++n)
+        {
+            for (size_t nBucket = 0; nBucket < BUCKETS; ++nBucket)
+                Snapshot.aanBucket[n][nBucket] += Shard.aanBucket[n][nBucket].load(memory_order_relaxed);
+            Snapshot.anSumUs[n] += Shard.anSumUs[n].load(memory_order_relaxed);
+        }
+    }
+    for (size_t n = 0; n < GAUGE_COUNT; ++n)
+        Snapshot.anGauge[n] = m_anGauge[n].load(memory_order_relaxed);
+
+    return Snapshot;
+}
+
+string FastCgiMetrics::GetText() const
+{
+    static const char* aszCounter[COUNTER_COUNT] = { "requests_started_total", "requests_completed_total", "requests_aborted_total", "requests_overloaded_total", "requests_too_large_total" };
+    static const char* aszGauge[GAUGE_COUNT] = { "requests_in_flight", "queue_depth" };
+    static const char* aszHistogram[HISTOGRAM_COUNT] = { "time_to_first_byte_seconds", "request_duration_seconds" };
+
+    const SNAPSHOT Snapshot = GetSnapshot();
+    stringstream ss;
+    ss.precision(12);
+
+    for (size_t n = 0; n < COUNTER_COUNT; ++n)
+    {
+        ss << "# TYPE " << m_strPrefix << "_" << aszCounter[n] << " counter\n";
+        ss << m_strPrefix << "_" << aszCounter[n] << " " << Snapshot.anCounter[n] << "\n";
+    }
+    for (size_t n = 0; n < GAUGE_COUNT; ++n)
+    {
+        ss << "# TYPE " << m_strPrefix << "_" << aszGauge[n] << " gauge\n";
+        ss << m_strPrefix << "_" << aszGauge[n] << " " << Snapshot.anGauge[n] << "\n";
+    }
+
+    const pair<const char*, const array<uint64_t, RECORD_TYPES>*> aRecords[] =
+    {
+        { "records_in_total", &Snapshot.anRecordsIn }, { "record_bytes_in_total", &Snapshot.anBytesIn },
+        { "records_out_total", &Snapshot.anRecordsOut }, { "record_bytes_out_total", &Snapshot.anBytesOut }
+    };
+    for (auto& Records : aRecords)
+    {
+        ss << "# TYPE " << m_strPrefix << "_" << Records.first << " counter\n";
+        for (size_t n = 0; n < RECORD_TYPES; ++n)
+        {
+            if ((*Records.second)[n] > 0)
+                ss << m_strPrefix << "_" << Records.first << "{type=\"" << s_aszRecordType[n] << "\"} " << (*Records.second)[n] << "\n";
+        }
+    }
+
+    for (size_t n = 0; n < HISTOGRAM_COUNT; ++n)
+    {
+        const string strName = m_strPrefix + "_" + aszHistogram[n];
+        ss << "# TYPE " << strName << " histogram\n";
+        uint64_t nCount = 0;
+        for (size_t nBucket = 0; nBucket < BUCKETS; ++nBucket)
+        {
+            nCount += Snapshot.aanBucket[n][nBucket];
+            if (nBucket < BUCKETS - 1)
+                ss << strName << "_bucket{le=\"" << (static_cast<uint64_t>(1) << nBucket) / 1e6 << "\"} " << nCount << "\n";
+            else
+                ss << strName << "_bucket{le=\"+Inf\"} " << nCount << "\n";
+        }
+        ss << strName << "_sum " << Snapshot.anSumUs[n] / 1e6 << "\n";
+        ss << strName << "_count " << nCount << "\n";
+    }
+
+    return ss.str();
+}
@@ -0,0 +1,87 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <array>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+// Runtime statistics of a FastCgiClient or FastCgiServer. Counters and histograms are spread over
+// several cache lines, a thread always adds to the same one, GetSnapshot sums them up.
+// The clients, pools and the server have none by default, SetMetrics attaches one, several may share it.
+class FastCgiMetrics
+{
+public:
+    enum COUNTER : uint8_t
+    {
+        REQUESTS_STARTED, REQUESTS_COMPLETED, REQUESTS_ABORTED, REQUESTS_OVERLOADED, REQUESTS_TOO_LARGE, COUNTER_COUNT
+    };
+    enum GAUGE : uint8_t
+    {
+        REQUESTS_IN_FLIGHT, QUEUE_DEPTH, GAUGE_COUNT
+    };
+    enum HISTOGRAM : uint8_t
+    {
+        TIME_TO_FIRST_BYTE, TOTAL_TIME, HISTOGRAM_COUNT
+    };
+    static const size_t RECORD_TYPES = 12;  // FCGI_BEGIN_REQUEST (1) to FCGI_UNKNOWN_TYPE (11), 0 for all other types
+    static const size_t BUCKETS = 26;       // Upper bounds 1 us, 2 us, 4 us ... 2^24 us (about 16 s), the last is unlimited
+
+    typedef struct
+    {
+        array<uint64_t, COUNTER_COUNT> anCounter;
+        array<int64_t, GAUGE_COUNT>    anGauge;
+        array<uint64_t, RECORD_TYPES>  anRecordsIn;
+        array<uint64_t, RECORD_TYPES>  anBytesIn;     // Content bytes, without header and padding
+        array<uint64_t, RECORD_TYPES>  anRecordsOut;
+        array<uint64_t, RECORD_TYPES>  anBytesOut;
+        array<array<uint64_t, BUCKETS>, HISTOGRAM_COUNT> aanBucket;  // Not cumulative
+        array<uint64_t, HISTOGRAM_COUNT> anSumUs;
+    }SNAPSHOT;
+
+    explicit FastCgiMetrics(const string& strPrefix = "fastcgi");
+
+    void Add(const COUNTER nCounter, const uint64_t nValue = 1) noexcept { GetShard().anCounter[nCounter].fetch_add(nValue, memory_order_relaxed); }
+    void AddGauge(const GAUGE nGauge, const int64_t nValue) noexcept { m_anGauge[nGauge].fetch_add(nValue, memory_order_relaxed); }
+    void SetGauge(const GAUGE nGauge, const int64_t nValue) noexcept { m_anGauge[nGauge].store(nValue, memory_order_relaxed); }
+    void RecordIn(const uint8_t nType, const size_t nBytes) noexcept;
+    void RecordOut(const uint8_t nType, const size_t nBytes, const uint64_t nRecords = 1) noexcept;
+    void Observe(const HISTOGRAM nHistogram, const chrono::steady_clock::duration tmDuration) noexcept;
+
+    SNAPSHOT GetSnapshot() const noexcept;
+    string GetText() const;     // Prometheus text exposition format
+
+private:
+    static const size_t SHARDS = 16;
+    typedef struct alignas(64)                  // A shard starts a cache line and fills whole ones, on the heap only from C++17 on
+    {
+        array<atomic<uint64_t>, COUNTER_COUNT> anCounter;
+        array<atomic<uint64_t>, RECORD_TYPES>  anRecordsIn;
+        array<atomic<uint64_t>, RECORD_TYPES>  anBytesIn;
+        array<atomic<uint64_t>, RECORD_TYPES>  anRecordsOut;
+        array<atomic<uint64_t>, RECORD_TYPES>  anBytesOut;
+        array<array<atomic<uint64_t>, BUCKETS>, HISTOGRAM_COUNT> aanBucket;
+        array<atomic<uint64_t>, HISTOGRAM_COUNT> anSumUs;
+    }SHARD;
+
+    SHARD& GetShard() noexcept;
+
+private:
+    string                          m_strPrefix;    // Start of the metric names in GetText
+    array<SHARD, SHARDS>            m_aShards;
+    alignas(64) array<atomic<int64_t>, GAUGE_COUNT> m_anGauge;    // Not on the line of the last shard
+};
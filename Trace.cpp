@@ -0,0 +1,97 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#include "Trace.h"
+
+FastCgiTracer::FastCgiTracer(const size_t nCapacity/* = 4096*/) : m_nMask(0), m_nHead(0), m_nTail(0)
+{
+    if (nCapacity > 0)
+    {
+        size_t nSize = 1;
+        while (nSize < nCapacity)
+            nSize <<= 1;
+
+        m_pSlots.reset(new SLOT[nSize]);
+        for (size_t n = 0; n < nSize; ++n)
+            m_pSlots[n].nSequence = 0;
+        m_nMask = nSize - 1;
+    }
+}
+
+void FastCgiTracer::Event(const void* const pSource, const uint16_t nRequestId, const PHASE nPhase, const chrono::steady_clock::time_point tmTime/* = chrono::steady_clock::now()*/)
+{
+    if (m_pSlots != nullptr)
+    {
+        const uint64_t nPos = m_nHead.fetch_add(1, memory_order_relaxed);
+        SLOT& Slot = m_pSlots[nPos & m_nMask];
+        Slot.nSequence.store(2 * nPos + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        Slot.nTime.store(tmTime.time_since_epoch().count(), memory_order_relaxed);
+        Slot.pSource.store(pSource, memory_order_relaxed);
+        Slot.nIdPhase.store((static_cast<uint32_t>(nRequestId) << 8) | nPhase, memory_order_relaxed);
+        Slot.nSequence.store(2 * nPos + 2, memory_order_release);
+    }
+
+    if (m_fnHook)
+        m_fnHook(TRACEEVENT({ tmTime, pSource, nRequestId, nPhase }));
+}
+
+size_t FastCgiTracer::Read(vector<TRACEEVENT>& vEvents)
+{
+    if (m_pSlots == nullptr)
+        return 0;
+
+    const uint64_t nHead = m_nHead.load(memory_order_acquire);
+    size_t nLost = 0;
+    if (nHead - m_nTail > m_nMask + 1)  // Overwritten before we read them
+    {
+        nLost = static_cast<size_t>(nHead - m_nTail - (m_nMask + 1));
+        m_nTail = nHead - (m_nMask + 1);
+    }
+
+    for (; m_nTail < nHead; ++m_nTail)
+    {
+        SLOT& Slot = m_pSlots[m_nTail & m_nMask];
+        const uint64_t nSequence = Slot.nSequence.load(memory_order_acquire);
+        if (nSequence != 2 * m_nTail + 2)   // Still written, or already overwritten by a newer event
+        {
+            if (nSequence < 2 * m_nTail + 2)
+                break;  // Read it the next time
+            ++nLost;
+            continue;
+        }
+
+        const int64_t nTime = Slot.nTime.load(memory_order_relaxed);
+        const void* pSource = Slot.pSource.load(memory_order_relaxed);
+        const uint32_t nIdPhase = Slot.nIdPhase.load(memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if (Slot.nSequence.load(memory_order_relaxed) != nSequence)
+        {
+            ++nLost;
+            continue;
+        }
+
+        vEvents.push_back(TRACEEVENT({ chrono::steady_clock::time_point(chrono::steady_clock::duration(nTime)), pSource, static_cast<uint16_t>(nIdPhase >> 8), static_cast<PHASE>(nIdPhase & 0xff) }));
+    }
+
+    return nLost;
+}
+
+const char* FastCgiTracer::GetPhaseName(const PHASE nPhase) noexcept
+{
+    static const char* aszNames[PHASE_COUNT] =
+    {
+        "CLIENT_SEND_REQUEST", "CLIENT_PARAMS_SENT", "CLIENT_FIRST_STDOUT", "CLIENT_END_REQUEST",
+        "SERVER_BEGIN_REQUEST", "SERVER_PARAMS_COMPLETE", "SERVER_HANDLER_START", "SERVER_HANDLER_END", "SERVER_END_REQUEST"
+    };
+    return nPhase < PHASE_COUNT ? aszNames[nPhase] : "UNKNOWN";
+}
@@ -0,0 +1,73 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+using namespace std;
+
+// Timestamps of the phases of a request. The events go to a ring buffer, that keeps the newest
+// ones, and to a hook if one is set. Writing does not lock, the hook is called in the writing thread.
+class FastCgiTracer
+{
+public:
+    enum PHASE : uint8_t
+    {
+        CLIENT_SEND_REQUEST,        // Request id assigned
+        CLIENT_PARAMS_SENT,         // FCGI_BEGIN_REQUEST and FCGI_PARAMS written
+        CLIENT_FIRST_STDOUT,
+        CLIENT_END_REQUEST,         // FCGI_END_REQUEST received or connection lost
+        SERVER_BEGIN_REQUEST,
+        SERVER_PARAMS_COMPLETE,     // Empty FCGI_PARAMS received, the request is queued for a worker
+        SERVER_HANDLER_START,
+        SERVER_HANDLER_END,
+        SERVER_END_REQUEST,         // FCGI_END_REQUEST written
+        PHASE_COUNT
+    };
+
+    typedef struct
+    {
+        chrono::steady_clock::time_point tmTime;
+        const void* pSource;        // The FastCgiClient, on the server the connection. Request ids are only unique per connection
+        uint16_t    nRequestId;
+        PHASE       nPhase;
+    }TRACEEVENT;
+    typedef function<void(const TRACEEVENT&)> FN_TRACE;
+
+    explicit FastCgiTracer(const size_t nCapacity = 4096);  // Rounded up to a power of 2, 0 = only the hook
+
+    void SetHook(FN_TRACE fnHook) { m_fnHook = fnHook; }   // Before the tracer is used
+    void Event(const void* const pSource, const uint16_t nRequestId, const PHASE nPhase, const chrono::steady_clock::time_point tmTime = chrono::steady_clock::now());
+    size_t Read(vector<TRACEEVENT>& vEvents);   // Only one reader, appends the events since the last call, returns the number of events lost in between
+    static const char* GetPhaseName(const PHASE nPhase) noexcept;
+
+private:
+    typedef struct
+    {
+        atomic<uint64_t> nSequence;     // 2 * position + 1 while written, 2 * position + 2 when done
+        atomic<int64_t>  nTime;
+        atomic<const void*> pSource;
+        atomic<uint32_t> nIdPhase;
+    }SLOT;
+
+    unique_ptr<SLOT[]>  m_pSlots;
+    size_t              m_nMask;
+    atomic<uint64_t>    m_nHead;        // Next position written
+    uint64_t            m_nTail;        // Next position read
+    FN_TRACE            m_fnHook;
+};
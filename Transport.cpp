@@ -0,0 +1,1244 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+
+#include "Transport.h"
+#include "BufferPool.h"
+#include "SocketLib/SocketLib.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <deque>
+#endif
+#include <cstddef>
+#endif
+
+namespace
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    // Where the path starts, 0 if it is no unix domain socket. "shm:" is a unix domain socket too, the client offers the shared memory on it
+    size_t GetUnixPathOffset(const string& strAddress) noexcept
+    {
+        if (strAddress.compare(0, 5, "unix:") == 0)
+            return 5;
+        return strAddress.compare(0, 4, "shm:") == 0 ? 4 : 0;
+    }
+
+    bool IsUnixAddress(const string& strAddress) noexcept
+    {
+        return GetUnixPathOffset(strAddress) != 0;
+    }
+
+    // "unix:/run/app.sock" is a path, "unix:@app" a name in the abstract namespace of linux
+    bool GetUnixAddress(const string& strAddress, sockaddr_un& stAddr, socklen_t& nLen) noexcept
+    {
+        const size_t nOffset = GetUnixPathOffset(strAddress);
+        const size_t nPathLen = strAddress.size() - nOffset;
+        stAddr = sockaddr_un{};
+        stAddr.sun_family = AF_UNIX;
+        if (nOffset == 0 || nPathLen == 0 || nPathLen >= sizeof(stAddr.sun_path))
+            return false;
+
+        memcpy(stAddr.sun_path, strAddress.data() + nOffset, nPathLen);
+        if (stAddr.sun_path[0] == '@')
+            stAddr.sun_path[0] = '\0';     // The name is not terminated, the length counts
+        nLen = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + nPathLen + (stAddr.sun_path[0] != '\0' ? 1 : 0));
+        return true;
+    }
+
+    int ListenUnix(const string& strAddress, int& nError) noexcept
+    {
+        sockaddr_un stAddr;
+        socklen_t nLen;
+        if (GetUnixAddress(strAddress, stAddr, nLen) == false)
+        {
+            nError = EINVAL;
+            return -1;
+        }
+
+        struct stat stFile;
+        if (stAddr.sun_path[0] != '\0' && stat(stAddr.sun_path, &stFile) == 0 && S_ISSOCK(stFile.st_mode))
+            unlink(stAddr.sun_path);    // Left over from a process before us, nobody accepts on it anymore
+
+        const int nSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (nSocket < 0)
+        {
+            nError = errno;
+            return -1;
+        }
+        fcntl(nSocket, F_SETFD, FD_CLOEXEC);
+        if (::bind(nSocket, reinterpret_cast<sockaddr*>(&stAddr), nLen) != 0 || listen(nSocket, SOMAXCONN) != 0)
+        {
+            nError = errno;
+            ::close(nSocket);
+            return -1;
+        }
+        return nSocket;
+    }
+
+    void RemoveUnixPath(const string& strAddress) noexcept
+    {
+        const size_t nOffset = GetUnixPathOffset(strAddress);
+        if (nOffset != 0 && strAddress.size() > nOffset && strAddress[nOffset] != '@')
+            unlink(strAddress.c_str() + nOffset);
+    }
+#endif
+
+    // The TcpSocket of the SocketLib, the usual case
+    class SocketLibStream : public FastCgiStream
+    {
+    public:
+        SocketLibStream() : m_pSocket(new TcpSocket()), m_bAccepted(false) {}
+        explicit SocketLibStream(TcpSocket* const pSocket) : m_pSocket(pSocket), m_bAccepted(true)
+        {   // The SocketLib deletes the socket after the close callback, we do the same with us
+            BindCloseFunction(nullptr);
+        }
+        ~SocketLibStream() noexcept override
+        {
+            if (m_bAccepted == false)
+                delete m_pSocket;
+        }
+
+        bool Connect(const string& strAddress, const uint16_t usPort) override { return m_pSocket->Connect(strAddress.c_str(), usPort); }
+        size_t Read(void* const pBuffer, const size_t nBufLen) override { return m_pSocket->Read(pBuffer, nBufLen); }
+        size_t Write(const void* const pBuffer, const size_t nBufLen) override { return m_pSocket->Write(pBuffer, nBufLen); }
+        size_t Writev(const iovec* const pVec, const size_t nCount) override
+        {   // The TcpSocket has no vectored write, it copies into its send queue. We copy once before, so the parts go in together.
+            size_t nLen = 0;
+            for (size_t n = 0; n < nCount; ++n)
+                nLen += pVec[n].iov_len;
+            if (nLen == 0)
+                return 0;
+
+            uint8_t* pBuffer = BufferPool::Get(nLen);
+            size_t nPos = 0;
+            for (size_t n = 0; n < nCount; ++n)
+            {
+                memcpy(pBuffer + nPos, pVec[n].iov_base, pVec[n].iov_len);
+                nPos += pVec[n].iov_len;
+            }
+            const size_t nWritten = m_pSocket->Write(pBuffer, nLen);
+            BufferPool::Put(pBuffer);
+            return nWritten;
+        }
+        size_t GetBytesAvailable() const override { return m_pSocket->GetBytesAvailable(); }
+        void StartReceiving() override { m_pSocket->StartReceiving(); }
+        void Close() override { m_pSocket->Close(); }
+        int GetErrorNo() const override { return m_pSocket->GetErrorNo(); }
+
+        void BindFuncConEstablished(FN_EVENT fnConnected) override
+        {
+            m_pSocket->BindFuncConEstablished(fnConnected == nullptr ? function<void(TcpSocket* const)>() : [this, fnConnected](TcpSocket* const) { fnConnected(this); });
+        }
+        void BindFuncBytesReceived(FN_EVENT fnBytesReceived) override
+        {
+            m_pSocket->BindFuncBytesReceived(fnBytesReceived == nullptr ? function<void(TcpSocket* const)>() : [this, fnBytesReceived](TcpSocket* const) { fnBytesReceived(this); });
+        }
+        void BindErrorFunction(FN_EVENT fnError) override
+        {
+            m_pSocket->BindErrorFunction(fnError == nullptr ? function<void(BaseSocket* const)>() : [this, fnError](BaseSocket* const) { fnError(this); });
+        }
+        void BindCloseFunction(FN_EVENT fnClosing) override
+        {
+            if (fnClosing == nullptr && m_bAccepted == false)
+                m_pSocket->BindCloseFunction(function<void(BaseSocket* const)>());
+            else
+            {
+                m_pSocket->BindCloseFunction([this, fnClosing](BaseSocket* const)
+                {
+                    if (fnClosing != nullptr)
+                        fnClosing(this);
+                    if (m_bAccepted == true)
+                        delete this;
+                });
+            }
+        }
+
+    private:
+        TcpSocket* const m_pSocket;
+        const bool       m_bAccepted;
+    };
+
+    class SocketLibListener : public FastCgiListener
+    {
+    public:
+        bool Start(const string& strBindAddr, const uint16_t usPort) override
+        {
+            m_Server.BindNewConnection([this](const vector<TcpSocket*>& vNewConnections)
+            {
+                vector<FastCgiStream*> vStreams;
+                for (auto& pSocket : vNewConnections)
+                {
+                    if (pSocket != nullptr)
+                        vStreams.push_back(new SocketLibStream(pSocket));
+                }
+                if (vStreams.size() > 0 && m_fnNewConnection != nullptr)
+                    m_fnNewConnection(vStreams);
+            });
+            return m_Server.Start(strBindAddr.c_str(), usPort);
+        }
+        void Close() override { m_Server.Close(); }
+        int GetErrorNo() const override { return m_Server.GetErrorNo(); }
+
+        void BindNewConnection(FN_NEWCONNECTION fnNewConnection) override { m_fnNewConnection = fnNewConnection; }
+        void BindErrorFunction(FN_ERROR fnError) override
+        {
+            m_Server.BindErrorFunction(fnError == nullptr ? function<void(BaseSocket* const)>() : [this, fnError](BaseSocket* const) { fnError(this); });
+        }
+        void BindAcceptCondition(function<bool()> /*fnCanAccept*/) override {}   // The port is ours alone, the server closes what is too much
+        void NotifyAcceptCondition() override {}
+
+    private:
+        TcpServer        m_Server;
+        FN_NEWCONNECTION m_fnNewConnection;
+    };
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#if defined(__linux__)
+    static const char   s_caShmOffer[8] = { 'F', 'C', 'G', 'I', 'S', 'H', 'M', '1' };  // Can not be the begin of a FastCGI record, the version is 1
+    static const size_t s_nShmRingSize = 1024 * 1024;  // Per direction, a power of 2
+    static const size_t s_nShmMinRingSize = 128 * 1024; // Takes the largest record, a multiple of the page size
+    static const size_t s_nShmDataOffset = 65536;      // The rings start on a page, also with 64 KB pages
+    static const size_t s_nShmFdCount = 5;             // The memfd and 4 eventfds
+    static const int    s_nShmSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;  // The size can not change anymore, a shorter file would be SIGBUS on access
+
+    // Two rings with one writer and one reader each in a memfd, the client writes to ring 0, the server to ring 1.
+    // Each ring has an eventfd that wakes the reader when data came, and one that wakes the writer when space got free.
+    // They are only written if the other side said it waits. The socket stays open, closing it ends the connection.
+    // The ring we read is mapped twice in a row, so the records are parsed where they are, also at the end of the ring.
+    // Parsed bytes are given free in order, a part held by HoldReceived only after its last reference is gone.
+    class ShmChannel : public enable_shared_from_this<ShmChannel>
+    {
+        typedef struct
+        {
+            char     caMagic[8];
+            uint64_t nRingSize;
+        }SHMHEADER;
+        typedef struct
+        {
+            alignas(64) atomic<uint64_t> nHead;     // Bytes written so far, only the writer changes it
+            alignas(64) atomic<uint64_t> nTail;     // Bytes given free so far, only the reader changes it
+            alignas(64) atomic<uint32_t> nReaderWaiting;
+            atomic<uint32_t> nWriterWaiting;
+        }RINGHEADER;
+        typedef struct
+        {
+            uint64_t nSegment;  // Of the lease holding it
+            uint64_t nEnd;      // Stream position the parsed bytes end
+            bool     bHeld;
+        }SEGMENT;
+
+        // The references to parsed bytes share one lease per callback, its end gives them free
+        class Lease
+        {
+        public:
+            Lease(const shared_ptr<ShmChannel>& spChannel, const uint64_t nSegment) noexcept : m_spChannel(spChannel), m_nSegment(nSegment) {}
+            ~Lease() { m_spChannel->Release(m_nSegment); }
+
+        private:
+            shared_ptr<ShmChannel> m_spChannel;     // The mapping stays while a handler reads from it
+            const uint64_t m_nSegment;
+        };
+
+    public:
+        static shared_ptr<ShmChannel> Create()  // The client side
+        {
+            shared_ptr<ShmChannel> pShm(new ShmChannel(0));
+            pShm->m_anFds[0] = memfd_create("fastcgi", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            for (size_t n = 1; n < s_nShmFdCount; ++n)
+                pShm->m_anFds[n] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (find(begin(pShm->m_anFds), end(pShm->m_anFds), -1) != end(pShm->m_anFds)
+                || ftruncate(pShm->m_anFds[0], static_cast<off_t>(s_nShmDataOffset + 2 * s_nShmRingSize)) != 0
+                || fcntl(pShm->m_anFds[0], F_ADD_SEALS, s_nShmSeals) != 0
+                || pShm->Map(s_nShmDataOffset + 2 * s_nShmRingSize) == false)
+                return nullptr;
+
+            SHMHEADER* pHeader = reinterpret_cast<SHMHEADER*>(pShm->m_pMemory);
+            memcpy(pHeader->caMagic, s_caShmOffer, sizeof(pHeader->caMagic));
+            pHeader->nRingSize = s_nShmRingSize;
+            for (size_t n = 0; n < 2; ++n)
+                new (pShm->m_pMemory + GetRingOffset(n)) RINGHEADER();
+            pShm->m_nRingSize = s_nShmRingSize;
+            return pShm->MapReceive() == true ? pShm : nullptr;
+        }
+
+        static shared_ptr<ShmChannel> Attach(const int* const pnFds, const size_t nCount)  // The server side, takes the handles
+        {
+            shared_ptr<ShmChannel> pShm(new ShmChannel(1));
+            copy(pnFds, pnFds + min(nCount, s_nShmFdCount), pShm->m_anFds);
+            if (nCount != s_nShmFdCount)
+            {
+                for (size_t n = s_nShmFdCount; n < nCount; ++n)
+                    ::close(pnFds[n]);
+                return nullptr;
+            }
+
+            // The memory comes from the other process, nothing is taken unchecked. Without the seals it could
+            // truncate the memfd under our mapping. The eventfds must not block us, whatever they really are.
+            const int nSeals = fcntl(pShm->m_anFds[0], F_GET_SEALS);
+            if (nSeals < 0 || (nSeals & s_nShmSeals) != s_nShmSeals)
+                return nullptr;
+            for (size_t n = 1; n < s_nShmFdCount; ++n)
+                fcntl(pShm->m_anFds[n], F_SETFL, fcntl(pShm->m_anFds[n], F_GETFL) | O_NONBLOCK);
+            struct stat stFile;
+            if (fstat(pShm->m_anFds[0], &stFile) != 0 || static_cast<uint64_t>(stFile.st_size) < s_nShmDataOffset || pShm->Map(static_cast<size_t>(stFile.st_size)) == false)
+                return nullptr;
+            const SHMHEADER* pHeader = reinterpret_cast<SHMHEADER*>(pShm->m_pMemory);
+            const uint64_t nRingSize = pHeader->nRingSize;
+            if (memcmp(pHeader->caMagic, s_caShmOffer, sizeof(pHeader->caMagic)) != 0 || nRingSize < s_nShmMinRingSize || (nRingSize & (nRingSize - 1)) != 0
+                || nRingSize > (static_cast<uint64_t>(stFile.st_size) - s_nShmDataOffset) / 2)
+                return nullptr;
+            pShm->m_nRingSize = static_cast<size_t>(nRingSize);
+            return pShm->MapReceive() == true ? pShm : nullptr;
+        }
+
+        ~ShmChannel() noexcept
+        {
+            if (m_pMemory != nullptr)
+                munmap(m_pMemory, m_nMapSize);
+            if (m_pReceive != nullptr)
+                munmap(m_pReceive, 2 * m_nRingSize);
+            for (auto nFd : m_anFds)
+            {
+                if (nFd >= 0)
+                    ::close(nFd);
+            }
+        }
+
+        const int* GetHandles() const noexcept { return m_anFds; }
+        int GetDataHandle() const noexcept { return m_anFds[1 + 2 * m_nRx]; }
+        uint64_t GetHead() const noexcept { return GetRing(m_nRx).nHead.load(memory_order_acquire); }
+        uint64_t GetRead() const noexcept { return m_nRead; }
+
+        // Received and not parsed yet. The head comes from the other process, it can not make us read beyond the ring.
+        size_t GetAvailable() const noexcept
+        {
+            return static_cast<size_t>(min(GetHead() - m_nRead, static_cast<uint64_t>(m_nRingSize) - (m_nRead - m_nReleased.load(memory_order_relaxed))));
+        }
+
+        // The receiving thread only, for PeekReceived, HoldReceived and ConsumeReceived of the stream
+        uint8_t* Peek(size_t& nLen) noexcept
+        {
+            nLen = GetAvailable();
+            m_pPeek = m_pReceive + (m_nRead & (m_nRingSize - 1));
+            return m_pPeek;
+        }
+
+        shared_ptr<uint8_t> Hold(uint8_t* const pData, const size_t nLen)
+        {
+            // Handlers not reading their FCGI_STDIN must not fill the ring, from half of it on they get a copy
+            const uint64_t nEnd = m_nRead + static_cast<uint64_t>(pData - m_pPeek) + nLen;
+            if (nEnd - m_nReleased.load(memory_order_relaxed) > m_nRingSize / 2)
+            {
+                shared_ptr<uint8_t> spCopy = BufferPool::GetShared(nLen);
+                memcpy(spCopy.get(), pData, nLen);
+                return spCopy;
+            }
+
+            if (m_spLease == nullptr)
+                m_spLease = allocate_shared<Lease>(PoolAllocator<Lease>(), shared_from_this(), m_nNextSegment++);
+            return shared_ptr<uint8_t>(m_spLease, pData);
+        }
+
+        void Consume(const size_t nLen)
+        {
+            shared_ptr<Lease> spLease;
+            unique_lock<mutex> lock(m_mxRelease);
+            m_nRead += nLen;
+            if (m_spLease != nullptr)
+            {
+                m_quSegments.push_back(SEGMENT({ m_nNextSegment - 1, m_nRead, true }));
+                spLease = move(m_spLease);
+            }
+            else if (m_quSegments.empty() == true)
+                SetReleased(m_nRead);
+            else if (m_quSegments.back().bHeld == false)
+                m_quSegments.back().nEnd = m_nRead;
+            else
+                m_quSegments.push_back(SEGMENT({ 0, m_nRead, false }));
+            lock.unlock();  // Our reference to the lease goes after it, it may be the last one
+        }
+
+        size_t Read(void* const pBuffer, const size_t nBufLen)
+        {
+            size_t nLen;
+            const uint8_t* pData = Peek(nLen);
+            nLen = min(nLen, nBufLen);
+            memcpy(pBuffer, pData, nLen);
+            Consume(nLen);
+            return nLen;
+        }
+
+        // Blocks while the ring is full, returns less if the connection is closed meanwhile
+        size_t Write(const void* const pBuffer, const size_t nBufLen, const int nSocket, const atomic<bool>& bClosing) noexcept
+        {
+            RINGHEADER& Ring = GetRing(m_nTx);
+            size_t nWritten = 0;
+            while (nWritten < nBufLen && bClosing == false)
+            {
+                const uint64_t nHead = Ring.nHead.load(memory_order_relaxed);
+                const size_t nFree = m_nRingSize - static_cast<size_t>(min(nHead - Ring.nTail.load(memory_order_acquire), static_cast<uint64_t>(m_nRingSize)));
+                if (nFree == 0)
+                {
+                    if (WaitFor(Ring.nWriterWaiting, m_anFds[2 + 2 * m_nTx], nSocket, [&]() noexcept { return nHead - Ring.nTail.load(memory_order_acquire) < m_nRingSize; }) == false)
+                        break;
+                    continue;
+                }
+
+                const size_t nLen = min(nFree, nBufLen - nWritten);
+                const size_t nPos = static_cast<size_t>(nHead & (m_nRingSize - 1));
+                const size_t nFirst = min(nLen, m_nRingSize - nPos);
+                memcpy(GetData(m_nTx) + nPos, static_cast<const char*>(pBuffer) + nWritten, nFirst);
+                memcpy(GetData(m_nTx), static_cast<const char*>(pBuffer) + nWritten + nFirst, nLen - nFirst);
+                Ring.nHead.store(nHead + nLen, memory_order_release);
+                nWritten += nLen;
+
+                atomic_thread_fence(memory_order_seq_cst);
+                if (Ring.nReaderWaiting.load(memory_order_relaxed) != 0)
+                    Signal(m_anFds[1 + 2 * m_nTx]);
+            }
+            return nWritten;
+        }
+
+        // Until the head moves away from nSeen, false if the socket was closed
+        bool WaitForData(const int nSocket, const uint64_t nSeen) noexcept
+        {
+            return WaitFor(GetRing(m_nRx).nReaderWaiting, GetDataHandle(), nSocket, [&]() noexcept { return GetHead() != nSeen; });
+        }
+
+        bool HasProtocolError() const noexcept { return m_bProtocolError; }  // The peer sent data over the socket
+
+    private:
+        explicit ShmChannel(const size_t nTx) noexcept : m_anFds{ -1, -1, -1, -1, -1 }, m_pMemory(nullptr), m_nMapSize(0), m_pReceive(nullptr), m_nRingSize(0), m_nTx(nTx), m_nRx(1 - nTx),
+            m_bProtocolError(false), m_nRead(0), m_nReleased(0), m_pPeek(nullptr), m_nNextSegment(0) {}
+
+        static size_t GetRingOffset(const size_t nRing) noexcept { return 64 + nRing * sizeof(RINGHEADER); }
+        RINGHEADER& GetRing(const size_t nRing) const noexcept { return *reinterpret_cast<RINGHEADER*>(m_pMemory + GetRingOffset(nRing)); }
+        char* GetData(const size_t nRing) const noexcept { return m_pMemory + s_nShmDataOffset + nRing * m_nRingSize; }
+
+        bool Map(const size_t nSize) noexcept
+        {
+            void* pMemory = mmap(nullptr, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_anFds[0], 0);
+            if (pMemory == MAP_FAILED)
+                return false;
+            m_pMemory = static_cast<char*>(pMemory);
+            m_nMapSize = nSize;
+            return true;
+        }
+
+        // The ring we read twice in a row, a record wrapping around at its end continues in the second mapping
+        bool MapReceive() noexcept
+        {
+            void* pReceive = mmap(nullptr, 2 * m_nRingSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (pReceive == MAP_FAILED)
+                return false;
+            m_pReceive = static_cast<uint8_t*>(pReceive);
+            const off_t nOffset = static_cast<off_t>(s_nShmDataOffset + m_nRx * m_nRingSize);
+            for (size_t n = 0; n < 2; ++n)
+            {
+                if (mmap(m_pReceive + n * m_nRingSize, m_nRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m_anFds[0], nOffset) == MAP_FAILED)
+                    return false;
+            }
+            return true;
+        }
+
+        // From the lease, any thread. The bytes up to the first segment still held are given free.
+        void Release(const uint64_t nSegment)
+        {
+            lock_guard<mutex> lock(m_mxRelease);
+            for (auto& Segment : m_quSegments)
+            {
+                if (Segment.bHeld == true && Segment.nSegment == nSegment)
+                {
+                    Segment.bHeld = false;
+                    break;
+                }
+            }
+
+            uint64_t nReleased = m_nReleased.load(memory_order_relaxed);
+            while (m_quSegments.empty() == false && m_quSegments.front().bHeld == false)
+            {
+                nReleased = m_quSegments.front().nEnd;
+                m_quSegments.pop_front();
+            }
+            SetReleased(nReleased);
+        }
+
+        void SetReleased(const uint64_t nReleased) noexcept   // m_mxRelease is locked
+        {
+            if (nReleased == m_nReleased.load(memory_order_relaxed))
+                return;
+            m_nReleased.store(nReleased, memory_order_relaxed);
+
+            RINGHEADER& Ring = GetRing(m_nRx);
+            Ring.nTail.store(nReleased, memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (Ring.nWriterWaiting.load(memory_order_relaxed) != 0)
+                Signal(m_anFds[2 + 2 * m_nRx]);
+        }
+
+        static void Signal(const int nEventFd) noexcept
+        {
+            const uint64_t nOne = 1;
+            while (write(nEventFd, &nOne, sizeof(nOne)) < 0 && errno == EINTR)
+            {
+            }
+        }
+
+        // Says we wait, looks once more, and sleeps until the eventfd or the socket wakes us
+        template<typename Ready>
+        bool WaitFor(atomic<uint32_t>& nWaiting, const int nEventFd, const int nSocket, Ready fnReady) noexcept
+        {
+            nWaiting.store(1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            bool bOpen = true;
+            if (fnReady() == false)
+            {
+                pollfd astPoll[2] = { { nEventFd, POLLIN, 0 }, { nSocket, POLLIN, 0 } };
+                while (poll(astPoll, 2, -1) < 0 && errno == EINTR)
+                {
+                }
+                bOpen = astPoll[1].revents == 0 || IsSocketOpen(nSocket, astPoll[1].revents);
+            }
+            nWaiting.store(0, memory_order_relaxed);
+
+            uint64_t nCount;
+            while (read(nEventFd, &nCount, sizeof(nCount)) > 0)
+            {
+            }
+            return bOpen;
+        }
+
+        // Over the socket comes nothing but the close. POLLIN is the close only if recv says so, data is a protocol
+        // error of the peer, it is not read but rejected, the connection is shut down.
+        bool IsSocketOpen(const int nSocket, const short nRevents) noexcept
+        {
+            if ((nRevents & (POLLHUP | POLLERR | POLLNVAL)) != 0)
+                return false;
+
+            char cPeek;
+            const ssize_t nLen = recv(nSocket, &cPeek, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (nLen < 0)   // Nothing there, we were woken for nothing
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            if (nLen > 0)
+            {
+                m_bProtocolError = true;
+                shutdown(nSocket, SHUT_RDWR);
+            }
+            return false;
+        }
+
+        int      m_anFds[s_nShmFdCount];
+        char*    m_pMemory;
+        size_t   m_nMapSize;
+        uint8_t* m_pReceive;    // The ring we read, mapped twice
+        size_t   m_nRingSize;
+        const size_t m_nTx;     // The ring we write to
+        const size_t m_nRx;
+        atomic<bool> m_bProtocolError;
+
+        // Our own positions, the ring header is also written by the other process
+        uint64_t         m_nRead;       // Parsed so far
+        atomic<uint64_t> m_nReleased;   // Given free so far, changed with m_mxRelease locked
+        uint8_t*         m_pPeek;       // Where the last Peek began
+        uint64_t         m_nNextSegment;
+        shared_ptr<Lease> m_spLease;    // Of the current callback, until Consume
+        deque<SEGMENT>   m_quSegments;  // Parsed, not yet given free
+        mutex            m_mxRelease;
+    };
+#endif
+
+    // A socket handle of our own, for what the SocketLib can not do: unix domain sockets and
+    // connections accepted on an inherited listening socket. On linux a client may offer a ShmChannel
+    // as the first thing it sends, if the server takes it the records go over the shared memory.
+    class PosixStream : public FastCgiStream
+    {
+    public:
+        explicit PosixStream(const bool bOfferShm = false) : m_nSocket(-1), m_bAccepted(false), m_bOfferShm(bOfferShm), m_nError(0), m_bReceiving(false), m_bClosing(false) {}
+        explicit PosixStream(const int nSocket) : m_nSocket(nSocket), m_bAccepted(true), m_bOfferShm(false), m_nError(0), m_bReceiving(false), m_bClosing(false) {}
+        ~PosixStream() noexcept override
+        {
+            if (m_thReceive.joinable() == true)
+            {
+                Close();
+                if (this_thread::get_id() == m_thReceive.get_id())
+                    m_thReceive.detach();
+                else
+                    m_thReceive.join();
+            }
+            if (m_nSocket >= 0)
+                ::close(m_nSocket);
+        }
+
+        bool Connect(const string& strAddress, const uint16_t /*usPort*/) override
+        {
+            sockaddr_un stAddr;
+            socklen_t nLen;
+            if (m_nSocket >= 0 || GetUnixAddress(strAddress, stAddr, nLen) == false)
+            {
+                m_nError = EINVAL;
+                return false;
+            }
+
+            if (ConnectSocket(stAddr, nLen) == false)
+                return false;
+#if defined(__linux__)
+            if (m_bOfferShm == true && OfferShm() == false)  // The server did not answer, it does not know the offer
+            {
+                ::close(m_nSocket);
+                m_nSocket = -1;
+                if (ConnectSocket(stAddr, nLen) == false)
+                    return false;
+            }
+#endif
+
+            StartReceiving();   // The thread calls the established callback first
+            return true;
+        }
+
+        size_t Read(void* const pBuffer, const size_t nBufLen) override
+        {
+#if defined(__linux__)
+            if (m_pShm != nullptr)
+                return m_pShm->Read(pBuffer, nBufLen);
+#endif
+            const ssize_t nRead = recv(m_nSocket, pBuffer, nBufLen, 0);
+            return nRead > 0 ? static_cast<size_t>(nRead) : 0;
+        }
+
+#if defined(__linux__)
+        uint8_t* PeekReceived(size_t& nLen) override
+        {
+            if (m_pShm != nullptr)
+                return m_pShm->Peek(nLen);
+            nLen = 0;
+            return nullptr;
+        }
+        shared_ptr<uint8_t> HoldReceived(uint8_t* const pData, const size_t nLen) override { return m_pShm->Hold(pData, nLen); }
+        void ConsumeReceived(const size_t nLen) override { m_pShm->Consume(nLen); }
+#endif
+
+        size_t Write(const void* const pBuffer, const size_t nBufLen) override
+        {
+            const iovec stData{ const_cast<void*>(pBuffer), nBufLen };
+            return Writev(&stData, 1);
+        }
+
+        size_t Writev(const iovec* const pVec, const size_t nCount) override
+        {
+            lock_guard<mutex> lock(m_mxWrite);  // The records of several requests must not mix
+            size_t nWritten = 0;
+#if defined(__linux__)
+            if (m_pShm != nullptr)
+            {
+                for (size_t n = 0; n < nCount; ++n)
+                {
+                    const size_t nPart = m_pShm->Write(pVec[n].iov_base, pVec[n].iov_len, m_nSocket, m_bClosing);
+                    nWritten += nPart;
+                    if (nPart < pVec[n].iov_len)
+                        break;
+                }
+                return nWritten;
+            }
+#endif
+
+            for (size_t nFirst = 0; nFirst < nCount;)
+            {
+                iovec astVec[16];   // A copy, after a part was sent it is moved on
+                msghdr stMsg{};
+                stMsg.msg_iov = astVec;
+                stMsg.msg_iovlen = min(nCount - nFirst, sizeof(astVec) / sizeof(astVec[0]));
+                copy_n(pVec + nFirst, stMsg.msg_iovlen, astVec);
+                nFirst += stMsg.msg_iovlen;
+
+                while (stMsg.msg_iovlen > 0)
+                {
+                    const ssize_t nSent = sendmsg(m_nSocket, &stMsg, MSG_NOSIGNAL);
+                    if (nSent < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        m_nError = errno;
+                        return nWritten;
+                    }
+                    nWritten += static_cast<size_t>(nSent);
+
+                    size_t nRest = static_cast<size_t>(nSent);
+                    while (stMsg.msg_iovlen > 0 && nRest >= stMsg.msg_iov->iov_len)
+                    {
+                        nRest -= stMsg.msg_iov->iov_len;
+                        ++stMsg.msg_iov;
+                        --stMsg.msg_iovlen;
+                    }
+                    if (nRest > 0)
+                    {
+                        stMsg.msg_iov->iov_base = static_cast<char*>(stMsg.msg_iov->iov_base) + nRest;
+                        stMsg.msg_iov->iov_len -= nRest;
+                    }
+                }
+            }
+            return nWritten;
+        }
+
+        size_t GetBytesAvailable() const override
+        {
+#if defined(__linux__)
+            if (m_pShm != nullptr)
+                return m_pShm->GetAvailable();
+#endif
+            int nAvailable = 0;
+            if (ioctl(m_nSocket, FIONREAD, &nAvailable) != 0 || nAvailable < 0)
+                return 0;
+            return static_cast<size_t>(nAvailable);
+        }
+
+        void StartReceiving() override
+        {
+            if (m_bReceiving.exchange(true) == false)
+            {
+                if (m_bAccepted == true)
+                    thread(&PosixStream::ReceiveLoop, this).detach();   // Accepted connections are gone after the close callback
+                else
+                    m_thReceive = thread(&PosixStream::ReceiveLoop, this);
+            }
+        }
+
+        void Close() override
+        {
+            if (m_bClosing.exchange(true) == false && m_nSocket >= 0)
+            {
+                shutdown(m_nSocket, SHUT_RDWR);
+                StartReceiving();   // Never received, the thread still calls the close callback
+            }
+        }
+
+        int GetErrorNo() const override { return m_nError; }
+
+        // The lock keeps a callback from being removed while it runs
+        void BindFuncConEstablished(FN_EVENT fnConnected) override { lock_guard<mutex> lock(m_mxCallback); m_fnConnected = fnConnected; }
+        void BindFuncBytesReceived(FN_EVENT fnBytesReceived) override { lock_guard<mutex> lock(m_mxCallback); m_fnBytesReceived = fnBytesReceived; }
+        void BindErrorFunction(FN_EVENT fnError) override { lock_guard<mutex> lock(m_mxCallback); m_fnError = fnError; }
+        void BindCloseFunction(FN_EVENT fnClosing) override { lock_guard<mutex> lock(m_mxCallback); m_fnClosing = fnClosing; }
+
+    private:
+        void Callback(const FN_EVENT& fnEvent)
+        {
+            lock_guard<mutex> lock(m_mxCallback);
+            if (fnEvent != nullptr)
+                fnEvent(this);
+        }
+
+        bool ConnectSocket(sockaddr_un& stAddr, const socklen_t nLen)
+        {
+            m_nSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (m_nSocket < 0)
+            {
+                m_nError = errno;
+                return false;
+            }
+            fcntl(m_nSocket, F_SETFD, FD_CLOEXEC);
+            if (connect(m_nSocket, reinterpret_cast<sockaddr*>(&stAddr), nLen) != 0)
+            {
+                m_nError = errno;
+                ::close(m_nSocket);
+                m_nSocket = -1;
+                return false;
+            }
+            return true;
+        }
+
+#if defined(__linux__)
+        // Sends the handles of a new ShmChannel, the server answers 'Y' if it takes it, 'N' to stay on the socket.
+        // false if no answer came, the socket is of no use then
+        bool OfferShm()
+        {
+            shared_ptr<ShmChannel> pShm = ShmChannel::Create();
+            if (pShm == nullptr)
+                return true;    // Stays on the socket
+
+            char caControl[CMSG_SPACE(sizeof(int) * s_nShmFdCount)] = {};
+            iovec stData{ const_cast<char*>(s_caShmOffer), sizeof(s_caShmOffer) };
+            msghdr stMsg{};
+            stMsg.msg_iov = &stData;
+            stMsg.msg_iovlen = 1;
+            stMsg.msg_control = caControl;
+            stMsg.msg_controllen = sizeof(caControl);
+            cmsghdr* pCtrl = CMSG_FIRSTHDR(&stMsg);
+            pCtrl->cmsg_level = SOL_SOCKET;
+            pCtrl->cmsg_type = SCM_RIGHTS;
+            pCtrl->cmsg_len = CMSG_LEN(sizeof(int) * s_nShmFdCount);
+            memcpy(CMSG_DATA(pCtrl), pShm->GetHandles(), sizeof(int) * s_nShmFdCount);
+            if (sendmsg(m_nSocket, &stMsg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(s_caShmOffer)))
+                return false;
+
+            pollfd stPoll{ m_nSocket, POLLIN, 0 };
+            char cAnswer = 0;
+            if (poll(&stPoll, 1, 1000) != 1 || recv(m_nSocket, &cAnswer, 1, 0) != 1 || (cAnswer != 'Y' && cAnswer != 'N'))
+                return false;
+            if (cAnswer == 'Y')
+                m_pShm = move(pShm);
+            return true;
+        }
+
+        // The first bytes of an accepted connection, false if they are no offer but a record
+        bool AcceptShm()
+        {
+            char caOffer[sizeof(s_caShmOffer)];
+            if (recv(m_nSocket, caOffer, sizeof(caOffer), MSG_PEEK) != static_cast<ssize_t>(sizeof(caOffer)) || memcmp(caOffer, s_caShmOffer, sizeof(caOffer)) != 0)
+                return false;   // The client sends the offer in one piece, a record starts with the version 1
+
+            char caControl[CMSG_SPACE(sizeof(int) * s_nShmFdCount)] = {};
+            iovec stData{ caOffer, sizeof(caOffer) };
+            msghdr stMsg{};
+            stMsg.msg_iov = &stData;
+            stMsg.msg_iovlen = 1;
+            stMsg.msg_control = caControl;
+            stMsg.msg_controllen = sizeof(caControl);
+            if (recvmsg(m_nSocket, &stMsg, MSG_CMSG_CLOEXEC) != static_cast<ssize_t>(sizeof(caOffer)))
+                return true;    // Got it with the peek, the socket is broken now
+
+            shared_ptr<ShmChannel> pShm;
+            for (cmsghdr* pCtrl = CMSG_FIRSTHDR(&stMsg); pCtrl != nullptr; pCtrl = CMSG_NXTHDR(&stMsg, pCtrl))
+            {
+                if (pCtrl->cmsg_level == SOL_SOCKET && pCtrl->cmsg_type == SCM_RIGHTS)
+                {
+                    int anFds[s_nShmFdCount + 1];   // One more, to see if there are too many
+                    const size_t nCount = min((pCtrl->cmsg_len - CMSG_LEN(0)) / sizeof(int), s_nShmFdCount + 1);
+                    memcpy(anFds, CMSG_DATA(pCtrl), nCount * sizeof(int));
+                    pShm = ShmChannel::Attach(anFds, nCount);  // Closes them, if they are not usable
+                }
+            }
+
+            const char cAnswer = pShm != nullptr && (stMsg.msg_flags & MSG_CTRUNC) == 0 ? 'Y' : 'N';
+            if (send(m_nSocket, &cAnswer, 1, MSG_NOSIGNAL) == 1 && cAnswer == 'Y')
+                m_pShm = move(pShm);
+            return true;
+        }
+
+        // Once the ShmChannel is taken, the socket only tells us when the other side is gone
+        // The callback comes again while it takes something. The rest of a record it leaves waits for more data.
+        void ShmLoop()
+        {
+            uint64_t nSeen = 0;     // Head of the ring at the last callback
+            bool bTaken = false;
+            while (m_bClosing == false)
+            {
+                const uint64_t nHead = m_pShm->GetHead();
+                if (m_pShm->GetAvailable() > 0 && (nHead != nSeen || bTaken == true))
+                {
+                    nSeen = nHead;
+                    const uint64_t nRead = m_pShm->GetRead();
+                    Callback(m_fnBytesReceived);
+                    bTaken = m_pShm->GetRead() != nRead;
+                }
+                else if (m_pShm->WaitForData(m_nSocket, nSeen) == false)
+                {
+                    if (m_pShm->HasProtocolError() == true)
+                    {
+                        m_nError = EPROTO;
+                        Callback(m_fnError);
+                    }
+                    else if (m_pShm->GetHead() != nSeen && m_pShm->GetAvailable() > 0)  // What was written before it closed
+                        Callback(m_fnBytesReceived);
+                    break;
+                }
+            }
+        }
+#endif
+
+        void ReceiveLoop()
+        {
+            if (m_bAccepted == false)
+                Callback(m_fnConnected);
+
+            pollfd stPoll{ m_nSocket, POLLIN, 0 };
+            bool bFirst = m_bAccepted;
+            while (m_bClosing == false && HasShm() == false)
+            {
+                if (poll(&stPoll, 1, -1) < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    m_nError = errno;
+                    break;
+                }
+
+                if ((stPoll.revents & (POLLERR | POLLNVAL)) != 0)
+                {
+                    int nError = 0;
+                    socklen_t nLen = sizeof(nError);
+                    getsockopt(m_nSocket, SOL_SOCKET, SO_ERROR, &nError, &nLen);
+                    m_nError = nError != 0 ? nError : EBADF;
+                    Callback(m_fnError);
+                    break;
+                }
+
+                if (GetBytesAvailable() == 0)   // Closed by the other side
+                    break;
+#if defined(__linux__)
+                if (bFirst == true && AcceptShm() == true)
+                    continue;
+#endif
+                bFirst = false;
+                Callback(m_fnBytesReceived);
+            }
+#if defined(__linux__)
+            if (HasShm() == true)
+                ShmLoop();
+#endif
+
+            m_bClosing = true;
+            Callback(m_fnClosing);
+            if (m_bAccepted == true)
+                delete this;
+        }
+
+        bool HasShm() const noexcept
+        {
+#if defined(__linux__)
+            return m_pShm != nullptr;
+#else
+            return false;
+#endif
+        }
+
+        int           m_nSocket;
+        const bool    m_bAccepted;
+        const bool    m_bOfferShm;      // A "shm:" address
+#if defined(__linux__)
+        shared_ptr<ShmChannel> m_pShm;  // Set before the records start, not changed afterwards. FCGI_STDIN chunks may keep it longer than us.
+#endif
+        atomic<int>   m_nError;
+        atomic<bool>  m_bReceiving;
+        atomic<bool>  m_bClosing;
+        thread        m_thReceive;      // Only for connections we made, accepted ones run detached
+        mutex         m_mxWrite;
+        mutex         m_mxCallback;
+        FN_EVENT      m_fnConnected;
+        FN_EVENT      m_fnBytesReceived;
+        FN_EVENT      m_fnError;
+        FN_EVENT      m_fnClosing;
+    };
+
+    // Accepts on a unix domain socket, or on a socket that is already listening, the one inherited as FCGI_LISTENSOCK_FILENO
+    class PosixListener : public FastCgiListener
+    {
+    public:
+        explicit PosixListener(const int nSocket = -1) : m_nSocket(nSocket), m_nError(0), m_bStop(false), m_bDone(false), m_anWakePipe{ -1, -1 }
+        {
+            if (pipe(m_anWakePipe) == 0)
+            {
+                for (const int nFd : m_anWakePipe)
+                {
+                    fcntl(nFd, F_SETFL, fcntl(nFd, F_GETFL) | O_NONBLOCK);
+                    fcntl(nFd, F_SETFD, FD_CLOEXEC);
+                }
+            }
+        }
+        ~PosixListener() noexcept override
+        {
+            Close();
+            for (const int nFd : m_anWakePipe)
+            {
+                if (nFd >= 0)
+                    ::close(nFd);
+            }
+        }
+
+        bool Start(const string& strBindAddr, const uint16_t /*usPort*/) override
+        {
+            if (m_thAccept.joinable() == true)
+                return false;
+            if (m_nSocket < 0)
+            {
+                int nError = 0;
+                m_nSocket = ListenUnix(strBindAddr, nError);
+                if (m_nSocket < 0)
+                {
+                    m_nError = nError;
+                    return false;
+                }
+                m_strBindAddr = strBindAddr;
+            }
+            fcntl(m_nSocket, F_SETFD, FD_CLOEXEC);  // Not for the processes we start
+            m_thAccept = thread(&PosixListener::AcceptLoop, this);
+            return true;
+        }
+
+        void Close() override
+        {
+            if (m_thAccept.joinable() == true)
+            {
+                m_bStop = true;
+                if (this_thread::get_id() == m_thAccept.get_id())   // From the error callback, the thread ends by itself
+                    return;
+                NotifyAcceptCondition();    // If it waits for the accept condition
+
+                // Other processes may accept on the same socket. If one of them took the connection we woke up for,
+                // we block in accept until the next one comes, so we send one, like the dummy connection of apache
+                unique_lock<mutex> lock(m_mxDone);
+                while (m_cvDone.wait_for(lock, chrono::milliseconds(200), [&]() noexcept { return m_bDone; }) == false)
+                    WakeUp();
+                lock.unlock();
+                m_thAccept.join();
+            }
+
+            if (m_nSocket >= 0)
+            {
+                ::close(m_nSocket);
+                m_nSocket = -1;
+                RemoveUnixPath(m_strBindAddr);
+            }
+        }
+
+        int GetErrorNo() const override { return m_nError; }
+
+        void BindNewConnection(FN_NEWCONNECTION fnNewConnection) override { m_fnNewConnection = fnNewConnection; }
+        void BindErrorFunction(FN_ERROR fnError) override { m_fnError = fnError; }
+        void BindAcceptCondition(function<bool()> fnCanAccept) override { m_fnCanAccept = fnCanAccept; }
+        void NotifyAcceptCondition() override
+        {
+            const uint8_t cWake = 0;
+            if (m_anWakePipe[1] >= 0 && ::write(m_anWakePipe[1], &cWake, 1) < 0)
+            {   // Full, the accept thread wakes up anyway
+            }
+        }
+
+    private:
+        void AcceptLoop()
+        {
+            // While the accept condition is false the socket is left out of the poll, NotifyAcceptCondition wakes us on the pipe
+            pollfd astPoll[2] = { { m_nSocket, POLLIN, 0 }, { m_anWakePipe[0], POLLIN, 0 } };
+            while (m_bStop == false)
+            {
+                astPoll[0].fd = m_fnCanAccept == nullptr || m_fnCanAccept() == true ? m_nSocket : -1;
+                const int nReady = poll(astPoll, 2, 100);
+                if (nReady < 0 && errno != EINTR)
+                {
+                    Error(errno);
+                    break;
+                }
+                if (nReady <= 0)
+                    continue;
+                if ((astPoll[1].revents & POLLIN) != 0)
+                {
+                    uint8_t caDrain[64];
+                    while (::read(m_anWakePipe[0], caDrain, sizeof(caDrain)) > 0)
+                    {   // Several notifications count as one
+                    }
+                }
+                if (astPoll[0].revents == 0)
+                    continue;
+                if ((astPoll[0].revents & POLLIN) == 0)
+                {
+                    Error(EBADF);
+                    break;
+                }
+
+                const int nSocket = accept(m_nSocket, nullptr, nullptr);
+                if (nSocket < 0)
+                {
+                    if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+                        continue;
+                    Error(errno);
+                    break;
+                }
+
+                if (m_bStop == true)    // Our own wake up connection, or one we are to late for
+                {
+                    ::close(nSocket);
+                    break;
+                }
+
+                fcntl(nSocket, F_SETFD, FD_CLOEXEC);
+                PosixStream* pStream = new PosixStream(nSocket);
+                if (m_fnNewConnection != nullptr)
+                    m_fnNewConnection(vector<FastCgiStream*>({ pStream }));
+                else
+                    pStream->Close();
+            }
+
+            lock_guard<mutex> lock(m_mxDone);
+            m_bDone = true;
+            m_cvDone.notify_all();
+        }
+
+        void Error(const int nError)
+        {
+            m_nError = nError;
+            if (m_fnError != nullptr)
+                m_fnError(this);
+        }
+
+        void WakeUp() const noexcept
+        {
+            sockaddr_storage stAddr{};
+            socklen_t nLen = sizeof(stAddr);
+            if (getsockname(m_nSocket, reinterpret_cast<sockaddr*>(&stAddr), &nLen) != 0)
+                return;
+
+            if (stAddr.ss_family == AF_INET && reinterpret_cast<sockaddr_in*>(&stAddr)->sin_addr.s_addr == htonl(INADDR_ANY))
+                reinterpret_cast<sockaddr_in*>(&stAddr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            else if (stAddr.ss_family == AF_INET6 && IN6_IS_ADDR_UNSPECIFIED(&reinterpret_cast<sockaddr_in6*>(&stAddr)->sin6_addr))
+                reinterpret_cast<sockaddr_in6*>(&stAddr)->sin6_addr = in6addr_loopback;
+
+            const int nSocket = socket(stAddr.ss_family, SOCK_STREAM, 0);
+            if (nSocket >= 0)
+            {
+                connect(nSocket, reinterpret_cast<sockaddr*>(&stAddr), nLen);
+                ::close(nSocket);
+            }
+        }
+
+        int                m_nSocket;
+        string             m_strBindAddr;   // Only if we made the socket
+        atomic<int>        m_nError;
+        atomic<bool>       m_bStop;
+        bool               m_bDone;
+        mutex              m_mxDone;
+        condition_variable m_cvDone;
+        thread             m_thAccept;
+        FN_NEWCONNECTION   m_fnNewConnection;
+        FN_ERROR           m_fnError;
+        function<bool()>   m_fnCanAccept;
+        int                m_anWakePipe[2]; // NotifyAcceptCondition writes a byte, AcceptLoop polls the read end
+    };
+#endif
+}
+
+unique_ptr<FastCgiStream> FastCgiStream::Create(const string& strAddress)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (IsUnixAddress(strAddress) == true)
+        return make_unique<PosixStream>(strAddress.compare(0, 4, "shm:") == 0);
+#else
+    static_cast<void>(strAddress);
+#endif
+    return make_unique<SocketLibStream>();
+}
+
+unique_ptr<FastCgiListener> FastCgiListener::Create(const string& strBindAddr)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (strBindAddr.empty() == true && HasInheritedListener() == true)
+        return make_unique<PosixListener>(FCGI_LISTENSOCK_FILENO);
+    if (IsUnixAddress(strBindAddr) == true)
+        return make_unique<PosixListener>();
+#endif
+    return make_unique<SocketLibListener>();
+}
+
+bool FastCgiListener::HasInheritedListener() noexcept
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    int nListening = 0;
+    socklen_t nLen = sizeof(nListening);
+    return getsockopt(FCGI_LISTENSOCK_FILENO, SOL_SOCKET, SO_ACCEPTCONN, &nListening, &nLen) == 0 && nListening != 0;
+#else
+    return false;
+#endif
+}
+
+FastCgiListenSocket::~FastCgiListenSocket() noexcept
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (m_nSocket >= 0)
+    {
+        ::close(m_nSocket);
+        RemoveUnixPath(m_strAddress);
+    }
+#endif
+}
+
+bool FastCgiListenSocket::Open(const string& strBindAddr, const uint16_t usPort)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (m_nSocket >= 0)
+        return false;
+
+    if (IsUnixAddress(strBindAddr) == true)
+    {
+        int nError = 0;
+        m_nSocket = ListenUnix(strBindAddr, nError);
+        m_strAddress = strBindAddr;
+        return m_nSocket >= 0;
+    }
+
+    addrinfo stHints{}, *pResult = nullptr;
+    stHints.ai_family = AF_UNSPEC;
+    stHints.ai_socktype = SOCK_STREAM;
+    stHints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    if (getaddrinfo(strBindAddr.empty() == true ? nullptr : strBindAddr.c_str(), to_string(usPort).c_str(), &stHints, &pResult) != 0)
+        return false;
+
+    for (addrinfo* pAddr = pResult; pAddr != nullptr && m_nSocket < 0; pAddr = pAddr->ai_next)
+    {
+        m_nSocket = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+        if (m_nSocket < 0)
+            continue;
+
+        const int nOn = 1;
+        setsockopt(m_nSocket, SOL_SOCKET, SO_REUSEADDR, &nOn, sizeof(nOn));
+        fcntl(m_nSocket, F_SETFD, FD_CLOEXEC);  // Only the processes we start get it, as FCGI_LISTENSOCK_FILENO
+        if (::bind(m_nSocket, pAddr->ai_addr, pAddr->ai_addrlen) != 0 || listen(m_nSocket, SOMAXCONN) != 0)
+        {
+            ::close(m_nSocket);
+            m_nSocket = -1;
+        }
+    }
+    freeaddrinfo(pResult);
+    if (m_nSocket < 0)
+        return false;
+
+    // Where we are, a free port was chosen by the system, a wildcard address is reached over loopback
+    sockaddr_storage stAddr{};
+    socklen_t nLen = sizeof(stAddr);
+    char szHost[NI_MAXHOST], szPort[NI_MAXSERV];
+    if (getsockname(m_nSocket, reinterpret_cast<sockaddr*>(&stAddr), &nLen) != 0
+        || getnameinfo(reinterpret_cast<sockaddr*>(&stAddr), nLen, szHost, sizeof(szHost), szPort, sizeof(szPort), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+    {
+        ::close(m_nSocket);
+        m_nSocket = -1;
+        return false;
+    }
+
+    m_strAddress = szHost;
+    if (m_strAddress == "0.0.0.0")
+        m_strAddress = "127.0.0.1";
+    else if (m_strAddress == "::")
+        m_strAddress = "::1";
+    m_usPort = static_cast<uint16_t>(stoul(szPort));
+    return true;
+#else
+    static_cast<void>(strBindAddr);
+    static_cast<void>(usPort);
+    return false;
+#endif
+}
@@ -0,0 +1,117 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#if defined(_WIN32) || defined(_WIN64)
+struct iovec
+{
+    void*  iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
+
+using namespace std;
+
+#define FCGI_LISTENSOCK_FILENO 0
+
+// A connection the FastCGI records go over. Mostly a TcpSocket of the SocketLib, but also sockets
+// the SocketLib can not make, unix domain sockets and the ones accepted on a listening socket inherited
+// from the parent. Addresses like "unix:/run/app.sock" are unix domain sockets, "unix:@app" is in the
+// abstract namespace of linux, the port is not used for them. "shm:/run/app.sock" connects like "unix:",
+// on linux the records then go over two rings in shared memory the client offers, with eventfds to wake
+// the other side. A server that does not take the offer keeps the socket.
+// The callbacks come from the receiving thread. Connections accepted by a FastCgiListener delete
+// themselves after the close callback returned, the others belong to who created them.
+class FastCgiStream
+{
+public:
+    typedef function<void(FastCgiStream* const)> FN_EVENT;
+
+    static unique_ptr<FastCgiStream> Create(const string& strAddress);  // For the client, the one that fits the address, unix domain sockets not on windows
+
+    virtual ~FastCgiStream() noexcept = default;    // No callback runs anymore, once returned
+
+    virtual bool Connect(const string& strAddress, const uint16_t usPort) = 0;   // Established, error or close callback follows
+    virtual size_t Read(void* const pBuffer, const size_t nBufLen) = 0;
+    virtual size_t Write(const void* const pBuffer, const size_t nBufLen) = 0;  // The whole buffer, several threads may write
+    virtual size_t Writev(const iovec* const pVec, const size_t nCount) = 0;    // The parts in one piece, like one Write
+    virtual size_t GetBytesAvailable() const = 0;
+    virtual void StartReceiving() = 0;  // Accepted connections, after the callbacks are bound
+    virtual void Close() = 0;           // The close callback follows
+    virtual int GetErrorNo() const = 0;
+
+    // Streams with the received bytes in memory of their own (shm) let the receiving thread parse them where they are, instead
+    // of Read. PeekReceived returns nullptr if the stream has no such memory. ConsumeReceived gives the parsed bytes free, a part
+    // kept by HoldReceived before only when the last copy of the pointer it returned is gone. It may return a copy instead.
+    virtual uint8_t* PeekReceived(size_t& nLen) { nLen = 0; return nullptr; }
+    virtual shared_ptr<uint8_t> HoldReceived(uint8_t* const /*pData*/, const size_t /*nLen*/) { return nullptr; }
+    virtual void ConsumeReceived(const size_t /*nLen*/) {}
+
+    virtual void BindFuncConEstablished(FN_EVENT fnConnected) = 0;
+    virtual void BindFuncBytesReceived(FN_EVENT fnBytesReceived) = 0;
+    virtual void BindErrorFunction(FN_EVENT fnError) = 0;
+    virtual void BindCloseFunction(FN_EVENT fnClosing) = 0;
+};
+
+// Accepts the connections of the FastCgiServer
+class FastCgiListener
+{
+public:
+    typedef function<void(const vector<FastCgiStream*>&)> FN_NEWCONNECTION;
+    typedef function<void(FastCgiListener* const)> FN_ERROR;
+
+    // An empty bind address takes the listening socket on FCGI_LISTENSOCK_FILENO, if we got one
+    static unique_ptr<FastCgiListener> Create(const string& strBindAddr);
+    static bool HasInheritedListener() noexcept;
+
+    virtual ~FastCgiListener() noexcept = default;
+
+    virtual bool Start(const string& strBindAddr, const uint16_t usPort) = 0;
+    virtual void Close() = 0;
+    virtual int GetErrorNo() const = 0;
+
+    virtual void BindNewConnection(FN_NEWCONNECTION fnNewConnection) = 0;
+    virtual void BindErrorFunction(FN_ERROR fnError) = 0;
+    // Connections are only accepted while it returns true, the others stay in the queue for the processes sharing the socket
+    virtual void BindAcceptCondition(function<bool()> fnCanAccept) = 0;
+    // The condition may be true again, e.g. a connection was closed. Wakes the listener waiting for it.
+    virtual void NotifyAcceptCondition() = 0;
+};
+
+// Listening socket handed to started FastCGI processes as FCGI_LISTENSOCK_FILENO. Several processes
+// may get the same one, they share its accept queue. Not on windows, there the server gets a pipe.
+class FastCgiListenSocket
+{
+public:
+    FastCgiListenSocket() noexcept : m_nSocket(-1), m_usPort(0) {}
+    ~FastCgiListenSocket() noexcept;
+    FastCgiListenSocket(const FastCgiListenSocket&) = delete;
+    FastCgiListenSocket& operator=(const FastCgiListenSocket&) = delete;
+
+    bool Open(const string& strBindAddr, const uint16_t usPort);  // Port 0 takes a free one, a "unix:" address is a unix domain socket
+    const string& GetAddress() const noexcept { return m_strAddress; }  // Where the clients connect to
+    uint16_t GetPort() const noexcept { return m_usPort; }
+    int GetHandle() const noexcept { return m_nSocket; }
+
+private:
+    int      m_nSocket;
+    string   m_strAddress;
+    uint16_t m_usPort;
+};
@@ -0,0 +1,297 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+// Microbenchmarks of the FastCGI encoding helpers, no sockets involved.
+// Each benchmark prints one JSON object per line to stdout.
+//
+// codec_bench [--filter name] [--seconds n]
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "FastCgi.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+__attribute__((weak)) void OutputDebugString(const wchar_t*) {}     // Used if the application does not provide them
+__attribute__((weak)) void OutputDebugStringA(const char*) {}
+#endif
+
+using namespace std;
+
+static volatile uint64_t s_nSink;   // Results go here, so the compiler can not drop the work
+
+class Codec : public FastCgiBase    // Makes the protected helpers accessible
+{
+public:
+    using FastCgiBase::RecordParser;
+    using FastCgiBase::ToShort;
+    using FastCgiBase::ToNumber;
+    using FastCgiBase::NextNameValuePair;
+    using FastCgiBase::FromShort;
+    using FastCgiBase::FromNumber;
+    using FastCgiBase::EncodeParams;
+};
+
+// Variables a web server sends for a typical request, all lengths below 128
+static const vector<pair<string, string>> s_vShortParams =
+{
+    { "GATEWAY_INTERFACE", "CGI/1.1" }, { "SERVER_SOFTWARE", "nginx/1.24.0" }, { "SERVER_NAME", "www.example.com" },
+    { "SERVER_ADDR", "192.168.1.10" }, { "SERVER_PORT", "443" }, { "SERVER_PROTOCOL", "HTTP/1.1" },
+    { "DOCUMENT_ROOT", "/var/www/example" }, { "DOCUMENT_URI", "/index.php" }, { "REQUEST_URI", "/index.php?page=2&sort=name" },
+    { "REQUEST_METHOD", "GET" }, { "QUERY_STRING", "page=2&sort=name" }, { "SCRIPT_NAME", "/index.php" },
+    { "SCRIPT_FILENAME", "/var/www/example/index.php" }, { "PATH_INFO", "" }, { "CONTENT_TYPE", "" },
+    { "CONTENT_LENGTH", "" }, { "REMOTE_ADDR", "203.0.113.54" }, { "REMOTE_PORT", "51234" },
+    { "REQUEST_SCHEME", "https" }, { "HTTPS", "on" }, { "REDIRECT_STATUS", "200" },
+    { "HTTP_HOST", "www.example.com" }, { "HTTP_CONNECTION", "keep-alive" }, { "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+    { "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" }, { "HTTP_ACCEPT_LANGUAGE", "de-DE,de;q=0.9,en;q=0.8" }, { "HTTP_CACHE_CONTROL", "max-age=0" },
+    { "HTTP_UPGRADE_INSECURE_REQUESTS", "1" }, { "HTTP_SEC_FETCH_MODE", "navigate" }, { "HTTP_SEC_FETCH_SITE", "none" },
+};
+
+// The same with values needing the 4 byte length, like browsers send them
+static const vector<pair<string, string>> s_vLongParams = []()
+{
+    vector<pair<string, string>> vParams(s_vShortParams);
+    vParams.emplace_back("HTTP_USER_AGENT", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36 Edg/120.0.0.0");
+    vParams.emplace_back("HTTP_COOKIE", "session=" + string(600, 'c') + "; theme=dark; consent=" + string(200, 'x'));
+    vParams.emplace_back("HTTP_REFERER", "https://www.example.com/search?q=" + string(180, 'q'));
+    return vParams;
+}();
+
+static size_t EncodedSize(const vector<pair<string, string>>& vParams) noexcept
+{
+    size_t nSize = 0;
+    for (auto& item : vParams)
+        nSize += (item.first.size() < 128 ? 1 : 4) + (item.second.size() < 128 ? 1 : 4) + item.first.size() + item.second.size();
+    return nSize;
+}
+
+static vector<uint8_t> Encode(const vector<pair<string, string>>& vParams)
+{
+    vector<uint8_t> vBuffer(EncodedSize(vParams));
+    uint8_t* pPos = vBuffer.data();
+    Codec Helper;
+    for (auto& item : vParams)
+        Helper.AddNameValuePair(&pPos, item.first.c_str(), item.first.size(), item.second.c_str(), item.second.size());
+    return vBuffer;
+}
+
+// Records of a request as the server receives them: BEGIN_REQUEST, PARAMS, empty PARAMS, STDIN, empty STDIN
+static vector<uint8_t> BuildRecords(const vector<uint8_t>& vParams, const size_t nStdIn)
+{
+    vector<uint8_t> vBuffer;
+    const auto fnRecord = [&](const uint8_t nType, const uint8_t* pContent, const size_t nLen)
+    {
+        const uint8_t nPadding = (8 - nLen % 8) & 7;
+        const uint8_t caHeader[8] = { 1, nType, 0, 1, static_cast<uint8_t>(nLen >> 8), static_cast<uint8_t>(nLen & 0xff), nPadding, 0 };
+        vBuffer.insert(end(vBuffer), caHeader, caHeader + 8);
+        vBuffer.insert(end(vBuffer), pContent, pContent + nLen);
+        vBuffer.insert(end(vBuffer), nPadding, 0);
+    };
+
+    const uint8_t caBegin[8] = { 0, 1, 1, 0, 0, 0, 0, 0 };
+    fnRecord(1, caBegin, sizeof(caBegin));                  // FCGI_BEGIN_REQUEST
+    fnRecord(4, vParams.data(), vParams.size());            // FCGI_PARAMS
+    fnRecord(4, nullptr, 0);
+    const vector<uint8_t> vStdIn(16384, 's');
+    for (size_t nLeft = nStdIn; nLeft > 0; nLeft -= min(nLeft, vStdIn.size()))
+        fnRecord(5, vStdIn.data(), min(nLeft, vStdIn.size()));  // FCGI_STDIN
+    fnRecord(5, nullptr, 0);
+    return vBuffer;
+}
+
+class Benchmark
+{
+public:
+    Benchmark(const string& strFilter, const double dSeconds) : m_strFilter(strFilter), m_dSeconds(dSeconds) {}
+
+    // fnRun does one operation processing nBytes, it is repeated until the time is up
+    template <typename FN_RUN>
+    void Run(const char* szName, const size_t nBytes, FN_RUN fnRun)
+    {
+        if (m_strFilter.empty() == false && string(szName).find(m_strFilter) == string::npos)
+            return;
+
+        for (int n = 0; n < 1000; ++n)  // Warm up
+            fnRun();
+
+        uint64_t nIterations = 0;
+        uint64_t nBatch = 1000;
+        const auto tmStart = chrono::steady_clock::now();
+        chrono::duration<double> tmElapsed(0);
+        while (tmElapsed.count() < m_dSeconds)
+        {
+            for (uint64_t n = 0; n < nBatch; ++n)
+                fnRun();
+            nIterations += nBatch;
+            tmElapsed = chrono::steady_clock::now() - tmStart;
+        }
+
+        const double dNsPerOp = tmElapsed.count() * 1e9 / nIterations;
+        cout << "{\"bench\":\"" << szName << "\",\"iterations\":" << nIterations << ",\"ns_per_op\":" << dNsPerOp
+             << ",\"bytes_per_op\":" << nBytes << ",\"mb_per_s\":" << (nBytes * 1e9 / dNsPerOp / (1024 * 1024)) << "}" << endl;
+    }
+
+private:
+    string m_strFilter;
+    double m_dSeconds;
+};
+
+int main(int argc, const char* argv[])
+{
+    string strFilter;
+    double dSeconds = 0.5;
+    for (int n = 1; n + 1 < argc; n += 2)
+    {
+        const string strOption(argv[n]);
+        if (strOption == "--filter")
+            strFilter = argv[n + 1];
+        else if (strOption == "--seconds")
+            dSeconds = strtod(argv[n + 1], nullptr);
+        else
+        {
+            cerr << "unknown option " << strOption << endl;
+            return 1;
+        }
+    }
+
+    Benchmark Bench(strFilter, dSeconds);
+    Codec Helper;
+
+    // Encoding of name-value pairs
+    for (auto pParams : { &s_vShortParams, &s_vLongParams })
+    {
+        const vector<pair<string, string>>& vParams = *pParams;
+        const bool bShort = pParams == &s_vShortParams;
+        vector<uint8_t> vBuffer(EncodedSize(vParams));
+
+        Bench.Run(bShort ? "encode_params_short" : "encode_params_long", vBuffer.size(), [&]()
+        {
+            uint8_t* pPos = vBuffer.data();
+            for (auto& item : vParams)
+                Helper.AddNameValuePair(&pPos, item.first.c_str(), item.first.size(), item.second.c_str(), item.second.size());
+            s_nSink = vBuffer[0];
+        });
+
+        FastCgiParamBlock Block;
+        for (auto& item : vParams)
+            Block.Add(item.first, item.second);
+        Bench.Run(bShort ? "copy_param_block_short" : "copy_param_block_long", Block.size(), [&]()
+        {
+            memcpy(vBuffer.data(), Block.data(), Block.size());
+            s_nSink = vBuffer[0];
+        });
+
+        const vector<uint8_t> vEncoded = Encode(vParams);
+        Bench.Run(bShort ? "decode_params_short" : "decode_params_long", vEncoded.size(), [&]()
+        {
+            const uint8_t* pPos = vEncoded.data();
+            const char* pKey, *pValue;
+            uint32_t nKeyLen, nValueLen, nSum = 0;
+            while (Codec::NextNameValuePair(&pPos, vEncoded.data() + vEncoded.size(), &pKey, nKeyLen, &pValue, nValueLen) == true)
+                nSum += nKeyLen + nValueLen;
+            s_nSink = nSum;
+        });
+
+        Bench.Run(bShort ? "decode_params_map_short" : "decode_params_map_long", vEncoded.size(), [&]()
+        {
+            const uint8_t* pPos = vEncoded.data();
+            const char* pKey, *pValue;
+            uint32_t nKeyLen, nValueLen;
+            PARAMETERLIST lstParameter;
+            while (Codec::NextNameValuePair(&pPos, vEncoded.data() + vEncoded.size(), &pKey, nKeyLen, &pValue, nValueLen) == true)
+                lstParameter.emplace(string(pKey, nKeyLen), string(pValue, nValueLen));
+            s_nSink = lstParameter.size();
+        });
+
+        // What the server does per request: the received content is indexed, a handler looks up some parameters.
+        // Copying the content into the string is part of it, the server appends the records to it as well.
+        FastCgiParams Params;
+        string strContent;
+        Bench.Run(bShort ? "parse_params_lookup_short" : "parse_params_lookup_long", vEncoded.size(), [&]()
+        {
+            strContent.assign(reinterpret_cast<const char*>(vEncoded.data()), vEncoded.size());
+            Params.Parse(strContent);
+            size_t nSum = Params.Get(FastCgiParams::REQUEST_METHOD).size() + Params.Get(FastCgiParams::SCRIPT_FILENAME).size()
+                + Params.Get(FastCgiParams::QUERY_STRING).size() + Params.Get(FastCgiParams::HTTP_HOST).size();
+            nSum += Params.Get("HTTP_ACCEPT_LANGUAGE").size() + (Params.Has("HTTP_X_FORWARDED_FOR") == true ? 1 : 0);
+            s_nSink = nSum;
+        });
+    }
+
+    // PARAMS as SendRequest encodes them, above 64 KB they are split into several records
+    for (const size_t nLarge : { static_cast<size_t>(0), static_cast<size_t>(200 * 1024) })
+    {
+        vector<pair<string, string>> vParams(s_vShortParams);
+        if (nLarge > 0)
+            vParams.emplace_back("HTTP_X_LARGE", string(nLarge, 'l'));
+        const size_t nParamLen = EncodedSize(vParams);
+
+        Bench.Run(nLarge == 0 ? "encode_param_records_short" : "encode_param_records_200k", nParamLen, [&]()
+        {
+            vector<uint8_t, PoolAllocator<uint8_t>> vBuffer;
+            vBuffer.reserve(nParamLen + (nParamLen / 65535 + 2) * 16);
+            s_nSink = Codec::EncodeParams(vBuffer, 1, nullptr, vParams) + vBuffer.size();
+        });
+    }
+
+    // Length fields
+    Bench.Run("from_to_number", 5, [&]()
+    {
+        uint8_t caBuffer[8];
+        uint8_t* pPos = caBuffer;
+        Helper.FromNumber(&pPos, static_cast<uint32_t>(s_nSink & 0x7f));
+        Helper.FromNumber(&pPos, 100000);
+        pPos = caBuffer;
+        uint16_t nContentLen = 8;
+        uint32_t nSum = Helper.ToNumber(&pPos, nContentLen);
+        nSum += Helper.ToNumber(&pPos, nContentLen);
+        s_nSink = nSum;
+    });
+
+    Bench.Run("from_to_short", 2, [&]()
+    {
+        uint8_t caBuffer[2];
+        Helper.FromShort(caBuffer, static_cast<uint16_t>(s_nSink + 4711));
+        s_nSink = Helper.ToShort(caBuffer);
+    });
+
+    // Record framing: a request split into records, parsed in receive sized pieces
+    for (const size_t nStdIn : { static_cast<size_t>(0), static_cast<size_t>(256 * 1024) })
+    {
+        const vector<uint8_t> vRecords = BuildRecords(Encode(s_vShortParams), nStdIn);
+        for (const size_t nChunk : { static_cast<size_t>(1460), static_cast<size_t>(65536) })
+        {
+            const string strName = string(nStdIn == 0 ? "parse_records_get" : "parse_records_post") + "_" + to_string(nChunk);
+            Codec::RecordParser Parser;
+            Bench.Run(strName.c_str(), vRecords.size(), [&]()
+            {
+                uint64_t nSum = 0;
+                for (size_t nPos = 0; nPos < vRecords.size(); nPos += nChunk)
+                {
+                    const size_t nLen = min(nChunk, vRecords.size() - nPos);
+                    memcpy(Parser.GetWriteBuffer(nLen), vRecords.data() + nPos, nLen);
+                    Parser.Commit(nLen);
+                    Parser.Parse([&](const uint8_t nType, const uint16_t nRequestId, uint8_t*, const uint16_t nContentLen) noexcept
+                    {
+                        nSum += nType + nRequestId + nContentLen;
+                        return true;
+                    });
+                }
+                s_nSink = nSum;
+            });
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,249 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+// Loopback benchmark: a FastCgiServer and FastCgiClients in one process.
+// Each scenario prints one JSON object per line to stdout, progress goes to stderr.
+//
+// fastcgi_bench [--scenario name] [--requests n] [--address a] [--port n] [--threads n]
+//   scenarios: small_get, large_response, large_upload, single, multiplexed, many_connections, all (default)
+//   address: 127.0.0.1 (default), or a unix domain socket like unix:/tmp/fastcgi_bench.sock,
+//            shm:/tmp/fastcgi_bench.sock for the records over shared memory (linux)
+//
+// TCP runs over SocketLib, unix: and shm: over the POSIX stream in Transport.cpp. TCP numbers only say something
+// against the SocketLib build the application links, compare the transports with that one only.
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+#include "FastCgi.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+__attribute__((weak)) void OutputDebugString(const wchar_t*) {}     // Used if the application does not provide them
+__attribute__((weak)) void OutputDebugStringA(const char*) {}
+#endif
+
+using namespace std;
+
+typedef struct
+{
+    const char* szName;
+    uint32_t    nConnections;   // Client connections
+    uint32_t    nInFlight;      // Requests sent before waiting for the answer, per connection
+    uint32_t    nRequests;      // Total, split over the connections
+    uint32_t    nUpload;        // Bytes sent on FCGI_STDIN per request
+    uint32_t    nResponse;      // Bytes the handler writes per request
+}SCENARIO;
+
+static const SCENARIO s_aScenarios[] =
+{
+    { "small_get",        1,  1,  20000, 0,           128 },
+    { "large_response",   1,  1,  500,   0,           1024 * 1024 },
+    { "large_upload",     1,  1,  500,   1024 * 1024, 128 },
+    { "single",           4,  1,  20000, 0,           1024 },
+    { "multiplexed",      4,  16, 20000, 0,           1024 },
+    { "many_connections", 64, 1,  20000, 0,           1024 },
+};
+
+typedef struct
+{
+    uint64_t nRequests;
+    uint64_t nErrors;
+    uint64_t nBytes;            // Response body received and upload sent
+    vector<uint32_t> vLatency;  // Microseconds
+}RESULT;
+
+static void RunConnection(const string& strAddress, const uint16_t nPort, const SCENARIO& Scenario, const uint32_t nRequests, RESULT& Result)
+{
+    const string strResponse = to_string(Scenario.nResponse);
+    const string strBody(Scenario.nUpload, 'u');
+    mutex mxInFlight;
+    condition_variable cvInFlight;
+    uint32_t nInFlight = 0;
+    atomic<uint64_t> nReceived(0);
+    atomic<uint64_t> nErrors(0);
+    vector<chrono::steady_clock::time_point> vStart(65536);
+    Result.vLatency.reserve(nRequests);
+
+    FastCgiClient Client;   // Destroyed first, it may still call the callbacks
+    if (Client.Connect(strAddress, nPort) != 1)
+    {
+        Result.nErrors += nRequests;
+        return;
+    }
+
+    for (uint32_t nSent = 0; nSent < nRequests;)
+    {
+        unique_lock<mutex> lock(mxInFlight);
+        cvInFlight.wait(lock, [&]() noexcept { return nInFlight < Scenario.nInFlight; });
+
+        vector<pair<string, string>> vCgiParam{ { "REQUEST_METHOD", Scenario.nUpload > 0 ? "POST" : "GET" }, { "SCRIPT_FILENAME", "/bench" },
+                                                { "CONTENT_LENGTH", to_string(Scenario.nUpload) }, { "RESPONSE_SIZE", strResponse } };
+        const auto tmStart = chrono::steady_clock::now();   // The lock is held, so the answer can not be handled before vStart is set
+        const uint16_t nRequestId = Client.SendRequest(vCgiParam,
+            [&](const uint16_t, const unsigned char*, uint16_t nLen, void*) { nReceived += nLen; },
+            [&](const uint16_t nReqId, const uint32_t nAppStatus, const uint8_t nProtocolStatus, const string&, void*)
+            {
+                const auto tmEnd = chrono::steady_clock::now();
+                lock_guard<mutex> lock(mxInFlight);
+                const uint32_t nLatency = static_cast<uint32_t>(chrono::duration_cast<chrono::microseconds>(tmEnd - vStart[nReqId]).count());
+                if (nAppStatus != 0 || nProtocolStatus != 0)
+                    ++nErrors;
+                Result.vLatency.push_back(nLatency);
+                --nInFlight;
+                cvInFlight.notify_one();
+            });
+
+        if (nRequestId == 0)
+        {
+            lock.unlock();
+            if (Client.IsConnected() == false)
+                break;
+            this_thread::sleep_for(chrono::microseconds(100));  // Request limit of the server reached
+            continue;
+        }
+
+        vStart[nRequestId] = tmStart;
+        ++nInFlight;
+        lock.unlock();
+
+        if (strBody.empty() == false)
+            Client.SendRequestData(nRequestId, strBody.data(), static_cast<uint32_t>(strBody.size()));
+        Client.SendRequestData(nRequestId, nullptr, 0);
+        ++nSent;
+    }
+
+    unique_lock<mutex> lock(mxInFlight);
+    if (cvInFlight.wait_for(lock, chrono::seconds(30), [&]() noexcept { return nInFlight == 0; }) == false)
+        nErrors += nInFlight;
+
+    Result.nRequests = Result.vLatency.size();
+    Result.nErrors += nErrors + (nRequests - min(nRequests, static_cast<uint32_t>(Result.nRequests)));
+    Result.nBytes = nReceived + static_cast<uint64_t>(Scenario.nUpload) * Result.nRequests;
+}
+
+static uint32_t Percentile(const vector<uint32_t>& vSorted, const double dFraction) noexcept
+{
+    if (vSorted.empty() == true)
+        return 0;
+    return vSorted[min(vSorted.size() - 1, static_cast<size_t>(dFraction * vSorted.size()))];
+}
+
+static void RunScenario(const string& strAddress, const uint16_t nPort, const SCENARIO& Scenario, const uint32_t nRequests)
+{
+    cerr << "running " << Scenario.szName << " ..." << endl;
+
+    vector<RESULT> vResults(Scenario.nConnections);
+    vector<thread> vThreads;
+    const auto tmStart = chrono::steady_clock::now();
+    for (uint32_t n = 0; n < Scenario.nConnections; ++n)
+    {
+        const uint32_t nShare = nRequests / Scenario.nConnections + (n < nRequests % Scenario.nConnections ? 1 : 0);
+        vThreads.emplace_back(RunConnection, cref(strAddress), nPort, cref(Scenario), nShare, ref(vResults[n]));
+    }
+    for (auto& thConnection : vThreads)
+        thConnection.join();
+    const double dSeconds = chrono::duration<double>(chrono::steady_clock::now() - tmStart).count();
+
+    uint64_t nDone = 0, nErrors = 0, nBytes = 0;
+    vector<uint32_t> vLatency;
+    for (auto& Result : vResults)
+    {
+        nDone += Result.nRequests, nErrors += Result.nErrors, nBytes += Result.nBytes;
+        vLatency.insert(end(vLatency), begin(Result.vLatency), end(Result.vLatency));
+    }
+    sort(begin(vLatency), end(vLatency));
+
+    cout << "{\"scenario\":\"" << Scenario.szName << "\",\"address\":\"" << strAddress << "\",\"connections\":" << Scenario.nConnections << ",\"in_flight\":" << Scenario.nInFlight
+         << ",\"upload_bytes\":" << Scenario.nUpload << ",\"response_bytes\":" << Scenario.nResponse
+         << ",\"requests\":" << nDone << ",\"errors\":" << nErrors << ",\"seconds\":" << dSeconds
+         << ",\"requests_per_s\":" << (dSeconds > 0 ? nDone / dSeconds : 0) << ",\"mb_per_s\":" << (dSeconds > 0 ? nBytes / dSeconds / (1024 * 1024) : 0)
+         << ",\"p50_us\":" << Percentile(vLatency, 0.5) << ",\"p99_us\":" << Percentile(vLatency, 0.99) << ",\"p999_us\":" << Percentile(vLatency, 0.999)
+         << "}" << endl;
+}
+
+int main(int argc, const char* argv[])
+{
+    string strScenario("all");
+    uint32_t nRequests = 0;     // 0 = default of the scenario
+    string strAddress("127.0.0.1");
+    uint16_t nPort = 19100;
+    uint32_t nThreads = 50;
+
+    for (int n = 1; n + 1 < argc; n += 2)
+    {
+        const string strOption(argv[n]);
+        if (strOption == "--scenario")
+            strScenario = argv[n + 1];
+        else if (strOption == "--requests")
+            nRequests = static_cast<uint32_t>(strtoul(argv[n + 1], nullptr, 10));
+        else if (strOption == "--address")
+            strAddress = argv[n + 1];
+        else if (strOption == "--port")
+            nPort = static_cast<uint16_t>(strtoul(argv[n + 1], nullptr, 10));
+        else if (strOption == "--threads")
+            nThreads = static_cast<uint32_t>(strtoul(argv[n + 1], nullptr, 10));
+        else
+        {
+            cerr << "unknown option " << strOption << endl;
+            return 1;
+        }
+    }
+
+    FastCgiServer Server(strAddress, nPort, nullptr);
+    Server.SetRequestHandler([](const FastCgiParams& Params, ostream& streamOut, istream& streamIn) -> int
+    {
+        static const string strChunk(16384, 'r');
+
+        char caDiscard[16384];
+        while (streamIn.read(caDiscard, sizeof(caDiscard)) || streamIn.gcount() > 0)
+        {   // Upload is only read
+        }
+
+        const ParamView vSize = Params.Get("RESPONSE_SIZE");
+        size_t nResponse = static_cast<size_t>(strtoul(string(vSize.data(), vSize.size()).c_str(), nullptr, 10));
+        streamOut << "Content-Type: application/octet-stream\r\n\r\n";
+        for (; nResponse > 0; nResponse -= min(nResponse, strChunk.size()))
+            streamOut.write(strChunk.data(), min(nResponse, strChunk.size()));
+        return 0;
+    });
+    Server.SetWorkerPool(nThreads);
+    Server.SetLimits(256, 4096);    // The scenarios may have more requests in flight than threads, they wait in the run queue
+    if (Server.Start() == false)
+    {
+        cerr << "server could not listen on " << strAddress << " port " << nPort << endl;
+        return 1;
+    }
+    this_thread::sleep_for(chrono::milliseconds(100));
+
+    bool bFound = false;
+    for (auto& Scenario : s_aScenarios)
+    {
+        if (strScenario == "all" || strScenario == Scenario.szName)
+        {
+            RunScenario(strAddress, nPort, Scenario, nRequests > 0 ? nRequests : Scenario.nRequests);
+            bFound = true;
+        }
+    }
+
+    Server.Stop();
+    if (bFound == false)
+    {
+        cerr << "unknown scenario " << strScenario << endl;
+        return 1;
+    }
+
+    auto Statistic = BufferPool::GetStatistic();
+    cerr << "buffer pool: hits " << Statistic.nHits << ", misses " << Statistic.nMisses << ", oversize " << Statistic.nOversize << endl;
+    return 0;
+}
@@ -0,0 +1,726 @@
+/* Copyright (C) 2016-2020 Thomas Hauck - All Rights Reserved.
+
+   Distributed under MIT license.
+   See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+
+   The author would be happy if changes and
+   improvements were reported back to him.
+
+   Author:  Thomas Hauck
+   Email:   Thomas@fam-hauck.de
+*/
+
+// Loopback test: a FastCgiServer and FastCgiClients in one process, each case on its own port.
+// Prints one line per case, returns the number of failed cases.
+//
+// fastcgi_test [--port n]     first port used, default 19100, the cases use the following ones
+// fastcgi_test --backend      started by the process cases, serves on FCGI_LISTENSOCK_FILENO (not on windows)
+
+#include <iostream>
+#include <cstdlib>
+#include <set>
+#include <codecvt>
+#include <locale>
+
+#include "FastCgi.h"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <csignal>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+#if !defined(_WIN32) && !defined(_WIN64)
+__attribute__((weak)) void OutputDebugString(const wchar_t*) {}     // Used if the application does not provide them
+__attribute__((weak)) void OutputDebugStringA(const char*) {}
+#endif
+
+using namespace std;
+
+static const uint8_t FCGI_REQUEST_COMPLETE = 0;     // Protocol status of FCGI_END_REQUEST
+static const uint8_t FCGI_OVERLOADED = 2;
+static const chrono::seconds s_tmWait(10);          // Longest time a case waits for an answer
+static wstring s_strBackend;                        // Command line starting this program with --backend
+
+#define CHECK(cond) do { if ((cond) == false) { cout << "  " << __LINE__ << ": " << #cond << " failed" << endl; return false; } } while (false)
+
+typedef struct
+{
+    mutex              mxDone;
+    condition_variable cvDone;
+    bool               bDone;
+    string             strOutput;       // Body of the answer, the header is removed by Wait
+    uint32_t           nAppStatus;
+    uint8_t            nProtocolStatus;
+}RESPONSE;
+
+// The handler of all cases. It reads FCGI_STDIN to the end and answers with
+// "<number of params> <stdin length> <TOKEN> <aborted> <length of BIG> <BIG as expected>"
+static atomic<uint32_t> s_nHandlerStarted(0);
+static atomic<uint32_t> s_nHandlerAborted(0);
+
+static string BigValue(const size_t nLen)
+{
+    string strValue(nLen, 0);
+    for (size_t n = 0; n < nLen; ++n)
+        strValue[n] = static_cast<char>('a' + n % 23);
+    return strValue;
+}
+
+static int Handler(const FastCgiParams& Params, ostream& streamOut, istream& streamIn)
+{
+    ++s_nHandlerStarted;
+    string strBody;
+    char caBuffer[4096];
+    while (streamIn.read(caBuffer, sizeof(caBuffer)) || streamIn.gcount() > 0)
+        strBody.append(caBuffer, static_cast<size_t>(streamIn.gcount()));
+
+    const ParamView vSleep = Params.Get("SLEEP");
+    if (vSleep.empty() == false)
+        this_thread::sleep_for(chrono::milliseconds(strtoul(string(vSleep.data(), vSleep.size()).c_str(), nullptr, 10)));
+
+    if (Params.IsAborted() == true)
+        ++s_nHandlerAborted;
+
+    const ParamView vToken = Params.Get("TOKEN");
+    const ParamView vBig = Params.Get("BIG");
+    streamOut << "Content-Type: text/plain\r\n\r\n" << Params.size() << ' ' << strBody.size() << ' ' << string(vToken.data(), vToken.size()) << ' '
+        << (Params.IsAborted() == true ? 1 : 0) << ' ' << vBig.size() << ' ' << (string(vBig.data(), vBig.size()) == BigValue(vBig.size()) ? 1 : 0);
+
+    const ParamView vStream = Params.Get("STREAM");    // Additional output, flushed in several records
+    for (size_t n = strtoul(string(vStream.data(), vStream.size()).c_str(), nullptr, 10); n > 0 && streamOut.good() == true; --n)
+    {
+        streamOut << string(1000, 's') << flush;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return 7;
+}
+
+static uint16_t Send(FastCgiClient& Client, vector<pair<string, string>> vParams, RESPONSE& Response, const string& strBody = string(), const bool bEndStdIn = true)
+{
+    Response.bDone = false;
+    Response.strOutput.clear();
+    const uint16_t nRequestId = Client.SendRequest(vParams, [&Response](const uint16_t, const unsigned char* pData, uint16_t nLen, void*)
+    {
+        Response.strOutput.append(reinterpret_cast<const char*>(pData), nLen);
+    },
+    [&Response](const uint16_t, const uint32_t nAppStatus, const uint8_t nProtocolStatus, const string&, void*)
+    {
+        lock_guard<mutex> lock(Response.mxDone);
+        Response.nAppStatus = nAppStatus;
+        Response.nProtocolStatus = nProtocolStatus;
+        Response.bDone = true;
+        Response.cvDone.notify_all();
+    });
+
+    if (nRequestId != 0 && strBody.empty() == false)
+        Client.SendRequestData(nRequestId, strBody.data(), static_cast<uint32_t>(strBody.size()));
+    if (nRequestId != 0 && bEndStdIn == true)
+        Client.SendRequestData(nRequestId, nullptr, 0);
+    return nRequestId;
+}
+
+static bool Wait(RESPONSE& Response)
+{
+    unique_lock<mutex> lock(Response.mxDone);
+    if (Response.cvDone.wait_for(lock, s_tmWait, [&]() noexcept { return Response.bDone; }) == false)
+        return false;
+    const size_t nHeaderEnd = Response.strOutput.find("\r\n\r\n");
+    if (nHeaderEnd != string::npos)
+        Response.strOutput.erase(0, nHeaderEnd + 4);
+    return true;
+}
+
+static bool WaitFor(const function<bool()>& fnReady)
+{
+    const chrono::steady_clock::time_point tmEnd = chrono::steady_clock::now() + s_tmWait;
+    while (fnReady() == false)
+    {
+        if (chrono::steady_clock::now() > tmEnd)
+            return false;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return true;
+}
+
+// Several threads share the connections of a FastCgiClientPool to a server without multiplexing. Prewarm opens them,
+// there are never more than FCGI_MAX_CONNS, on release only nMaxIdle idle ones are kept.
+static bool ClientPool(const uint16_t nPort)
+{
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetWorkerPool(4);
+    Server.SetLimits(4, 4, false);
+    CHECK(Server.Start() == true);
+
+    FastCgiClientPool Pool("127.0.0.1", nPort, 2);
+    CHECK(Pool.Prewarm(3) == 3);
+    CHECK(Pool.GetConnectionCount() == 3);
+
+    atomic<uint32_t> nOk(0), nFailed(0);
+    atomic<size_t> nMaxConnections(0);
+    vector<thread> vThreads;
+    for (uint32_t nThread = 0; nThread < 6; ++nThread)
+    {
+        vThreads.emplace_back([&, nThread]()
+        {
+            for (uint32_t n = 0; n < 20;)
+            {
+                FastCgiClient* pClient = Pool.Acquire();
+                if (pClient == nullptr)     // All FCGI_MAX_CONNS connections are busy
+                {
+                    this_thread::sleep_for(chrono::milliseconds(1));
+                    continue;
+                }
+                nMaxConnections = max(nMaxConnections.load(), Pool.GetConnectionCount());
+
+                RESPONSE Response;
+                const string strToken = to_string(nThread) + "_" + to_string(n++);
+                if (Send(*pClient, { { "TOKEN", strToken }, { "SLEEP", "2" } }, Response) != 0 && Wait(Response) == true && Response.strOutput == "2 0 " + strToken + " 0 0 1")
+                    ++nOk;
+                else
+                    ++nFailed;
+                Pool.Release(pClient);
+            }
+        });
+    }
+    for (auto& thClient : vThreads)
+        thClient.join();
+
+    CHECK(nFailed == 0);
+    CHECK(nOk == 120);
+    CHECK(nMaxConnections <= 4);
+    CHECK(Pool.GetConnectionCount() <= 2);
+
+    Server.Stop();
+    return true;
+}
+
+// FCGI_PARAMS over 64 KB are sent in several records and put together by the server,
+// above SetMaxParamsSize the request is ended with FCGI_OVERLOADED
+static bool LargeParams(const uint16_t nPort)
+{
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetMaxParamsSize(512 * 1024);
+    CHECK(Server.Start() == true);
+
+    FastCgiClient Client;
+    CHECK(Client.Connect("127.0.0.1", nPort) == 1);
+
+    for (const size_t nLen : { size_t(65535), size_t(65536), size_t(200000), size_t(400000) })
+    {
+        RESPONSE Response;
+        CHECK(Send(Client, { { "TOKEN", "d" }, { "BIG", BigValue(nLen) }, { "AFTER", "1" } }, Response) != 0);
+        CHECK(Wait(Response) == true);
+        CHECK(Response.nProtocolStatus == FCGI_REQUEST_COMPLETE);
+        CHECK(Response.strOutput == "3 0 d 0 " + to_string(nLen) + " 1");
+    }
+
+    RESPONSE TooLarge;
+    CHECK(Send(Client, { { "BIG", BigValue(600000) } }, TooLarge) != 0);
+    CHECK(Wait(TooLarge) == true);
+    CHECK(TooLarge.nProtocolStatus == FCGI_OVERLOADED);
+
+    RESPONSE After;     // The connection goes on
+    CHECK(Send(Client, { { "TOKEN", "e" } }, After) != 0);
+    CHECK(Wait(After) == true);
+    CHECK(After.strOutput == "1 0 e 0 0 1");
+
+    Server.Stop();
+    return true;
+}
+
+// Many requests, several at a time on one connection. The request ids and slots of the client and the
+// recycled requests of the server are used again, no answer must reach another request, no parameter survive its request.
+static bool RequestReuse(const uint16_t nPort)
+{
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetWorkerPool(8);
+    Server.SetLimits(0, 64);
+    CHECK(Server.Start() == true);
+
+    FastCgiClient Client;
+    CHECK(Client.Connect("127.0.0.1", nPort) == 1);
+
+    static const uint32_t nInFlight = 16;
+    uint16_t nMaxId = 0;
+    RESPONSE aResponse[nInFlight];
+    for (uint32_t nRound = 0; nRound < 200; ++nRound)
+    {
+        for (uint32_t n = 0; n < nInFlight; ++n)
+        {
+            vector<pair<string, string>> vParams{ { "TOKEN", to_string(nRound) + "_" + to_string(n) } };
+            if (n % 2 == 0)
+                vParams.emplace_back("EXTRA", "1");
+            const uint16_t nRequestId = Send(Client, vParams, aResponse[n], string(n, 'x'));
+            CHECK(nRequestId != 0);
+            nMaxId = max(nMaxId, nRequestId);
+        }
+        for (uint32_t n = 0; n < nInFlight; ++n)
+        {
+            CHECK(Wait(aResponse[n]) == true);
+            CHECK(aResponse[n].strOutput == to_string(n % 2 == 0 ? 2 : 1) + " " + to_string(n) + " " + to_string(nRound) + "_" + to_string(n) + " 0 0 1");
+        }
+    }
+    CHECK(nMaxId <= nInFlight);     // The ids are used again
+
+    Server.Stop();
+    return true;
+}
+
+// After RemoveRequest no callback of the request runs, also if output of it is on the way
+static bool RemoveWhileReceiving(const uint16_t nPort)
+{
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetWorkerPool(8);
+    Server.SetLimits(0, 64);
+    CHECK(Server.Start() == true);
+
+    FastCgiClient Client;
+    CHECK(Client.Connect("127.0.0.1", nPort) == 1);
+
+    atomic<uint32_t> nLate(0);
+    for (int nLoop = 0; nLoop < 30; ++nLoop)
+    {
+        const shared_ptr<atomic<bool>> pbRemoved = make_shared<atomic<bool>>(false);
+        vector<pair<string, string>> vParams{ { "STREAM", "40" } };
+        const uint16_t nRequestId = Client.SendRequest(vParams, [pbRemoved, &nLate](const uint16_t, const unsigned char*, uint16_t, void*)
+        {
+            this_thread::sleep_for(chrono::microseconds(300));
+            if (*pbRemoved == true)
+                ++nLate;
+        }, [](const uint16_t, const uint32_t, const uint8_t, const string&, void*) {});
+        CHECK(nRequestId != 0);
+        Client.SendRequestData(nRequestId, nullptr, 0);
+        this_thread::sleep_for(chrono::milliseconds(10 + nLoop % 7));
+        Client.RemoveRequest(nRequestId);
+        *pbRemoved = true;
+    }
+    this_thread::sleep_for(chrono::milliseconds(200));
+    CHECK(nLate == 0);
+
+    Server.Stop();
+    return true;
+}
+
+// Requests one after the other on a connection get the streams of the request before, their buffers come
+// from the BufferPool. Once it is warm, no request allocates a buffer anymore.
+static bool ContextRecycling(const uint16_t nPort)
+{
+    mutex mxStreams;
+    set<const void*> setStreams;
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler([&](const FastCgiParams& Params, ostream& streamOut, istream& streamIn) -> int
+    {
+        mxStreams.lock();
+        setStreams.insert(&streamOut);
+        setStreams.insert(&streamIn);
+        mxStreams.unlock();
+        return Handler(Params, streamOut, streamIn);
+    });
+    Server.SetWorkerPool(4);
+    CHECK(Server.Start() == true);
+
+    FastCgiClient Client;
+    CHECK(Client.Connect("127.0.0.1", nPort) == 1);
+
+    uint64_t nMisses = 0;
+    for (uint32_t n = 0; n < 300; ++n)
+    {
+        if (n == 50)    // Warm
+            nMisses = BufferPool::GetStatistic().nMisses;
+
+        RESPONSE Response;
+        CHECK(Send(Client, { { "TOKEN", to_string(n) }, { "STREAM", n % 10 == 0 ? "20" : "0" } }, Response, string(20000, 'u')) != 0);
+        CHECK(Wait(Response) == true);
+        CHECK(Response.strOutput == "2 20000 " + to_string(n) + " 0 0 1" + string(n % 10 == 0 ? 20000 : 0, 's'));
+    }
+    CHECK(setStreams.size() == 2);
+    CHECK(BufferPool::GetStatistic().nMisses == nMisses);
+
+    Server.Stop();
+    return true;
+}
+
+// FCGI_ABORT_REQUEST while the handler waits on FCGI_STDIN, then the recycled request is used again on the connection
+static bool AbortDuringStdIn(const uint16_t nPort)
+{
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetWorkerPool(4);
+    CHECK(Server.Start() == true);
+
+    FastCgiClient Client;
+    CHECK(Client.Connect("127.0.0.1", nPort) == 1);
+
+    for (int nLoop = 0; nLoop < 3; ++nLoop)
+    {
+        const uint32_t nStarted = s_nHandlerStarted, nAborted = s_nHandlerAborted;
+        RESPONSE Aborted;
+        const uint16_t nAbortedId = Send(Client, { { "TOKEN", "a" } }, Aborted, string(1000, 'i'), false);
+        CHECK(nAbortedId != 0);
+        CHECK(WaitFor([&]() { return s_nHandlerStarted > nStarted; }) == true);
+        CHECK(Client.AbortRequest(nAbortedId) == true);
+        CHECK(Wait(Aborted) == true);
+        CHECK(WaitFor([&]() { return s_nHandlerAborted > nAborted; }) == true);
+        CHECK(Aborted.strOutput.empty() == true);   // The output of an aborted request is discarded
+
+        RESPONSE Next;
+        CHECK(Send(Client, { { "TOKEN", "b" } }, Next, "hello") != 0);
+        CHECK(Wait(Next) == true);
+        CHECK(Next.nProtocolStatus == FCGI_REQUEST_COMPLETE);
+        CHECK(Next.nAppStatus == 7);
+        CHECK(Next.strOutput == "1 5 b 0 0 1");
+    }
+
+    Server.Stop();
+    return true;
+}
+
+// Requests above SetLimits get FCGI_OVERLOADED, the others are answered. Connections above it are closed.
+static bool LimitsOverload(const uint16_t nPort)
+{
+    FastCgiServer Server("127.0.0.1", nPort, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetWorkerPool(4);
+    Server.SetLimits(2, 2);
+    CHECK(Server.Start() == true);
+
+    FastCgiClient aClient[3];
+    CHECK(aClient[0].Connect("127.0.0.1", nPort) == 1);
+    CHECK(aClient[1].Connect("127.0.0.1", nPort) == 1);
+    CHECK(aClient[0].GetMaxReqs() == 2);
+    CHECK(aClient[2].Connect("127.0.0.1", nPort) != 1 || WaitFor([&]() { return aClient[2].IsConnected() == false; }) == true);
+
+    RESPONSE aResponse[4];  // Each client keeps FCGI_MAX_REQS, the server gets twice as many
+    for (size_t n = 0; n < 4; ++n)
+        CHECK(Send(aClient[n % 2], { { "SLEEP", "300" } }, aResponse[n]) != 0);
+
+    uint32_t nCompleted = 0, nOverloaded = 0;
+    for (auto& Response : aResponse)
+    {
+        CHECK(Wait(Response) == true);
+        if (Response.nProtocolStatus == FCGI_REQUEST_COMPLETE && Response.nAppStatus == 7)
+            ++nCompleted;
+        else if (Response.nProtocolStatus == FCGI_OVERLOADED)
+            ++nOverloaded;
+    }
+    CHECK(nCompleted == 2);
+    CHECK(nOverloaded == 2);
+
+    RESPONSE After;     // The rejected requests are not counted anymore
+    CHECK(Send(aClient[0], { { "TOKEN", "c" } }, After) != 0);
+    CHECK(Wait(After) == true);
+    CHECK(After.strOutput == "1 0 c 0 0 1");
+
+    Server.Stop();
+    return true;
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+// This program started with --backend. Serves on the listening socket it got as FCGI_LISTENSOCK_FILENO, at most
+// two connections, the others stay in the queue for the processes sharing it. Answers with its pid until SIGTERM.
+static int Backend()
+{
+    if (FastCgiListener::HasInheritedListener() == false)
+        return 1;
+
+    sigset_t stSignals;     // Before the threads are started, they get the mask
+    sigemptyset(&stSignals);
+    sigaddset(&stSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stSignals, nullptr);
+
+    FastCgiServer Server("", 0, nullptr);
+    Server.SetRequestHandler([](const FastCgiParams&, ostream& streamOut, istream& streamIn) -> int
+    {
+        streamIn.ignore(numeric_limits<streamsize>::max());
+        streamOut << "Content-Type: text/plain\r\n\r\n" << getpid();
+        return 0;
+    });
+    Server.SetWorkerPool(2);
+    Server.SetLimits(2, 2);
+    if (Server.Start() == false)
+        return 1;
+
+    int nSignal = 0;
+    sigwait(&stSignals, &nSignal);
+    Server.Stop();
+    return 0;
+}
+
+// A request to a process started with --backend, its pid or an empty string
+static string GetBackendPid(FastCgiClient& Client)
+{
+    RESPONSE Response;
+    if (Send(Client, {}, Response) == 0 || Wait(Response) == false || Response.nProtocolStatus != FCGI_REQUEST_COMPLETE)
+        return string();
+    return Response.strOutput;
+}
+
+// The processes of a FastCgiProcessPool get a listening socket of their own, a process is replaced after 5 requests
+static bool ProcessPool(const uint16_t)
+{
+    FastCgiProcessPool Pool(s_strBackend, "127.0.0.1", 0, 2, 3);
+    Pool.SetRecycling(5);
+    CHECK(Pool.Start() == 2);
+
+    mutex mxPids;
+    set<string> setPids;
+    atomic<uint32_t> nFailed(0);
+    vector<thread> vThreads;
+    for (uint32_t nThread = 0; nThread < 3; ++nThread)
+    {
+        vThreads.emplace_back([&]()
+        {
+            for (uint32_t n = 0; n < 10;)
+            {
+                FastCgiClient* pClient = Pool.Acquire();
+                if (pClient == nullptr)     // All processes are busy
+                {
+                    this_thread::sleep_for(chrono::milliseconds(1));
+                    continue;
+                }
+                const string strPid = GetBackendPid(*pClient);
+                Pool.Release(pClient);
+                ++n;
+
+                lock_guard<mutex> lock(mxPids);
+                if (strPid.empty() == true)
+                    ++nFailed;
+                else
+                    setPids.insert(strPid);
+            }
+        });
+    }
+    for (auto& thClient : vThreads)
+        thClient.join();
+
+    CHECK(nFailed == 0);
+    CHECK(setPids.size() >= 6);     // 30 requests, 5 per process
+    CHECK(Pool.GetProcessCount() <= 3);
+    return true;
+}
+
+// Two processes started with the same listening socket share its accept queue. Each one takes two connections,
+// the others stay for the other one.
+static bool InheritedListener(const uint16_t)
+{
+    const shared_ptr<FastCgiListenSocket> spListenSocket = make_shared<FastCgiListenSocket>();
+    CHECK(spListenSocket->Open("127.0.0.1", 0) == true);
+
+    FastCgiClient aProcess[2] = { FastCgiClient(s_strBackend, spListenSocket), FastCgiClient(s_strBackend, spListenSocket) };
+    CHECK(aProcess[0].IsFcgiProcessActiv() == true);
+    CHECK(aProcess[1].IsFcgiProcessActiv() == true);
+
+    set<string> setPids;
+    {
+        FastCgiClient aClient[4];
+        for (auto& Client : aClient)
+        {
+            CHECK(Client.Connect(spListenSocket->GetAddress(), spListenSocket->GetPort()) == 1);
+            const string strPid = GetBackendPid(Client);
+            CHECK(strPid.empty() == false);
+            setPids.insert(strPid);
+        }
+    }
+    CHECK(setPids.size() == 2);
+    return true;
+}
+
+// The same requests over unix domain sockets, a path in the file system and a name in the abstract namespace of linux
+static bool UnixSocket(const uint16_t nPort)
+{
+    vector<string> vAddresses{ "unix:/tmp/fastcgi_test_" + to_string(nPort) + ".sock" };
+#if defined(__linux__)
+    vAddresses.push_back("unix:@fastcgi_test_" + to_string(nPort));
+#endif
+
+    for (const string& strAddress : vAddresses)
+    {
+        FastCgiServer Server(strAddress, 0, nullptr);
+        Server.SetRequestHandler(Handler);
+        Server.SetWorkerPool(4);
+        CHECK(Server.Start() == true);
+
+        FastCgiClient Client;
+        CHECK(Client.Connect(strAddress, 0) == 1);
+
+        for (uint32_t nRound = 0; nRound < 3; ++nRound)
+        {
+            RESPONSE aResponse[4];
+            for (uint32_t n = 0; n < 4; ++n)
+                CHECK(Send(Client, { { "TOKEN", to_string(n) }, { "BIG", BigValue(70000) } }, aResponse[n], string(100000 * n, 'u')) != 0);
+            for (uint32_t n = 0; n < 4; ++n)
+            {
+                CHECK(Wait(aResponse[n]) == true);
+                CHECK(aResponse[n].strOutput == "2 " + to_string(100000 * n) + " " + to_string(n) + " 0 70000 1");
+            }
+        }
+
+        Server.Stop();
+    }
+    return true;
+}
+#endif
+
+#if defined(__linux__)
+// The memfds of the shared memory connections in this process, client and server side
+static size_t CountShmFiles()
+{
+    size_t nCount = 0;
+    DIR* pDir = opendir("/proc/self/fd");
+    if (pDir == nullptr)
+        return 0;
+    while (const dirent* pEntry = readdir(pDir))
+    {
+        char caLink[256] = {};
+        if (readlink(("/proc/self/fd/" + string(pEntry->d_name)).c_str(), caLink, sizeof(caLink) - 1) > 0 && string(caLink).find("/memfd:fastcgi ") == 0)
+            ++nCount;
+    }
+    closedir(pDir);
+    return nCount;
+}
+
+// Offers a memfd without the seals, the answer of the server
+static char OfferUnsealed(const string& strPath)
+{
+    const int nSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un stAddr{};
+    stAddr.sun_family = AF_UNIX;
+    strncpy(stAddr.sun_path, strPath.c_str(), sizeof(stAddr.sun_path) - 1);
+    if (nSocket < 0 || connect(nSocket, reinterpret_cast<sockaddr*>(&stAddr), sizeof(stAddr)) != 0)
+    {
+        if (nSocket >= 0)
+            close(nSocket);
+        return 0;
+    }
+
+    static const char caOffer[8] = { 'F', 'C', 'G', 'I', 'S', 'H', 'M', '1' };
+    static const uint64_t nRingSize = 1024 * 1024;
+    int anFds[5] = { memfd_create("fastcgi_test", MFD_CLOEXEC), eventfd(0, EFD_CLOEXEC), eventfd(0, EFD_CLOEXEC), eventfd(0, EFD_CLOEXEC), eventfd(0, EFD_CLOEXEC) };
+    if (ftruncate(anFds[0], static_cast<off_t>(65536 + 2 * nRingSize)) == 0)
+    {   // A valid header, only the seals are missing
+        pwrite(anFds[0], caOffer, sizeof(caOffer), 0);
+        pwrite(anFds[0], &nRingSize, sizeof(nRingSize), sizeof(caOffer));
+    }
+
+    char caControl[CMSG_SPACE(sizeof(anFds))] = {};
+    iovec stData{ const_cast<char*>(caOffer), sizeof(caOffer) };
+    msghdr stMsg{};
+    stMsg.msg_iov = &stData;
+    stMsg.msg_iovlen = 1;
+    stMsg.msg_control = caControl;
+    stMsg.msg_controllen = sizeof(caControl);
+    cmsghdr* pCtrl = CMSG_FIRSTHDR(&stMsg);
+    pCtrl->cmsg_level = SOL_SOCKET;
+    pCtrl->cmsg_type = SCM_RIGHTS;
+    pCtrl->cmsg_len = CMSG_LEN(sizeof(anFds));
+    memcpy(CMSG_DATA(pCtrl), anFds, sizeof(anFds));
+
+    char cAnswer = 0;
+    pollfd stPoll{ nSocket, POLLIN, 0 };
+    if (sendmsg(nSocket, &stMsg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(caOffer)) || poll(&stPoll, 1, 1000) != 1 || recv(nSocket, &cAnswer, 1, 0) != 1)
+        cAnswer = 0;
+    for (const int nFd : anFds)
+        close(nFd);
+    close(nSocket);
+    return cAnswer;
+}
+
+// Records over the shared memory of a "shm:" connection. The uploads are larger than the rings, the answers
+// of all requests together too, several requests at a time. A memfd without the seals is not taken.
+static bool ShmTransport(const uint16_t nPort)
+{
+    const string strPath = "/tmp/fastcgi_test_" + to_string(nPort) + ".sock";
+    FastCgiServer Server("shm:" + strPath, 0, nullptr);
+    Server.SetRequestHandler(Handler);
+    Server.SetWorkerPool(4);
+    CHECK(Server.Start() == true);
+
+    {
+        FastCgiClient Client;
+        CHECK(Client.Connect("shm:" + strPath, 0) == 1);
+        CHECK(CountShmFiles() == 2);    // The server took the offer
+
+        for (uint32_t nRound = 0; nRound < 3; ++nRound)
+        {
+            RESPONSE aResponse[4];
+            for (uint32_t n = 0; n < 4; ++n)
+                CHECK(Send(Client, { { "TOKEN", to_string(n) }, { "STREAM", "100" } }, aResponse[n], string(600000 * n, 'u')) != 0);
+            for (uint32_t n = 0; n < 4; ++n)
+            {
+                CHECK(Wait(aResponse[n]) == true);
+                CHECK(aResponse[n].strOutput == "2 " + to_string(600000 * n) + " " + to_string(n) + " 0 0 1" + string(100000, 's'));
+            }
+        }
+    }
+    CHECK(WaitFor([]() { return CountShmFiles() == 0; }) == true);
+
+    CHECK(OfferUnsealed(strPath) == 'N');
+    CHECK(CountShmFiles() == 0);
+
+    Server.Stop();
+    return true;
+}
+#endif
+
+int main(int argc, const char* argv[])
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (argc == 2 && string(argv[1]) == "--backend")
+        return Backend();
+#endif
+
+    uint16_t nPort = 19100;
+    for (int n = 1; n < argc; ++n)
+    {
+        if (string(argv[n]) == "--port" && n + 1 < argc)
+            nPort = static_cast<uint16_t>(strtoul(argv[++n], nullptr, 10));
+        else
+        {
+            cerr << "unknown option " << argv[n] << endl;
+            return 1;
+        }
+    }
+    s_strBackend = L"\"" + wstring_convert<codecvt_utf8<wchar_t>, wchar_t>().from_bytes(argv[0]) + L"\" --backend";
+
+    static const struct { const char* szName; bool (*fnTest)(const uint16_t); } aTests[] =
+    {
+        { "client_pool", ClientPool },
+        { "large_params", LargeParams },
+        { "request_reuse", RequestReuse },
+        { "remove_while_receiving", RemoveWhileReceiving },
+        { "context_recycling", ContextRecycling },
+        { "abort_during_stdin", AbortDuringStdIn },
+        { "limits_overload", LimitsOverload },
+#if !defined(_WIN32) && !defined(_WIN64)
+        { "process_pool", ProcessPool },
+        { "inherited_listener", InheritedListener },
+        { "unix_socket", UnixSocket },
+#endif
+#if defined(__linux__)
+        { "shm_transport", ShmTransport },
+#endif
+    };
+
+    int nFailed = 0;
+    for (const auto& Test : aTests)
+    {
+        const bool bOk = Test.fnTest(nPort++);
+        cout << (bOk == true ? "ok   " : "FAIL ") << Test.szName << endl;
+        if (bOk == false)
+            ++nFailed;
+    }
+    return nFailed;
+}